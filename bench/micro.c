@@ -0,0 +1,289 @@
+// Microbenchmarks for the compiler's and the VM's hot functions. Each one is
+// warmed up, calibrated until a sample takes SAMPLE_NS, then sampled SAMPLES
+// times; the median, minimum and standard deviation of ns/op are reported.
+//
+// To build: gcc -O2 -pthread -o micro bench/micro.c -lm
+// To use:   ./micro [-s samples] [name filter]
+
+#define HW4_NO_MAIN
+#include "../hw4compiler.c"
+#include <math.h>
+
+#define SAMPLES 21
+#define SAMPLE_NS 2000000   // a sample runs for at least 2 ms
+#define STREAM 4096         // tokens, instructions or names a run walks over
+#define ALU_RUN 64          // ALU instructions per loop iteration
+
+typedef long long (*micro_fn)(long long reps, int param);
+
+volatile long long sink;
+char *filter = NULL;
+int samples = SAMPLES;
+char *identWords[] = { "x", "count", "beginning", "doit", "valid", "oddity",
+                       "w", "temp", "index", "readme", "endless", "total" };
+char lookupNames[STREAM][MAX_TYPE_LENGTH];
+int asCode[STREAM * 4];  // also holds the executionCycle() programs
+instruction aluCode[ALU_RUN + 3];
+vm_stack *microStack;
+
+double now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+// Runs fn with param, doubling its repetitions until a sample is long enough
+// (which also warms it up), then prints the statistics of the samples
+void micro(char *name, micro_fn fn, int param)
+{
+  double t0, t, ns[SAMPLES * 10], mean = 0, var = 0;
+  long long reps = 1, ops;
+  int i;
+
+  if (filter != NULL && strstr(name, filter) == NULL)
+    return;
+  while (1)
+  {
+    t0 = now_ns();
+    fn(reps, param);
+    t = now_ns() - t0;
+    if (t >= SAMPLE_NS)
+      break;
+    reps *= 2;
+  }
+  for (i = 0; i < samples; i++)
+  {
+    t0 = now_ns();
+    ops = fn(reps, param);
+    ns[i] = (now_ns() - t0) / ops;
+    mean += ns[i];
+  }
+  mean /= samples;
+  for (i = 0; i < samples; i++)
+    var += (ns[i] - mean) * (ns[i] - mean);
+  qsort(ns, samples, sizeof(double), compare_double);
+  printf("%-32s %10.2f %10.2f %9.1f%%\n", name, ns[samples / 2], ns[0],
+         (mean > 0) ? 100 * sqrt(var / samples) / mean : 0);
+}
+
+// isReserved() over the reserved words (param 0) or identifiers (param 1)
+long long micro_isReserved(long long reps, int param)
+{
+  long long r, hits = 0;
+  int i, n = (param == 0) ? 14 : 12;
+
+  for (r = 0; r < reps; r++)
+    for (i = 0; i < n; i++)
+      hits += isReserved((param == 0) ? reserved[i] : identWords[i]);
+  sink = hits;
+  return reps * n;
+}
+
+long long micro_whatType(long long reps, int param)
+{
+  long long r, sum = 0;
+  int i;
+
+  for (r = 0; r < reps; r++)
+    for (i = 0; i < 14; i++)
+      sum += whatType(reserved[i]);
+  sink = sum;
+  return reps * 14;
+}
+
+// position() with param symbols in the table, looking each of them up
+long long micro_position(long long reps, int param)
+{
+  long long r, sum = 0;
+
+  for (r = 0; r < reps; r++)
+    sum += position(lookupNames[r % param], param, 0);
+  sink = sum;
+  return reps;
+}
+
+long long micro_getNextToken(long long reps, int param)
+{
+  long long r, sum = 0;
+  int i;
+
+  for (r = 0; r < reps; r++)
+  {
+    listIndex = 0;
+    for (i = 0; i < STREAM; i++)
+      sum += getNextToken().type;
+  }
+  sink = sum;
+  return reps * STREAM;
+}
+
+long long micro_emit(long long reps, int param)
+{
+  long long r;
+  int i;
+
+  listIndex = 0;
+  for (r = 0; r < reps; r++)
+  {
+    gen->len = 0;
+    for (i = 0; i < STREAM; i++)
+      emit(1, i & 7, 0, i);
+  }
+  sink = gen->len;
+  return reps * STREAM;
+}
+
+long long micro_fetchCycle(long long reps, int param)
+{
+  instruction ir;
+  long long r, sum = 0;
+  int i;
+
+  for (r = 0; r < reps; r++)
+    for (i = 0; i < STREAM; i++)
+      sum += fetchCycle(asCode, &ir, i)->m;
+  sink = sum;
+  return reps * STREAM;
+}
+
+// vm_base() param static links down from the innermost of a chain of frames
+long long micro_vm_base(long long reps, int param)
+{
+  int *data_stack = microStack->slots, top = 1 + 4 * MAX_LEXI_LEVELS * 4;
+  long long r, sum = 0;
+
+  for (r = 0; r < reps; r++)
+    sum += vm_base(param, top, data_stack);
+  sink = sum;
+  return reps;
+}
+
+// Fills aluCode with two LITs, ALU_RUN copies of opcode op and a jump back
+// to the copies
+void alu_code(int op)
+{
+  int i;
+
+  aluCode[0] = (instruction){ 1, 1, 0, 7 };
+  aluCode[1] = (instruction){ 1, 2, 0, 3 };
+  for (i = 0; i < ALU_RUN; i++)
+    aluCode[2 + i] = (op == 1) ? (instruction){ 1, 0, 0, 5 } : (instruction){ op, 0, 1, 2 };
+  aluCode[2 + ALU_RUN] = (instruction){ 7, 0, 0, 2 };
+}
+
+// vm_run() on a loop of opcode param, with lit as the baseline
+long long micro_vm_run(long long reps, int param)
+{
+  vm_state vm;
+
+  alu_code(param);
+  vm_init(&vm, microStack);
+  vm.budget = reps * (ALU_RUN + 1);
+  vm_run(&vm, aluCode, ALU_RUN + 3);
+  sink = vm.reg[0];
+  return reps * (ALU_RUN + 1);
+}
+
+// executionCycle() on ALU_RUN * 4 copies of opcode param and a halt. Its
+// trace goes to /dev/null but is still formatted, and is part of the cost.
+long long micro_executionCycle(long long reps, int param)
+{
+  long long r;
+  int i, n = ALU_RUN * 4;
+
+  alu_code(param);
+  for (i = 0; i < n + 3; i++)
+  {
+    instruction ir = (i < 2) ? aluCode[i] : (i < n + 2) ? aluCode[2] : (instruction){ 11, 0, 0, 3 };
+    asCode[i * 4] = ir.op;
+    asCode[i * 4 + 1] = ir.r;
+    asCode[i * 4 + 2] = ir.l;
+    asCode[i * 4 + 3] = ir.m;
+  }
+  for (r = 0; r < reps; r++)
+    executionCycle(asCode);
+  return reps * (n + 3);
+}
+
+int main(int argc, char **argv)
+{
+  char name[64];
+  int i, sizes[] = { 16, 64, 256, 1024, 4096 };
+  int *data_stack;
+  token *t;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+      samples = atoi(argv[++i]);
+    else
+      filter = argv[i];
+  }
+  if (samples < 1 || samples > SAMPLES * 10)
+    samples = SAMPLES;
+
+  fpout = fopen("/dev/null", "w");
+  stackSlots = DEFAULT_STACK_SLOTS;
+  microStack = vm_stack_acquire(stackSlots);
+
+  // A symbol table of STREAM variables, a token stream of identifiers,
+  // numbers and symbols, and STREAM instructions for fetchCycle()
+  symbolCapacity = STREAM + 1;
+  symbol_table = calloc(symbolCapacity, sizeof(symbol));
+  listIndex = 0;
+  for (i = 1; i <= STREAM; i++)
+  {
+    sprintf(lookupNames[i - 1], "v%d", i);
+    strcpy(symbol_table[i].name, lookupNames[i - 1]);
+    symbol_table[i].kind = 2;
+    t = createToken((i % 3 == 0) ? identsym : (i % 3 == 1) ? numbersym : plussym,
+                    (i % 3 == 1) ? "42" : lookupNames[i - 1], 1);
+    list_add(t);
+    free(t);
+  }
+  for (i = 0; i < STREAM * 4; i++)
+    asCode[i] = i;
+
+  // A chain of frames whose static links each go one frame down
+  data_stack = microStack->slots;
+  for (i = 1; i <= 1 + 4 * MAX_LEXI_LEVELS * 4; i += 4)
+    data_stack[i + 1] = (i > 1) ? i - 4 : 1;
+
+  printf("%-32s %10s %10s %10s\n", "benchmark", "median ns", "min ns", "stddev");
+  micro("isReserved reserved", micro_isReserved, 0);
+  micro("isReserved identifier", micro_isReserved, 1);
+  micro("whatType", micro_whatType, 0);
+  for (i = 0; i < 5; i++)
+  {
+    sprintf(name, "position %d symbols", sizes[i]);
+    micro(name, micro_position, sizes[i]);
+  }
+  micro("getNextToken", micro_getNextToken, 0);
+  micro("emit", micro_emit, 0);
+  micro("fetchCycle", micro_fetchCycle, 0);
+  for (i = 0; i <= MAX_LEXI_LEVELS; i++)
+  {
+    sprintf(name, "vm_base depth %d", i);
+    micro(name, micro_vm_base, i);
+  }
+  for (i = 1; i <= 24; i = (i == 1) ? 12 : i + 1)
+  {
+    sprintf(name, "vm_run %s", opNames[i]);
+    micro(name, micro_vm_run, i);
+  }
+  for (i = 1; i <= 24; i = (i == 1) ? 12 : i + 1)
+  {
+    sprintf(name, "executionCycle %s", opNames[i]);
+    micro(name, micro_executionCycle, i);
+  }
+  return 0;
+}
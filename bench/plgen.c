@@ -0,0 +1,376 @@
+// Generates random, valid PL/0 programs for the benchmarks. Every program
+// terminates: procedures only call procedures whose bodies were finished
+// before theirs, every loop counts up to a constant, and every assignment is
+// reduced modulo 1000 so no expression can overflow. A procedure makes at
+// most one call, so the instructions run grow with the number of procedures
+// rather than exponentially; --inner multiplies them along call chains.
+//
+// To build: gcc -O2 -o plgen plgen.c
+// To use:   ./plgen [--seed n] [--depth n] [--procs n] [--vars n]
+//                   [--stmts n] [--expr n] [--trips n] [--inner n] > prog.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEXI_LEVELS 3
+#define MAX_PROCS 4096
+#define MAX_VARS 64
+#define MAX_CONSTANT 99
+
+typedef struct
+{
+  int id;         // number in the names of the block's procedure and vars
+  int level;      // lexicographical level, 0 for the main block
+  int vars;       // variables declared by the block
+  int parent;     // index of the enclosing block, -1 for the main block
+} block_info;
+
+block_info blocks[MAX_PROCS];
+int done[MAX_PROCS], doneCount = 0; // procedures whose bodies are finished
+int blockCount = 0, column = 0, callsLeft = 0;
+unsigned long long rng;
+
+int depth = 2, procs = 2, vars = 4, stmts = 6, expr = 3, trips = 100, inner = 0;
+
+void block(int b);
+
+// xorshift, so a seed gives the same program on every platform
+int random_below(int n)
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (int)(rng % (unsigned long long)n);
+}
+
+// Prints one token, breaking lines at about 80 columns
+void put(char *str)
+{
+  int len = strlen(str);
+
+  if (column + len + 1 > 80)
+  {
+    printf("\n");
+    column = 0;
+  }
+  printf("%s%s", (column > 0) ? " " : "", str);
+  column += len + 1;
+}
+
+void put_name(char c, int id, int n)
+{
+  char name[16];
+
+  sprintf(name, "%c%dx%d", c, id, n);
+  put(name);
+}
+
+void put_number(int n)
+{
+  char str[16];
+
+  sprintf(str, "%d", n);
+  put(str);
+}
+
+// Prints a variable visible from block b: its own or an ancestor's, but not
+// the loop counter, which is the last variable of every block
+void put_var(int b)
+{
+  int up = random_below(blocks[b].level + 1);
+
+  while (up-- > 0)
+    b = blocks[b].parent;
+  put_name('v', blocks[b].id, random_below(blocks[b].vars - 1));
+}
+
+// Prints a variable as above, a constant or a parenthesized sum
+void factor(int b)
+{
+  int pick = random_below(4);
+
+  if (pick == 0)
+  {
+    put("(");
+    put_var(b);
+    put("+");
+    put_number(random_below(MAX_CONSTANT + 1));
+    put(")");
+  }
+  else if (pick == 1)
+    put_number(random_below(MAX_CONSTANT + 1));
+  else
+    put_var(b);
+}
+
+// Prints an expression of terms terms. Products are of a variable and a
+// constant, or of two variables, and divisions are by constants only, so
+// with every variable below 1000 the value stays far from overflowing.
+void expression(int b, int terms)
+{
+  int i;
+
+  for (i = 0; i < terms; i++)
+  {
+    if (i > 0)
+      put(random_below(2) ? "+" : "-");
+    factor(b);
+    switch (random_below(4))
+    {
+      case 0: put("*");
+        put_number(1 + random_below(9));
+        break;
+      case 1: put("/");
+        put_number(1 + random_below(9));
+        break;
+      case 2: put("*");
+        put_var(b);
+        break;
+    }
+  }
+}
+
+// Prints v := e; v := v - v / 1000 * 1000
+void assignment(int b)
+{
+  int up = random_below(blocks[b].level + 1), t = b, n;
+
+  while (up-- > 0)
+    t = blocks[t].parent;
+  n = random_below(blocks[t].vars - 1);
+  put_name('v', blocks[t].id, n);
+  put(":=");
+  expression(b, 1 + random_below(expr));
+  put(";");
+  put_name('v', blocks[t].id, n);
+  put(":=");
+  put_name('v', blocks[t].id, n);
+  put("-");
+  put_name('v', blocks[t].id, n);
+  put("/");
+  put("1000");
+  put("*");
+  put("1000");
+}
+
+// Prints a call to a procedure finished before block b started its body and
+// visible from it, or an assignment when there is none
+void call(int b)
+{
+  int i, p, visible[MAX_PROCS], count = 0;
+
+  for (i = 0; i < doneCount; i++)
+  {
+    // A procedure is visible if its parent is b or one of b's ancestors
+    for (p = b; p >= 0; p = blocks[p].parent)
+    {
+      if (blocks[done[i]].parent == p)
+      {
+        visible[count++] = done[i];
+        break;
+      }
+    }
+  }
+  if (count == 0 || callsLeft == 0)
+  {
+    assignment(b);
+    return;
+  }
+  callsLeft--;
+  put("call");
+  put_name('p', blocks[visible[random_below(count)]].id, 0);
+}
+
+// Prints a statement: mostly assignments, with ifs and calls
+void statement(int b)
+{
+  switch (random_below(6))
+  {
+    case 0:
+      put("if");
+      if (random_below(4) == 0)
+      {
+        put("odd");
+        put_var(b);
+      }
+      else
+      {
+        // The compiler does not take = as a relation
+        expression(b, 1 + random_below(expr));
+        put((char *[]){ "<>", "<", "<=", ">", ">=" }[random_below(5)]);
+        expression(b, 1 + random_below(expr));
+      }
+      put("then");
+      put("begin");
+      assignment(b);
+      put("end");
+      if (random_below(2))
+      {
+        put("else");
+        assignment(b);
+      }
+      break;
+    case 1:
+      call(b);
+      break;
+    default:
+      assignment(b);
+  }
+}
+
+// Prints a loop running count times around stmts statements
+void loop(int b, int count)
+{
+  int i, id = blocks[b].id, counter = blocks[b].vars - 1;
+
+  put_name('v', id, counter);
+  put(":=");
+  put("0");
+  put(";");
+  put("while");
+  put_name('v', id, counter);
+  put("<");
+  put_number(count);
+  put("do");
+  put("begin");
+  for (i = 0; i < stmts; i++)
+  {
+    statement(b);
+    put(";");
+  }
+  put_name('v', id, counter);
+  put(":=");
+  put_name('v', id, counter);
+  put("+");
+  put("1");
+  put("end");
+}
+
+// Declares the variables and procedures of block b, then prints its body
+void block(int b)
+{
+  int i, child;
+
+  put("var");
+  for (i = 0; i < blocks[b].vars; i++)
+  {
+    put_name('v', blocks[b].id, i);
+    put((i + 1 < blocks[b].vars) ? "," : ";");
+  }
+  printf("\n");
+  column = 0;
+
+  for (i = 0; blocks[b].level < depth && i < procs && blockCount < MAX_PROCS; i++)
+  {
+    child = blockCount++;
+    blocks[child].id = child;
+    blocks[child].level = blocks[b].level + 1;
+    blocks[child].vars = 2 + random_below(vars);
+    blocks[child].parent = b;
+    put("procedure");
+    put_name('p', child, 0);
+    put(";");
+    printf("\n");
+    column = 0;
+    block(child);
+    put(";");
+    printf("\n");
+    column = 0;
+    done[doneCount++] = child;
+  }
+
+  // Variables start at zero in the main block only, so procedures set theirs
+  callsLeft = (b == 0) ? -1 : 1;
+  put("begin");
+  for (i = 0; i < blocks[b].vars - 1; i++)
+  {
+    put_name('v', blocks[b].id, i);
+    put(":=");
+    put_number(random_below(MAX_CONSTANT + 1));
+    put(";");
+  }
+  if (b == 0)
+  {
+    loop(b, trips);
+    for (i = 0; i < blocks[b].vars - 1; i++)
+    {
+      put(";");
+      put("write");
+      put_name('v', blocks[b].id, i);
+    }
+  }
+  else if (inner > 0)
+    loop(b, inner);
+  else
+  {
+    for (i = 0; i < stmts; i++)
+    {
+      if (i > 0)
+        put(";");
+      statement(b);
+    }
+  }
+  put("end");
+}
+
+int main(int argc, char **argv)
+{
+  int i;
+  unsigned long long seed = 1;
+
+  for (i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--seed") == 0)
+      seed = strtoull(argv[i + 1], NULL, 10);
+    else if (strcmp(argv[i], "--depth") == 0)
+      depth = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--procs") == 0)
+      procs = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--vars") == 0)
+      vars = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--stmts") == 0)
+      stmts = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--expr") == 0)
+      expr = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--trips") == 0)
+      trips = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--inner") == 0)
+      inner = atoi(argv[i + 1]);
+    else
+      break;
+  }
+  if (i < argc)
+  {
+    fprintf(stderr, "Usage: %s [--seed n] [--depth n] [--procs n] [--vars n] [--stmts n] [--expr n] [--trips n] [--inner n]\n", argv[0]);
+    return 1;
+  }
+
+  // Numbers are at most 5 digits and loop bounds at most 2047, like the
+  // compiler's literals
+  if (depth > MAX_LEXI_LEVELS)
+    depth = MAX_LEXI_LEVELS;
+  if (vars > MAX_VARS)
+    vars = MAX_VARS;
+  if (vars < 1)
+    vars = 1;
+  if (stmts < 1)
+    stmts = 1;
+  if (expr < 1)
+    expr = 1;
+  if (trips > 2047)
+    trips = 2047;
+  if (inner > 2047)
+    inner = 2047;
+
+  rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+  blocks[0].id = 0;
+  blocks[0].level = 0;
+  blocks[0].vars = 1 + vars;
+  blocks[0].parent = -1;
+  blockCount = 1;
+  block(0);
+  put(".");
+  printf("\n");
+  return 0;
+}
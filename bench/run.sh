@@ -0,0 +1,118 @@
+#!/bin/sh
+# Runs the end-to-end benchmarks: builds the compiler and plgen, generates a
+# program for every configuration below and times it with --timings, keeping
+# the best of a few runs of each phase. Writes one JSON document with
+# lexing MB/s, parsing tokens/s, codegen instructions/s and VM instructions/s
+# per benchmark, one benchmark per line so two runs can be compared.
+#
+# To use: bench/run.sh [-n repeats] [-o results.json]
+#         bench/run.sh --compare old.json new.json
+
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+repeats=3
+out=
+
+# name and plgen arguments of every benchmark
+configs='
+small   --depth 1 --procs 2 --vars 4 --stmts 10 --trips 2000
+wide    --depth 1 --procs 400 --vars 40 --stmts 20 --trips 10
+deep    --depth 3 --procs 6 --vars 8 --stmts 30 --trips 200
+exprs   --depth 2 --procs 8 --vars 8 --stmts 40 --expr 10 --trips 200
+loops   --depth 2 --procs 3 --vars 6 --stmts 8 --trips 500 --inner 40
+'
+
+metric()
+{
+  sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p" "$1"
+}
+
+if [ "$1" = "--compare" ]
+then
+  if [ $# -ne 3 ]
+  then
+    echo "Usage: $0 --compare old.json new.json" >&2
+    exit 1
+  fi
+  printf '%-8s %-24s %14s %14s %8s\n' benchmark metric old new ratio
+  grep '"name"' "$3" | while read -r line
+  do
+    name=$(echo "$line" | sed 's/.*"name": "\([^"]*\)".*/\1/')
+    old=$(grep "\"name\": \"$name\"" "$2" || true)
+    [ -n "$old" ] || continue
+    for m in lex_mb_s parse_tokens_s codegen_instructions_s vm_instructions_s
+    do
+      a=$(echo "$old" | sed -n "s/.*\"$m\": \([0-9.]*\).*/\1/p")
+      b=$(echo "$line" | sed -n "s/.*\"$m\": \([0-9.]*\).*/\1/p")
+      awk -v n="$name" -v m="$m" -v a="$a" -v b="$b" 'BEGIN {
+        printf "%-8s %-24s %14.1f %14.1f %8s\n", n, m, a, b, (a > 0) ? sprintf("%.3f", b / a) : "-" }'
+    done
+  done
+  exit 0
+fi
+
+while [ $# -gt 0 ]
+do
+  case "$1" in
+    -n) repeats=$2; shift 2 ;;
+    -o) out=$2; shift 2 ;;
+    *) echo "Usage: $0 [-n repeats] [-o results.json] | --compare old.json new.json" >&2; exit 1 ;;
+  esac
+done
+if [ -z "$out" ]
+then
+  mkdir -p "$bench/results"
+  out="$bench/results/$(date +%Y%m%d-%H%M%S).json"
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+gcc -O2 -pthread -o "$work/hw4compiler" "$bench/../hw4compiler.c"
+gcc -O2 -o "$work/plgen" "$bench/plgen.c"
+
+{
+  printf '{\n  "commit": "%s",\n  "date": "%s",\n  "host": "%s",\n  "repeats": %d,\n  "benchmarks": [\n' \
+    "$(git -C "$bench" rev-parse --short HEAD 2>/dev/null || echo unknown)" \
+    "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)" "$repeats"
+  first=1
+  echo "$configs" | while read -r name args
+  do
+    [ -n "$name" ] || continue
+    # shellcheck disable=SC2086
+    "$work/plgen" $args > "$work/$name.txt"
+    "$work/hw4compiler" "$work/$name.txt" "$work/out.txt" --stats "$work/stats.json" > /dev/null
+    executed=$(metric "$work/stats.json" instructions)
+
+    i=0
+    : > "$work/times"
+    while [ $i -lt "$repeats" ]
+    do
+      "$work/hw4compiler" "$work/$name.txt" "$work/out.txt" -r --timings > "$work/timings"
+      cat "$work/timings" >> "$work/times"
+      i=$((i + 1))
+    done
+
+    [ $first -eq 1 ] || printf ',\n'
+    first=0
+    awk -v name="$name" -v args="$args" -v executed="$executed" '
+      function best(phase, ms) { if (!(phase in t) || ms < t[phase]) t[phase] = ms }
+      function rate(count, ms) { return (ms > 0) ? count / (ms / 1000) : 0 }
+      $1 == "lex" { best("lex", $2) }
+      $1 == "parse+codegen" { best("parse", $2) }
+      $1 == "execute" { best("execute", $2) }
+      /^source bytes/ { bytes = $3 }
+      /^tokens/ { tokens = $2 }
+      /^instructions emitted/ { emitted = $3 }
+      END {
+        printf "    { \"name\": \"%s\", \"args\": \"%s\", \"source_bytes\": %d, \"tokens\": %d, ", name, args, bytes, tokens
+        printf "\"instructions_emitted\": %d, \"instructions_executed\": %d, ", emitted, executed
+        printf "\"lex_ms\": %.3f, \"parse_ms\": %.3f, \"execute_ms\": %.3f, ", t["lex"], t["parse"], t["execute"]
+        printf "\"lex_mb_s\": %.2f, \"parse_tokens_s\": %.0f, ", rate(bytes, t["lex"]) / 1e6, rate(tokens, t["parse"])
+        printf "\"codegen_instructions_s\": %.0f, \"vm_instructions_s\": %.0f }", rate(emitted, t["parse"]), rate(executed, t["execute"])
+      }' "$work/times"
+  done
+  printf '\n  ]\n}\n'
+} > "$out"
+
+cat "$out"
@@ -14,14 +14,42 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sched.h>
 
 #define MAX_DATA_STACK_HEIGHT 40
 #define MAX_IDENT_LENGTH 11
 #define MAX_NUM_LENGTH 5
+#define LEX_CHUNK_MIN (1 << 16)  // bytes of source in a chunk lexed in parallel
+#define TOKEN_RING_SIZE 4096     // tokens, a power of two
+#define CODEGEN_MIN_TOKENS (1 << 15) // tokens in a program compiled in parallel
+#define TOKEN_LINE_MAX 0xffffff  // lines a token tells apart, the last for the rest
+#define INTERN_BLOCK 4096        // names in each block of an intern table
+#define INTERN_BLOCKS 16384      // blocks an intern table has room for
 #define MAX_CODE_LENGTH 550
 #define MAX_SYMBOL_TABLE_SIZE 500
 #define MAX_LEXI_LEVELS 3
 #define MAX_TYPE_LENGTH 13
+#define MAX_REGISTERS 8
+#define LANES 8
+#define PHASE_COUNT 6
+#define TRACE_OVERFLOW (-2) // op of the trace record ending an overflowed run
+#define TRACE_SYNC (-3)     // op of the trace record resuming after a gap
+#define TRACE_STACK (-4)    // op of the trace records carrying the stack then
+#define PROMOTE_CANDIDATES 64 // variables of a loop promote_vars() counts uses of
 
 typedef enum
 {
@@ -33,12 +61,36 @@ typedef enum
   varsym = 29, procsym = 30, writesym = 31, readsym = 32 , elsesym = 33
 } token_type;
 
+// A lexeme in 8 bytes: val is the intern ID of an identifier's name or the
+// value of a number. A number not written as its value would print (with
+// leading zeros, or too many digits) is interned instead and spelled set.
 typedef struct
 {
-  token_type type;
-  char str[MAX_TYPE_LENGTH];
+  unsigned int type : 7;     // token_type
+  unsigned int spelled : 1;
+  unsigned int line : 24;    // source line the token is on
+  int val;
 }token;
 
+// A slot of an intern table's hash: a name padded with zeros, so that one
+// load finds and compares it, and its ID + 1, or 0 if the slot is free
+typedef struct
+{
+  char name[MAX_TYPE_LENGTH - 1];
+  int id;
+} intern_slot;
+
+// Names by intern ID, 0 being the empty name. The blocks never move once
+// allocated, so with --stream the parser reads the names of the tokens it
+// was handed while the lexer interns more.
+typedef struct
+{
+  char (**blocks)[MAX_TYPE_LENGTH];
+  int count;
+  intern_slot *slots;
+  int mask;
+} intern_table;
+
 typedef struct
 {
   int op;
@@ -47,6 +99,43 @@ typedef struct
   int m;
 }instruction;
 
+// One chunk of the source for the lexer: code[start, end), whose first line
+// is line, and the tokens and lexical errors found in it
+typedef struct
+{
+  char *code;
+  int start, end, line, lines;
+  token *tokens;
+  int len, cap, first;    // first is where the tokens go in the list
+  intern_table *names;    // where the names of its tokens are interned
+  int *remap;             // intern IDs of those names in internTable
+  int *errors, error_len, error_cap;
+  long long strcmps;      // strcmp() calls of the worker, for --timings
+  struct token_ring *ring; // with --stream, where the tokens go instead
+} lex_chunk;
+
+// Ring of tokens from the lexer thread to the parser with --stream. tail
+// counts tokens ever published and head the tokens the parser is done with;
+// it keeps the two before the next one, whose lines emit() looks up.
+typedef struct token_ring
+{
+  token *slots;
+  _Alignas(64) long long head;
+  _Alignas(64) long long tail;
+  _Alignas(64) bool done;
+  lex_chunk chunk;
+  pthread_t thread;
+} token_ring;
+
+// Chunks shared by the lexer's workers, which take the next one until none
+// are left: to lex them, then to copy their tokens once joining
+typedef struct
+{
+  lex_chunk *chunks;
+  int n, next;
+  bool joining;
+} lex_job;
+
 typedef struct
 {
   int kind; // const = 1, var = 2, proc = 3
@@ -56,14 +145,361 @@ typedef struct
   int addr; // M
 } symbol;
 
+// Code as the parser emits it, with the source line and procedure of each
+// instruction. The main thread's becomes ins, insLine and insProc once the
+// program is compiled; a codegen worker emits a procedure body into its own.
+typedef struct
+{
+  instruction *ins;
+  int *line, *proc;
+  int len, cap;
+} code_buffer;
+
+// Symbol table entries a block entered, in order
+typedef struct
+{
+  int *entries;
+  int len, cap;
+} entry_list;
+
+// A procedure body block() left to the codegen workers: its tokens, from
+// start to the one ending it, where its code goes among block()'s, and the
+// entries it sees: the first scope_len entered by its procedure and each
+// ancestor (scope_proc, by level). The last of an ancestor's is the next
+// procedure in, which had scope_addr then, before it was finished.
+typedef struct
+{
+  int start, end, at, base;
+  int proc, level;
+  int scope_proc[MAX_LEXI_LEVELS + 1], scope_len[MAX_LEXI_LEVELS + 1];
+  int scope_addr[MAX_LEXI_LEVELS + 1];
+  code_buffer code;
+  int errors;
+  bool ok;                // compiled without errors, ending at end
+} body_job;
+
+// Bodies shared by the codegen workers, which take the next one until none
+// are left: to compile them, with the symbol table of the main thread and
+// the entries of each procedure's block, then to copy them into out once
+// joining, with map giving where each of block()'s instructions went
+typedef struct
+{
+  body_job *bodies;
+  int n, cap, next;
+  bool joining;
+  symbol *symbols;
+  entry_list *scopes;
+  int scope_cap;
+  code_buffer out;
+  int *map;
+  long long probes, strcmps;
+} codegen_job;
+
+// An innermost while loop, from its header to the JMP back to it, and the
+// variables promote_vars() keeps in registers while it runs: var_l and var_m
+// name each as its LODs do, reg holds it, and stored is set if the loop
+// writes it. held marks the registers holding one.
+typedef struct
+{
+  int head, back;
+  int vars, stores;
+  int var_l[MAX_REGISTERS], var_m[MAX_REGISTERS], reg[MAX_REGISTERS];
+  bool stored[MAX_REGISTERS], held[MAX_REGISTERS];
+} reg_loop;
+
+// A VM data stack mapped between two guard pages
+typedef struct vm_stack
+{
+  int *slots;
+  size_t size;    // usable slots
+  size_t mapped;  // bytes mapped, guards included
+  struct vm_stack *next, *all_next;
+} vm_stack;
+
+// State of one virtual machine. pc is the index of the next instruction to
+// execute; halted is 0 while running, 1 after SIO halt, -1 if control left
+// the program, -2 on stack overflow and -3 when the scheduler stopped it.
+typedef struct
+{
+  int pc, bp, sp, halted;
+  int reg[MAX_REGISTERS];
+  int *data_stack;
+  vm_stack *stack;
+  // Program I/O is captured into these arrays instead of using the console
+  bool capture;
+  int *input, input_len, input_pos;
+  int *output, output_len, output_cap;
+  bool input_open, blocked; // more input may come; a read is waiting for it
+  long long budget;       // instructions vm_run may still execute
+  long long *counts;      // executions of each pc, or NULL when not counting
+  int depth, max_depth, max_sp;
+  struct loop_jit *loops; // hot loop traces, NULL when loops are not traced
+} vm_state;
+
+// Backward jump counters and compiled loop traces, indexed by loop header pc
+typedef struct loop_jit
+{
+  int *counts;
+  struct loop_trace **traces;
+  int n;
+} loop_jit;
+
+// Native code produced by the JIT for a whole program
+typedef struct
+{
+  unsigned char *mem;
+  size_t size;
+  void **targets; // native address of each instruction
+  int n;
+} jit_code;
+
+// One line of a --batch input file and the values the program wrote for it
+typedef struct
+{
+  int *input, input_len;
+  int *output, output_len;
+  int halted;
+} batch_run;
+
+// Runs shared by the workers of a batch. next is the first run no worker
+// has taken yet; workers take chunk runs at a time.
+typedef struct
+{
+  batch_run *runs;
+  int n, next, chunk;
+  bool lanes;
+  jit_code *jc;
+  size_t slots;
+} batch_job;
+
+// A vector of one int per lane, for the SPMD interpreter (--lanes)
+typedef int lane_int __attribute__((vector_size(LANES * sizeof(int))));
+typedef unsigned lane_uint __attribute__((vector_size(LANES * sizeof(int))));
+
+// LANES virtual machines running the same program in lockstep. The active
+// lanes are at pc; parked lanes wait at their own pc in lane_pc.
+typedef struct
+{
+  lane_int reg[MAX_REGISTERS];
+  lane_int bp, sp;
+  lane_int mask;     // all ones on the active lanes
+  int pc, park_min;  // park_min is the lowest pc of a parked lane
+  unsigned active, parked;
+  int lane_pc[LANES], halted[LANES];
+  int *stack;        // slot s of lane k is stack[s * LANES + k]
+  batch_run *runs[LANES];
+  int input_pos[LANES], output_cap[LANES];
+} lane_vm;
+
+// Program input for SIO read, read from fd in blocks
+typedef struct
+{
+  int fd;
+  bool prompt, eof;
+  char *buf;
+  size_t len, pos;
+  long long consumed; // values read so far
+} io_input;
+
+// Header of a checkpoint file (see checkpoint_save), followed by the live
+// slots of the data stack
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t program;
+  int32_t pc, bp, sp, halted;
+  int32_t reg[MAX_REGISTERS];
+  int64_t executed, values_read, output_offset;
+  int32_t live;
+} checkpoint_header;
+
+// Program output for SIO write, flushed to fpout
+typedef struct
+{
+  char *buf;
+  size_t len;
+} io_output;
+
+// One VM instance run by the scheduler (--sched). Values for its reads that
+// arrive while it runs wait in pending.
+typedef enum
+{
+  TASK_READY, TASK_RUNNING, TASK_BLOCKED, TASK_DONE
+} task_state;
+
+typedef struct sched_task
+{
+  vm_state vm;
+  int id, input_cap;
+  task_state state;
+  long long executed;
+  int *pending, pending_len, pending_cap;
+  struct sched_task *next; // next in the ready queue
+} sched_task;
+
+typedef struct
+{
+  sched_task *tasks;
+  int n, done;
+  sched_task *head, *tail; // ready queue
+  bool input_open;
+  long long slice, limit;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} scheduler;
+
+// A folded call stack ("main;a;b") and how many samples had it
+typedef struct
+{
+  char *stack;
+  long count;
+} folded_stack;
+
+// Samples collected by the profiler (--profile)
+typedef struct
+{
+  long samples;
+  long *pc_samples, *line_samples; // by pc and by source line
+  long *self, *total;              // by procedure: at the top, anywhere on the stack
+  int lines;
+  bool *seen;
+  char *stack;
+  folded_stack *folded;            // hash table of folded stacks
+  size_t folded_cap, folded_len, folded_last;
+} profile;
+
+// One instruction of the -v trace: the pc it ran at, the instruction, and
+// the registers after it
+typedef struct
+{
+  int32_t pc, op, r, l, m;
+  int32_t next_pc, bp, sp;
+  int32_t reg[MAX_REGISTERS];
+} trace_record;
+
+// What a trace renderer keeps between records: its copy of the data stack
+typedef struct
+{
+  int *stack;
+  size_t slots;
+  int top;              // slots below top may have been written
+  int bp, activate;
+} trace_shadow;
+
+// Where a keyframe of a trace file is
+typedef struct
+{
+  uint64_t step, offset;
+} trace_key;
+
+// Writes a --trace-file: the state after the last step encoded, and where
+// the last keyframe was
+typedef struct
+{
+  FILE *fp;
+  uint8_t buf[1 << 16];
+  size_t len;
+  uint64_t offset, steps;       // bytes and steps written so far
+  uint64_t key_offset, key_step, key_size;
+  trace_key *keys;
+  size_t keys_len, keys_cap;
+  int32_t next_pc, bp, sp, reg[MAX_REGISTERS];
+} trace_encoder;
+
+// Reads a trace file: the state after the last step decoded
+typedef struct
+{
+  FILE *fp;
+  uint8_t buf[1 << 16];
+  size_t len, pos;
+  bool bad;
+  int *code, n;         // the program, from the header
+  uint64_t start;       // offset of the first step
+  trace_key *keys;
+  size_t keys_len;
+  trace_shadow shadow;
+  uint64_t step, skipped;  // steps decoded, and left out before the next one
+  int32_t next_pc, bp, sp, reg[MAX_REGISTERS];
+} trace_reader;
+
+// Ring of trace records from the VM to the writer thread. head and tail
+// count records ever taken and published, and sit on their own cache lines.
+typedef struct
+{
+  trace_record *slots;
+  _Alignas(64) uint64_t head;
+  _Alignas(64) uint64_t tail;
+  _Alignas(64) bool done;
+  trace_encoder *enc;   // the --trace-file, or NULL to format into fpout
+  trace_shadow shadow;
+  uint64_t steps;       // steps run before the next record taken
+  // With --trace-last, the records of the last steps, kept until the VM is
+  // done, and the state before the first of them
+  trace_record *kept;
+  uint64_t kept_head, kept_tail, kept_cap, kept_steps;
+  trace_shadow snap;
+  trace_record snap_last;
+  uint64_t snap_steps;
+  pthread_t thread;
+} trace_ring;
+
+// Which steps -v traces: those of instructions in the pc ranges or the
+// procedures (all if there are none), then only the first steps, every
+// every-th step, and of those only the last ones (0 when unlimited)
+typedef struct
+{
+  int (*ranges)[2];
+  int range_count;
+  char **procs;
+  int proc_count;
+  long long first, every, last;
+} trace_filter;
+
+// Start of a --trace-file, followed by the code and the steps
+typedef struct
+{
+  char magic[4];
+  int32_t version, code_len;
+  uint64_t slots;       // size of the traced VM's stack
+} trace_file_header;
+
+// End of a trace file, after the index of keyframes
+typedef struct
+{
+  uint64_t index_offset, keys;
+  char magic[8];
+} trace_file_footer;
+
 token_type whatType(char *str);
 bool isReserved(char *str);
 bool isSymbol(char symbol);
 void print_token(int tokenRep);
 void print_error(int errorNum);
+void list_add(token *t);
+void lex_add(lex_chunk *c, token_type t, char *str, int line);
+void lex_error(lex_chunk *c, int errorNum);
+void lex_range(lex_chunk *c);
+void *lex_worker(void *arg);
+void lex_run(lex_job *job, int threads);
+void token_stream_start(char *code);
+void token_push(token_ring *tr, token t);
+int intern(intern_table *it, char *name);
+void intern_free(intern_table *it);
+token token_make(intern_table *names, token_type t, char *str, int line);
+bool token_wait();
+void token_release();
+int token_stream_finish();
 void enter(int k, int* ptableIndex, int* pdataindex, int level);
 void block(int level, int tableIndex);
-void emit(int op, int l, int m);
+void body_defer(int level, int proc);
+void *codegen_worker(void *arg);
+void codegen_run(codegen_job *cg, int threads);
+bool codegen_link(codegen_job *cg, int threads);
+void body_compile(codegen_job *cg, body_job *b, symbol **view, int *cap);
+void code_publish();
+int lazy_compile(int k, int caller);
+void emit(int op, int r, int l, int m);
 void statement(int lev, int *ptx);
 void expression(int lev, int *ptx);
 void condition(int level, int* ptableindex);
@@ -74,40 +510,329 @@ instruction *create_instruction(int op, int r, int l, int m);
 instruction *fetchCycle(int *as_code, instruction *ir, int pc);
 void executionCycle(int *as_code);
 int vm_base(int l, int vm_base, int* data_stack);
+void super_output(int pc, int bp, int sp, int data_stack[], int reg[], int activate);
+trace_ring *trace_start(int *code, int n, size_t slots);
+void trace_push(trace_ring *tr, int pc, instruction *ir, int next_pc, int bp, int sp, int *reg);
+void trace_push_sync(trace_ring *tr, int pc, long long steps, int activate, int bp, int sp, int *reg, int *data_stack, int top);
+void trace_finish(trace_ring *tr);
+char *trace_mask(int n);
+void trace_window(long long steps, long long *start, long long *end);
+int trace_replay(trace_shadow *sh, trace_record *t, int *slots);
+void trace_print(trace_shadow *sh, trace_record *t);
+void trace_encode(trace_encoder *e, trace_shadow *sh, trace_record *t);
+trace_reader *trace_open(char *path);
+void trace_close(trace_reader *rd);
+void trace_read_keyframe(trace_reader *rd);
+bool trace_read_step(trace_reader *rd, trace_record *t);
+bool trace_render_file(char *path);
+bool trace_state_at(char *path, uint64_t step);
+void timings_open();
+void phase_begin(int id);
+void phase_end();
+void timings_report();
+void vm_init(vm_state *vm, vm_stack *stack);
+vm_stack *vm_stack_acquire(size_t slots);
+void vm_stack_clear(vm_stack *s);
+void vm_stack_release(vm_stack *s);
+size_t vm_stack_slots();
+size_t stack_depth(instruction *code, int n);
+void light_calls(instruction *code, int *proc, int n, int procs);
+void tail_calls(instruction *code, int n);
+void promote_vars(code_buffer *c);
+void vm_execute(vm_state *vm, instruction *code, int n, jit_code *jc);
+void vm_run(vm_state *vm, instruction *code, int n);
+bool io_open(char *path);
+bool io_read_int(int *value);
+int io_read();
+void io_write(int value);
+void io_flush();
+int vm_read(vm_state *vm);
+void vm_write(vm_state *vm, int value);
+jit_code *jit_compile(instruction *code, int n);
+void jit_run(jit_code *jc, vm_state *vm);
+void jit_free(jit_code *jc);
+void loop_hot(vm_state *vm, instruction *code, int n);
+loop_jit *loop_jit_create(int n);
+void loop_jit_free(loop_jit *jc);
+void run_program(bool jit);
+uint64_t program_hash(instruction *code, int n);
+bool checkpoint_save(vm_state *vm, char *path, long long executed);
+bool checkpoint_load(vm_state *vm, char *path, long long *executed);
+void run_checkpointed(char *save, char *resume, long long every);
+void profile_fold(profile *pf, char *stack);
+void profile_sample(profile *pf, vm_state *vm);
+void profile_report(profile *pf, char *source, char *folded);
+void run_profiled(char *source, char *folded);
+int proc_entry(instruction *code, int n, int pc);
+void stats_write(FILE *fp, vm_state *vm);
+void run_stats(char *path);
+bool vm_same(vm_state *vm1, vm_state *vm2, char *name);
+bool jit_check();
+void emit_c(instruction *code, int n, char *source);
+batch_run *batch_read(char *path, int *count);
+void *batch_worker(void *arg);
+void run_batch(char *path, int threads, bool jit, bool lanes);
+void print_run(int *output, int len, int halted);
+void sched_ready(scheduler *sc, sched_task *t);
+void *sched_worker(void *arg);
+void run_sched(int count, int threads, long long slice, long long limit);
+int vm_alu(int op, int a, int b);
+void lane_init(lane_vm *lv, vm_stack *stack, batch_run *runs, int count);
+void lane_schedule(lane_vm *lv);
+void lane_run(lane_vm *lv, instruction *code, int n);
+bool lane_execute(lane_vm *lv, instruction *code, int n);
+void *lane_worker(void *arg);
 
 FILE *fpin, *fpout;
-token list[MAX_CODE_LENGTH], current;
-symbol symbol_table[MAX_SYMBOL_TABLE_SIZE];
+token *list;                      // grown by list_add()
+intern_table internTable;         // names of the tokens in list
+int listSize = 0, listCapacity = 0;
+__thread symbol *symbol_table;    // grown by enter()
+int symbolCapacity = 0, symbolTop = 0; // symbolTop: highest entry entered
+long long sourceBytes = 0;
 instruction *ins;
-int insIndex = 0, listIndex = 0, lit_m, num;
-char reserved[14][9] = { "const", "var", "procedure", "call", "begin", "end",
+int insIndex = 0, insCapacity = 0, lit_m;
+int *insLine, *insProc;           // source line and procedure of each instruction
+int procCount = 0;                // procedures seen
+// The parser's state, which each codegen worker has its own of
+__thread token current;
+__thread int listIndex = 0, num, rp = 0;
+__thread int emitProc = 0;        // procedure being compiled
+code_buffer mainCode;             // program()'s code, until it is ins
+__thread code_buffer *gen = &mainCode; // where emit() puts code
+__thread int *codegenErrors = NULL; // while set, errors are counted, not printed
+codegen_job *deferred = NULL;     // bodies block() leaves to the workers,
+                                  // or with --lazy to their first call
+bool lazyCompile = false;         // --lazy, when the program is just run
+int genScopeProc[MAX_LEXI_LEVELS + 1];  // procedure of each open block
+char (*procNames)[MAX_TYPE_LENGTH];
+bool traceLoops = false;
+size_t stackSlots = 0;             // --stack, or 0 to size stacks by analysis
+vm_stack *stack_pool = NULL;       // released stacks, ready for reuse
+vm_stack *stack_all = NULL;        // every stack ever mapped
+pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread sigjmp_buf *vm_overflow_jmp = NULL; // armed while a VM runs
+io_input io_in;
+io_output io_out;
+bool timings = false;              // --timings
+char *traceFile = NULL;            // --trace-file, for the -v trace records
+trace_filter traceFilter;          // --trace-pc, --trace-proc and the like
+int perfFds[3] = { -1, -1, -1 };   // cycles, instructions, cache misses
+int currentPhase = 0;
+long long phaseStart[4], phaseTotals[PHASE_COUNT][4]; // ns and the counters
+__thread long long positionProbes = 0;
+__thread long long strcmpCalls = 0;  // per thread; lexer workers add theirs
+int lexThreads = 0;                // --threads, or 0 for one per core
+token_ring *tokenRing = NULL;      // while --stream lexes into it
+char reserved[14][10] = { "const", "var", "procedure", "call", "begin", "end",
                          "if", "then", "else", "while", "do", "read", "write",
                          "odd" };
 
 /////////////////////////////// End of header /////////////////////////////////
 
+// Returns the name with intern ID id
+static inline char *intern_name(intern_table *it, int id)
+{
+  return it->blocks[id / INTERN_BLOCK][id % INTERN_BLOCK];
+}
+
+// FNV-1a hash of a padded name
+static inline unsigned int intern_hash(char *key)
+{
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i = 0; i < MAX_TYPE_LENGTH - 1; i++)
+  {
+    h = (h ^ (unsigned char)key[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Returns the intern ID of name, a string of at most MAX_TYPE_LENGTH - 1
+// characters, adding it to the table if it is new. The hash doubles once
+// half full.
+int intern(intern_table *it, char *name)
+{
+  char key[MAX_TYPE_LENGTH - 1] = { 0 };
+  intern_slot *old;
+  int i, k, id, oldMask;
+
+  if (it->blocks == NULL)
+  {
+    it->blocks = calloc(INTERN_BLOCKS, sizeof(*it->blocks));
+    it->mask = 255;
+    it->slots = calloc(it->mask + 1, sizeof(intern_slot));
+    it->blocks[0] = malloc(INTERN_BLOCK * MAX_TYPE_LENGTH);
+    it->blocks[0][0][0] = '\0';
+    it->count = 1;
+  }
+  for (i = 0; i < MAX_TYPE_LENGTH - 1 && name[i] != '\0'; i++)
+  {
+    key[i] = name[i];
+  }
+  for (i = intern_hash(key) & it->mask; it->slots[i].id != 0; i = (i + 1) & it->mask)
+  {
+    if (memcmp(it->slots[i].name, key, MAX_TYPE_LENGTH - 1) == 0)
+      return it->slots[i].id - 1;
+  }
+  if (name[0] == '\0')
+    return 0;
+  if (it->count == INTERN_BLOCK * INTERN_BLOCKS)
+  {
+    printf("Err: more than %d names\n", INTERN_BLOCK * INTERN_BLOCKS - 1);
+    return 0;
+  }
+
+  id = it->count;
+  if (id % INTERN_BLOCK == 0)
+  {
+    it->blocks[id / INTERN_BLOCK] = malloc(INTERN_BLOCK * MAX_TYPE_LENGTH);
+  }
+  memcpy(intern_name(it, id), key, MAX_TYPE_LENGTH - 1);
+  intern_name(it, id)[MAX_TYPE_LENGTH - 1] = '\0';
+  memcpy(it->slots[i].name, key, MAX_TYPE_LENGTH - 1);
+  it->slots[i].id = id + 1;
+  it->count++;
+
+  if (it->count * 2 > it->mask)
+  {
+    old = it->slots;
+    oldMask = it->mask;
+    it->mask = it->mask * 2 + 1;
+    it->slots = calloc(it->mask + 1, sizeof(intern_slot));
+    for (i = 0; i <= oldMask; i++)
+    {
+      if (old[i].id == 0)
+        continue;
+      k = intern_hash(old[i].name) & it->mask;
+      while (it->slots[k].id != 0)
+      {
+        k = (k + 1) & it->mask;
+      }
+      it->slots[k] = old[i];
+    }
+    free(old);
+  }
+  return id;
+}
+
+void intern_free(intern_table *it)
+{
+  int b;
+
+  if (it->blocks != NULL)
+  {
+    for (b = 0; b * INTERN_BLOCK < it->count; b++)
+    {
+      free(it->blocks[b]);
+    }
+  }
+  free(it->blocks);
+  free(it->slots);
+  memset(it, 0, sizeof(intern_table));
+}
+
+// Returns a token of type t for the lexeme str, interning an identifier's
+// name in names and reading a number's value
+token token_make(intern_table *names, token_type t, char *str, int line)
+{
+  token tok = { 0 };
+  int i, value = 0;
+
+  tok.type = t;
+  tok.line = (line < TOKEN_LINE_MAX) ? line : TOKEN_LINE_MAX;
+  if (t == identsym)
+  {
+    tok.val = intern(names, str);
+  }
+  else if (t == numbersym)
+  {
+    for (i = 0; isdigit(str[i]) && i < MAX_NUM_LENGTH; i++)
+    {
+      value = value * 10 + (str[i] - '0');
+    }
+    if (str[i] != '\0' || (str[0] == '0' && str[1] != '\0'))
+    {
+      tok.val = intern(names, str);
+      tok.spelled = 1;
+    }
+    else
+    {
+      tok.val = value;
+    }
+  }
+  return tok;
+}
+
 // Returns the address of a new token
-token *createToken(token_type t, char *str)
+token *createToken(token_type t, char *str, int line)
 {
 	token *tptr = malloc(1 * sizeof(token));
-	tptr->type = t;
-  strcpy(tptr->str, str);
+	*tptr = token_make(&internTable, t, str, line);
 	return tptr;
 }
 
-// Retreives the next token from the list of lexemes and its string or number
-// associated with it if needed
+// Appends a token to the list of lexemes, which starts at MAX_CODE_LENGTH
+// tokens and doubles whenever it fills up
+void list_add(token *t)
+{
+  if (listIndex == listCapacity)
+  {
+    listCapacity = (listCapacity == 0) ? MAX_CODE_LENGTH : listCapacity * 2;
+    list = realloc(list, listCapacity * sizeof(token));
+  }
+  list[listIndex++] = *t;
+  listSize = listIndex;
+}
+
+// Returns lexeme i, from the list or, with --stream, from the ring
+static inline token *token_at(int i)
+{
+  return (tokenRing != NULL) ? &tokenRing->slots[i & (TOKEN_RING_SIZE - 1)] : &list[i];
+}
+
+// Returns the name of an identifier token or the digits of a number, which
+// constants are entered under
+static inline char *token_name(token *t)
+{
+  static __thread char digits[MAX_TYPE_LENGTH];
+
+  if (t->type == numbersym && t->spelled == 0)
+  {
+    sprintf(digits, "%d", t->val);
+    return digits;
+  }
+  return intern_name(&internTable, t->val);
+}
+
+// Retreives the next token from the list of lexemes and its number if it
+// is one; a number's value was read by the lexer
 token getNextToken()
 {
-  current = list[listIndex];
+  token *t;
+
+  // Reading past the last lexeme gives nulsym, so the parser reports errors.
+  // With --stream, listSize is what the lexer had published when last
+  // looked at, and the lexer may still be behind.
+  if (listIndex >= listSize && (tokenRing == NULL || token_wait() == false))
+  {
+    current.type = nulsym;
+    current.val = 0;
+    listIndex++;
+    return current;
+  }
+  t = token_at(listIndex);
+  current = *t;
 
-  //Takes care of variables, always represented by "2 | variable"
-  if (current.type == 2)
-    strcpy(current.str, list[listIndex].str);
-  else if (current.type == 3)
-    num = atoi(list[listIndex].str);
+  if (current.type == 3)
+    num = (current.spelled) ? atoi(token_name(&current)) : current.val;
 
   listIndex++;
+  if (tokenRing != NULL && (listIndex & 255) == 0)
+  {
+    token_release();
+  }
   return current;
 }
 
@@ -145,31 +870,34 @@ void varDeclaration(int level, int *ptableindex, int *pdataindex)
   }
 }
 
-// Returns index of symbol table that id is located in
+// strcmp() for the compiler, counted for --timings
+static inline int counted_strcmp(const char *a, const char *b)
+{
+  strcmpCalls++;
+  return strcmp(a, b);
+}
+
+// Returns index of symbol table that id is located in, preferring the
+// declaration in the closest enclosing level
 int position(char *id, int ptableIndex, int levels)
 {
-  int pos = 0, prevdiff, diff = 0;
+  int pos = 0, diff, bestdiff = MAX_LEXI_LEVELS + 2;
   int s = ptableIndex;
-  int diffCount = 0;
 
   while(s != 0)
   {
-    if (strcmp(symbol_table[s].name, id) == 0)
+    positionProbes++;
+    if (counted_strcmp(symbol_table[s].name, id) == 0)
     {
       if(symbol_table[s].level <= levels)
       {
-        if(diff != 0)
-        {
-          prevdiff = diff;
-        }
-
         diff = levels - symbol_table[s].level;
 
-        if(diff == 0 || diff < prevdiff)
+        if(diff < bestdiff)
         {
           pos = s;
+          bestdiff = diff;
         }
-        diffCount++;
       }
     }
     s--;
@@ -183,7 +911,7 @@ char* trim(char *str)
 {
   int lp = 0, rp, diff, i, len = strlen(str);
   i = 0;
-  char *trimmed = malloc(sizeof(char) * MAX_CODE_LENGTH);
+  char *trimmed = malloc(sizeof(char) * (len + 1));
 
   while (str[lp] != '\0')
   {
@@ -192,6 +920,9 @@ char* trim(char *str)
       rp = lp + 2;
       while (str[rp] != '*' && str[rp + 1] != '/')
       {
+        // Keeping the lines of comments so that line numbers stay right
+        if (str[rp] == '\n')
+          trimmed[i++] = '\n';
         rp++;
       }
       lp = rp + 2;
@@ -200,25 +931,60 @@ char* trim(char *str)
     i++;
     lp++;
   }
+  trimmed[i] = '\0';
   return trimmed;
 }
 
+// Adds a token to a chunk's tokens, which double whenever they fill up
+void lex_add(lex_chunk *c, token_type t, char *str, int line)
+{
+  token tok = token_make(c->names, t, str, line);
+
+  if (c->ring != NULL)
+  {
+    token_push(c->ring, tok);
+    c->len++;
+    return;
+  }
+  if (c->len == c->cap)
+  {
+    c->cap = (c->cap == 0) ? MAX_CODE_LENGTH : c->cap * 2;
+    c->tokens = realloc(c->tokens, c->cap * sizeof(token));
+  }
+  c->tokens[c->len++] = tok;
+}
+
+// Keeps a lexical error of a chunk, to be printed when the chunks are joined
+void lex_error(lex_chunk *c, int errorNum)
+{
+  if (c->error_len == c->error_cap)
+  {
+    c->error_cap = (c->error_cap == 0) ? 16 : c->error_cap * 2;
+    c->errors = realloc(c->errors, c->error_cap * sizeof(int));
+  }
+  c->errors[c->error_len++] = errorNum;
+}
+
 // This section holds the lexical analyzer and parser.
 // The lexical analyzer tokenizes the code and labels the tokens as
 // identifiers, reserved words, operators, and special symbols. It then checks
 // for lexical errors only (order of words and symbols).
 // The parser evaluates lexemes, creates a symbol table, and looks for syntax
 // errors only.
-int parse(char *code)
+//
+// lex_range() lexes one chunk of the code, from a place the lexer would also
+// reach from the start of the code, with lines counted from the chunk's
+// first line.
+void lex_range(lex_chunk *c)
 {
-  token *tptr;
-  int lp = 0, rp, length, i, lev = 0, dx = 0;
-  char buffer[MAX_CODE_LENGTH];
+  char *code = c->code;
+  int lp = c->start, end = c->end, rp, length, i, line = c->line;
+  char buffer[MAX_TYPE_LENGTH];
   token_type t;
   bool a;
 
   // looping through string containing input and filling list of tokens
-  while (code[lp] != '\0')
+  while (lp < end)
   {
     // Resetting flag that determines if the token is represented by two characters
     a = 0;
@@ -226,8 +992,13 @@ int parse(char *code)
     // Ignoring whitespace
     if (isspace(code[lp]))
     {
+      if (code[lp] == '\n')
+        line++;
       lp++;
     }
+    // What follows the whitespace at the end of a chunk is the next chunk's
+    if (lp >= end)
+      break;
     if (isalpha(code[lp]))
     {
       rp = lp;
@@ -242,11 +1013,11 @@ int parse(char *code)
       // checking for ident length error
       if (length > MAX_IDENT_LENGTH)
       {
-        print_error(26); // Identifier too long
+        lex_error(c, 26); // Identifier too long
       }
 
-      // creating substring
-      for (i = 0; i < length; i++)
+      // creating substring, cut to what a token holds
+      for (i = 0; i < length && i < MAX_TYPE_LENGTH - 1; i++)
       {
         buffer[i] = code[lp + i];
       }
@@ -257,14 +1028,12 @@ int parse(char *code)
       if (isReserved(buffer))
       {
         t = whatType(buffer);
-        tptr = createToken(t, buffer);
-        list[listIndex++] = *tptr;
+        lex_add(c, t, buffer, line);
       }
       else
       {
         t = identsym;
-        tptr = createToken(t, buffer);
-        list[listIndex++] = *tptr;
+        lex_add(c, t, buffer, line);
       }
     }
     else if (isdigit(code[lp]))
@@ -283,11 +1052,11 @@ int parse(char *code)
       // Checking for ident length error
       if (length > MAX_NUM_LENGTH)
       {
-        print_error(25); // Number is too large
+        lex_error(c, 25); // Number is too large
       }
 
-      // Creating substring
-      for (i = 0; i < length; i++)
+      // Creating substring, cut to what a token holds
+      for (i = 0; i < length && i < MAX_TYPE_LENGTH - 1; i++)
       {
         buffer[i] = code[lp + i];
       }
@@ -295,8 +1064,7 @@ int parse(char *code)
       lp = rp;
 
       t = numbersym;
-      tptr = createToken(t, buffer);
-      list[listIndex++] = *tptr;
+      lex_add(c, t, buffer, line);
     }
     else if (isSymbol(code[lp]))
     {
@@ -372,7 +1140,7 @@ int parse(char *code)
       }
       else
       {
-        print_error(27); // Invalid symbol
+        lex_error(c, 27); // Invalid symbol
       }
 
       buffer[0] = code[lp];
@@ -381,70 +1149,420 @@ int parse(char *code)
       {
         buffer[2] = '\0';
         buffer[1] = code[++lp];
+        if (code[lp] == '\n')
+          line++;
       }
-      tptr = createToken(t, buffer);
-      list[listIndex++] = *tptr;
+      lex_add(c, t, buffer, line);
       lp++;
     }
   }
-  free(tptr);
-  return listIndex;
+  c->lines = line - c->line;
+  c->strcmps = strcmpCalls;
 }
 
-//This enters a symbol into the table
-void enter(int k, int *ptx, int *pdx, int lev)
+// Lexes the chunks of a job that no other worker has taken, then copies
+// the tokens of those a second round takes into the list of lexemes
+void *lex_worker(void *arg)
 {
-  char *str1;
-  int i, len;
-  (*ptx)++;
-  str1 = current.str;
-  len = strlen(current.str);
+  lex_job *job = arg;
+  lex_chunk *c;
+  token *t;
+  int k, i, line;
 
-  for (i = 0; i <= len; i++)
+  while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
   {
-    symbol_table[*ptx].name[i] = *str1;
-    str1++;
+    c = &job->chunks[k];
+    if (job->joining == false)
+    {
+      lex_range(c);
+      continue;
+    }
+    for (i = 0; i < c->len; i++)
+    {
+      t = &list[c->first + i];
+      *t = c->tokens[i];
+      line = t->line + c->line;
+      t->line = (line < TOKEN_LINE_MAX) ? line : TOKEN_LINE_MAX;
+      if (t->type == identsym || t->spelled)
+        t->val = c->remap[t->val];
+    }
   }
+  return NULL;
+}
 
-  symbol_table[*ptx].kind=k;
-  if (k == 1)
+// Runs the workers of a job, on threads threads
+void lex_run(lex_job *job, int threads)
+{
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  int i;
+
+  job->next = 0;
+  for (i = 0; i < threads; i++)
   {
-    symbol_table[*ptx].val=num;
+    pthread_create(&workers[i], NULL, lex_worker, job);
   }
-  else if (k == 2)
+  for (i = 0; i < threads; i++)
   {
-    symbol_table[*ptx].level=lev;
-    symbol_table[*ptx].addr=*pdx;
-    (*pdx)++;
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+}
+
+// Lexes the code into the list of lexemes. A large source is split into
+// chunks, each starting at the first character after whitespace past an
+// even share of the code: the lexer never takes whitespace into a token
+// except as the second character of a symbol, which it then ends, so it
+// starts a token there with every newline before it counted, whatever came
+// before. The chunks are lexed on --threads threads (one per core by
+// default) and their tokens and errors joined in order, as a serial lex
+// would have produced them.
+int parse(char *code)
+{
+  lex_job job = { 0 };
+  lex_chunk *c;
+  int len = strlen(code), threads = lexThreads, k, q, total = 0, line = 1;
+
+  if (threads < 1)
+  {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  job.n = (len / LEX_CHUNK_MIN < threads * 4) ? len / LEX_CHUNK_MIN : threads * 4;
+  job.n = (job.n < 1 || threads == 1) ? 1 : job.n;
+  job.chunks = calloc(job.n, sizeof(lex_chunk));
+
+  // Boundaries, dropping the chunks that found none
+  q = 0;
+  for (k = 0; k < job.n && q < len; k++)
+  {
+    c = &job.chunks[k];
+    c->code = code;
+    c->start = q;
+    q = (k + 1 == job.n) ? len : (int)((long long)len * (k + 1) / job.n);
+    q = (q > c->start) ? q : c->start + 1;
+    while (q < len && !(isspace(code[q - 1]) && !isspace(code[q])))
+    {
+      q++;
+    }
+    c->end = q;
+  }
+  job.n = (k > 0) ? k : 1;
+  job.chunks[0].code = code;
+
+  if (job.n == 1)
+  {
+    job.chunks[0].line = 1;
+    job.chunks[0].names = &internTable;
+    lex_range(&job.chunks[0]);
   }
   else
   {
-    symbol_table[*ptx].level=lev;
+    for (k = 0; k < job.n; k++)
+    {
+      job.chunks[k].names = calloc(1, sizeof(intern_table));
+    }
+    lex_run(&job, (threads < job.n) ? threads : job.n);
   }
-}
 
-// Handles case of no '.' at the end of block
-void program()
-{
-  current = getNextToken();
-  block(0, 0);
-  if (current.type != periodsym)
+  // Places in the list and first lines, then the errors in order
+  for (k = 0; k < job.n; k++)
+  {
+    c = &job.chunks[k];
+    c->first = total;
+    total += c->len;
+    if (job.n > 1)
+    {
+      c->line = line;
+      line += c->lines;
+      strcmpCalls += c->strcmps;
+    }
+    for (q = 0; q < c->error_len; q++)
+    {
+      print_error(c->errors[q]);
+    }
+    free(c->errors);
+
+    // Names are interned in the order a serial lex would have met them
+    if (job.n > 1)
+    {
+      c->remap = malloc(((c->names->count > 0) ? c->names->count : 1) * sizeof(int));
+      for (q = 0; q < c->names->count; q++)
+      {
+        c->remap[q] = intern(&internTable, intern_name(c->names, q));
+      }
+      intern_free(c->names);
+      free(c->names);
+    }
+  }
+
+  if (job.n == 1)
+  {
+    free(list);
+    list = job.chunks[0].tokens;
+    listCapacity = job.chunks[0].cap;
+  }
+  else
   {
-    print_error(9);
+    if (total > listCapacity)
+    {
+      listCapacity = total;
+      list = realloc(list, listCapacity * sizeof(token));
+    }
+    job.joining = true;
+    lex_run(&job, (threads < job.n) ? threads : job.n);
+    for (k = 0; k < job.n; k++)
+    {
+      free(job.chunks[k].tokens);
+      free(job.chunks[k].remap);
+    }
   }
+  free(job.chunks);
+  listIndex = listSize = total;
+  return listIndex;
 }
 
-void block(int level, int tableIndex)
+///////////////////////////////// Token streaming //////////////////////////////
+
+// With --stream the lexer runs on its own thread, one token ahead of the
+// parser at least and a ring of tokens at most, instead of filling the
+// list of lexemes before program() starts. Lexical errors are printed once
+// the lexer is done, before whatever the parser printed meanwhile, so the
+// output is the same as without --stream.
+
+void *token_lexer(void *arg)
 {
-  if(MAX_LEXI_LEVELS < level)
+  token_ring *tr = arg;
+
+  lex_range(&tr->chunk);
+  __atomic_store_n(&tr->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Starts lexing code into a new ring that getNextToken() reads
+void token_stream_start(char *code)
+{
+  lex_chunk *c;
+
+  tokenRing = calloc(1, sizeof(token_ring));
+  tokenRing->slots = malloc(TOKEN_RING_SIZE * sizeof(token));
+  c = &tokenRing->chunk;
+  c->code = code;
+  c->end = strlen(code);
+  c->line = 1;
+  c->ring = tokenRing;
+  c->names = &internTable;
+  intern(&internTable, "");
+  listIndex = listSize = 0;
+  pthread_create(&tokenRing->thread, NULL, token_lexer, tokenRing);
+}
+
+// Publishes a token, waiting while the ring holds tokens the parser still
+// needs
+void token_push(token_ring *tr, token t)
+{
+  while (tr->tail - __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE) >= TOKEN_RING_SIZE)
   {
-    print_error(26);
+    sched_yield();
   }
+  tr->slots[tr->tail & (TOKEN_RING_SIZE - 1)] = t;
+  __atomic_store_n(&tr->tail, tr->tail + 1, __ATOMIC_RELEASE);
+}
 
-  int dataIndex = 4, tableIndex2, insIndex0;
-  tableIndex2 = tableIndex;
-  symbol_table[tableIndex].addr = insIndex;
-  emit(7, 0, 0);
+// Hands the tokens before the two last read back to the lexer
+void token_release()
+{
+  __atomic_store_n(&tokenRing->head, (listIndex > 2) ? listIndex - 2 : 0, __ATOMIC_RELEASE);
+}
+
+// Waits until the lexer has published the token at listIndex. Returns false
+// if it finished without one.
+bool token_wait()
+{
+  bool done;
+  long long tail;
+
+  token_release();
+  while (1)
+  {
+    done = __atomic_load_n(&tokenRing->done, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&tokenRing->tail, __ATOMIC_ACQUIRE);
+    if (tail > listIndex || done)
+    {
+      listSize = tail;
+      return tail > listIndex;
+    }
+    sched_yield();
+  }
+}
+
+// Lets the lexer run to the end of the code, past tokens the parser never
+// read, then prints its errors and frees the ring. Returns the number of
+// tokens.
+int token_stream_finish()
+{
+  token_ring *tr = tokenRing;
+  int i, count;
+
+  __atomic_store_n(&tr->head, LLONG_MAX / 2, __ATOMIC_RELEASE);
+  pthread_join(tr->thread, NULL);
+  for (i = 0; i < tr->chunk.error_len; i++)
+  {
+    print_error(tr->chunk.errors[i]);
+  }
+  strcmpCalls += tr->chunk.strcmps;
+  count = tr->chunk.len;
+  free(tr->chunk.errors);
+  free(tr->slots);
+  free(tr);
+  tokenRing = NULL;
+  listSize = count;
+  return count;
+}
+
+//This enters a symbol into the table
+void enter(int k, int *ptx, int *pdx, int lev)
+{
+  entry_list *scope;
+  char *str1;
+  int i, len;
+
+  // Bodies left to the codegen workers may still have to see the entries of
+  // finished procedures, so none are entered over
+  if (deferred != NULL)
+  {
+    *ptx = symbolTop;
+  }
+  (*ptx)++;
+  symbolTop = (*ptx > symbolTop) ? *ptx : symbolTop;
+  if (*ptx == symbolCapacity)
+  {
+    symbolCapacity *= 2;
+    symbol_table = realloc(symbol_table, symbolCapacity * sizeof(symbol));
+  }
+  if (deferred != NULL && lev <= MAX_LEXI_LEVELS)
+  {
+    scope = &deferred->scopes[genScopeProc[lev]];
+    if (scope->len == scope->cap)
+    {
+      scope->cap = (scope->cap == 0) ? 16 : scope->cap * 2;
+      scope->entries = realloc(scope->entries, scope->cap * sizeof(int));
+    }
+    scope->entries[scope->len++] = *ptx;
+  }
+  str1 = token_name(&current);
+  len = strlen(str1);
+
+  for (i = 0; i <= len; i++)
+  {
+    symbol_table[*ptx].name[i] = *str1;
+    str1++;
+  }
+
+  symbol_table[*ptx].kind=k;
+  if (k == 1)
+  {
+    symbol_table[*ptx].val=num;
+  }
+  else if (k == 2)
+  {
+    symbol_table[*ptx].level=lev;
+    symbol_table[*ptx].addr=*pdx;
+    (*pdx)++;
+  }
+  else
+  {
+    symbol_table[*ptx].level=lev;
+  }
+}
+
+// Handles case of no '.' at the end of block. A large program's procedure
+// bodies are left to the codegen workers, on --threads threads; if that
+// finds any error, the program is compiled again serially to print them.
+// With --lazy they are left to their first call instead, errors and all.
+void program()
+{
+  int threads = (lexThreads > 0) ? lexThreads : sysconf(_SC_NPROCESSORS_ONLN);
+  int i, errors = 0;
+  bool linked = false;
+
+  if (lazyCompile == true || (threads > 1 && tokenRing == NULL && listSize >= CODEGEN_MIN_TOKENS))
+  {
+    deferred = calloc(1, sizeof(codegen_job));
+    codegenErrors = (lazyCompile == true) ? NULL : &errors;
+    current = getNextToken();
+    block(0, 0);
+    if (current.type != periodsym)
+    {
+      print_error(9);
+    }
+    emit(11, 0, 0, 3); // SIO halt
+    codegenErrors = NULL;
+    if (lazyCompile == true)
+    {
+      deferred->symbols = symbol_table;
+      code_publish();
+      return;
+    }
+    linked = (errors == 0) && codegen_link(deferred, threads);
+    for (i = 0; i < procCount && i < deferred->scope_cap; i++)
+    {
+      free(deferred->scopes[i].entries);
+    }
+    free(deferred->scopes);
+    free(deferred->bodies);
+    free(deferred);
+    deferred = NULL;
+
+    if (linked == false)
+    {
+      listIndex = 0;
+      mainCode.len = 0;
+      procCount = 0;
+      symbolTop = 0;
+    }
+  }
+  if (linked == false)
+  {
+    current = getNextToken();
+    block(0, 0);
+    if (current.type != periodsym)
+    {
+      print_error(9);
+    }
+    emit(11, 0, 0, 3); // SIO halt
+  }
+  code_publish();
+}
+
+void block(int level, int tableIndex)
+{
+  if(MAX_LEXI_LEVELS < level)
+  {
+    print_error(26);
+  }
+
+  int dataIndex = 4, tableIndex2, insIndex0, i, proc = procCount++;
+  tableIndex2 = tableIndex;
+
+  if (deferred != NULL && level <= MAX_LEXI_LEVELS)
+  {
+    genScopeProc[level] = proc;
+    if (proc >= deferred->scope_cap)
+    {
+      i = deferred->scope_cap;
+      deferred->scope_cap = (proc < 32) ? 64 : proc * 2;
+      deferred->scopes = realloc(deferred->scopes, deferred->scope_cap * sizeof(entry_list));
+      memset(&deferred->scopes[i], 0, (deferred->scope_cap - i) * sizeof(entry_list));
+    }
+  }
+
+  // Procedure names are kept apart from the symbol table, whose entries for
+  // nested procedures are reused once their parent has been compiled
+  procNames = realloc(procNames, procCount * sizeof(*procNames));
+  strcpy(procNames[proc], (level == 0) ? "main" : symbol_table[tableIndex].name);
+  emitProc = proc;
+
+  symbol_table[tableIndex2].addr = gen->len;
+  emit(7, 0, 0, 0);
 
    while ((current.type == constsym) || (current.type == varsym) || (current.type == procsym))
    {
@@ -514,7 +1632,7 @@ void block(int level, int tableIndex)
        }
 
        block(level+1, tableIndex);
-       emit(2, 0, 0); // Return
+       emit(2, 0, 0, 0); // Return
 
        if (current.type == semicolonsym)
        {
@@ -526,20 +1644,31 @@ void block(int level, int tableIndex)
        }
      }
    }
-   ins[symbol_table[tableIndex2].addr].m = insIndex;
-   symbol_table[tableIndex2].addr = insIndex;
-   insIndex0 = insIndex;
-   emit(6, 0, dataIndex); // INC
-   statement(level, &tableIndex);
+   gen->ins[symbol_table[tableIndex2].addr].m = gen->len;
+   symbol_table[tableIndex2].addr = gen->len;
+   insIndex0 = gen->len;
+   emitProc = proc;
+   emit(6, 0, 0, dataIndex); // INC
+   if (deferred != NULL)
+   {
+     body_defer(level, proc);
+   }
+   else
+   {
+     statement(level, &tableIndex);
+   }
 
 }
 
 void statement(int lev, int *ptx)
 {
   int i, insIndex1, insIndex2;
+
+  // Every statement starts with an empty register stack
+  rp = 0;
   if (current.type == identsym)
   {
-    i = position(current.str, *ptx, lev);
+    i = position(token_name(&current), *ptx, lev);
     if (i == 0)
     {
       print_error(11); // Undeclared identifier
@@ -559,9 +1688,10 @@ void statement(int lev, int *ptx)
       print_error(13); // Assignment operator expected.
     }
     expression(lev, ptx);
+    rp--;
     if (i != 0)
     {
-      emit(4, symbol_table[i].level, symbol_table[i].addr);
+      emit(4, rp, lev - symbol_table[i].level, symbol_table[i].addr); // STO
     }
   }
   else if (current.type == callsym)
@@ -573,14 +1703,14 @@ void statement(int lev, int *ptx)
     }
     else
     {
-      i = position(current.str, *ptx, lev);
+      i = position(token_name(&current), *ptx, lev);
       if (i == 0)
       {
         print_error(11); //Undeclared identifier.
       }
       else if (symbol_table[i].kind == 3)
       {
-        emit(5, symbol_table[i].level, symbol_table[i].addr);
+        emit(5, 0, lev - symbol_table[i].level, symbol_table[i].addr); // CAL
       }
       else
       {
@@ -602,8 +1732,8 @@ void statement(int lev, int *ptx)
       print_error(16);  // then expected
     }
 
-    insIndex1 = insIndex;
-    emit(8, 0, 0);
+    insIndex1 = gen->len;
+    emit(8, --rp, 0, 0); // JPC
     statement(lev, ptx);
 
     // else functionality
@@ -611,12 +1741,12 @@ void statement(int lev, int *ptx)
     {
       current = getNextToken();
 
-      ins[insIndex1].m = insIndex + 1;
-      insIndex1 = insIndex;
-      emit(7, 0, 0);
+      gen->ins[insIndex1].m = gen->len + 1;
+      insIndex1 = gen->len;
+      emit(7, 0, 0, 0);
       statement(lev, ptx);
     }
-    ins[insIndex1].m = insIndex;
+    gen->ins[insIndex1].m = gen->len;
   }
   else if (current.type == beginsym)
   {
@@ -641,12 +1771,12 @@ void statement(int lev, int *ptx)
   }
   else if (current.type == whilesym)
   {
-    insIndex1 = insIndex;
+    insIndex1 = gen->len;
     current = getNextToken();
     // printf("token: %d\n", current.type);
     condition(lev, ptx);
-    insIndex2 = insIndex;
-    emit(8, 0, 0);
+    insIndex2 = gen->len;
+    emit(8, --rp, 0, 0); // JPC
     if (current.type == dosym)
     {
       current = getNextToken();
@@ -657,21 +1787,21 @@ void statement(int lev, int *ptx)
       print_error(18); // do expected
     }
     statement(lev, ptx);
-    emit(7, 0, insIndex1);
-    ins[insIndex2].m = insIndex;
+    emit(7, 0, 0, insIndex1);
+    gen->ins[insIndex2].m = gen->len;
   }
   else if (current.type == writesym)
   {
     current = getNextToken();
     // printf("token: %d\n", current.type);
     expression(lev, ptx);
-    emit(9, 0, 1);
+    emit(9, --rp, 0, 1); // SIO write
   }
   else if (current.type == readsym)
   {
     current = getNextToken();
-    emit(10, 0, 2);
-    i = position(current.str, *ptx, lev);
+    emit(10, rp, 0, 2); // SIO read
+    i = position(token_name(&current), *ptx, lev);
     if (i == 0)
     {
       print_error(11); // Undeclared identifier.
@@ -683,7 +1813,7 @@ void statement(int lev, int *ptx)
     }
     if (i != 0)
     {
-      emit(4, symbol_table[i].level, symbol_table[i].addr);
+      emit(4, rp, lev - symbol_table[i].level, symbol_table[i].addr); // STO
     }
      current = getNextToken();
   }
@@ -696,7 +1826,7 @@ void condition(int level, int* ptableindex)
   {
     current = getNextToken();
     expression(level, ptableindex);
-    emit(2, 0, 6);
+    emit(17, rp - 1, rp - 1, 0); // ODD
   }
   else
   {
@@ -712,30 +1842,32 @@ void condition(int level, int* ptableindex)
       rel_switch = current.type;
       current = getNextToken();
       expression(level, ptableindex);
+      rp--;
 
+      // eqlsym..geqsym map onto EQL..GEQ (19-24)
       if(rel_switch == 9)
       {
-        emit(2, 0, 8);
+        emit(19, rp - 1, rp - 1, rp);
       }
       if(rel_switch == 10)
       {
-        emit(2, 0, 9);
+        emit(20, rp - 1, rp - 1, rp);
       }
       if(rel_switch == 11)
       {
-        emit(2, 0, 10);
+        emit(21, rp - 1, rp - 1, rp);
       }
       if(rel_switch == 12)
       {
-        emit(2, 0, 11);
+        emit(22, rp - 1, rp - 1, rp);
       }
       if(rel_switch == 13)
       {
-        emit(2, 0, 12);
+        emit(23, rp - 1, rp - 1, rp);
       }
       if(rel_switch == 14)
       {
-        emit(2, 0, 13);
+        emit(24, rp - 1, rp - 1, rp);
       }
     }
   }
@@ -750,7 +1882,7 @@ void expression(int lev, int *ptx)
     current = getNextToken();
     term(lev, ptx);
     if(addop == minussym)
-      emit(2, 0, 1); // OPR, 0, OPR_NEG
+      emit(12, rp - 1, rp - 1, 0); // NEG
   }
   else
   {
@@ -761,13 +1893,14 @@ void expression(int lev, int *ptx)
     addop = current.type;
     current = getNextToken();
     term(lev, ptx);
+    rp--;
     if (addop == plussym)
     {
-      emit(2, 0, 2); // addition
+      emit(13, rp - 1, rp - 1, rp); // addition
     }
     else
     {
-      emit(2, 0, 3); // subtraction
+      emit(14, rp - 1, rp - 1, rp); // subtraction
     }
   }
 }
@@ -781,13 +1914,14 @@ void term(int lev, int *ptx)
     mulop = current.type;
     current = getNextToken();
     factor(lev, ptx);
+    rp--;
     if (mulop == multsym)
     {
-      emit(2, 0, 4);
+      emit(15, rp - 1, rp - 1, rp); // multiplication
     }
     else
     {
-      emit(2, 0, 5);
+      emit(16, rp - 1, rp - 1, rp); // division
     }
   }
 }
@@ -800,7 +1934,7 @@ void factor(int lev, int *ptx)
   {
     if (current.type == identsym)
     {
-      i = position(current.str, *ptx, lev);
+      i = position(token_name(&current), *ptx, lev);
       if (i == 0)
       {
         print_error(11); // undeclared identifier
@@ -813,17 +1947,18 @@ void factor(int lev, int *ptx)
         val = symbol_table[i].val;
         if (kind == 1)
         {
-          emit(1, 0, val);
+          emit(1, rp, 0, val); // LIT
         }
         else if (kind == 2)
         {
-          emit(3, lev - level, adr);
+          emit(3, rp, lev - level, adr); // LOD
         }
         else
         {
           print_error(21); // Expression must not contain a procedure identifier
         }
       }
+      rp++;
       current = getNextToken();
     }
     else if (current.type == numbersym)
@@ -833,7 +1968,7 @@ void factor(int lev, int *ptx)
         print_error(25);
         num = 0;
       }
-      emit(1, 0, num);
+      emit(1, rp++, 0, num); // LIT
       current = getNextToken();
     }
     else if (current.type == lparentsym)
@@ -852,13 +1987,342 @@ void factor(int lev, int *ptx)
   }
 }
 
-// Adds instruction to instruction array
-void emit(int op, int l, int m)
+///////////////////////////////// Parallel codegen /////////////////////////////
+
+// A procedure body compiles the same wherever it is compiled, given the
+// symbol table as it was and the tokens, but for the addresses: of its own
+// jumps, and of the procedures it calls. block() leaves each body to the
+// codegen workers, which compile them with jumps counted from the body's
+// start, and with CALs and block()'s JMPs naming places in block()'s code;
+// the bodies are then spliced into it, after their INCs.
+
+// Leaves the body of procedure proc, at level, to the codegen workers, and
+// skips to the token that ends it
+void body_defer(int level, int proc)
+{
+  entry_list *scope;
+  body_job *b;
+  int i, depth = 0;
+  token_type t;
+
+  if (deferred->n == deferred->cap)
+  {
+    deferred->cap = (deferred->cap == 0) ? 64 : deferred->cap * 2;
+    deferred->bodies = realloc(deferred->bodies, deferred->cap * sizeof(body_job));
+  }
+  b = &deferred->bodies[deferred->n++];
+  memset(b, 0, sizeof(body_job));
+  b->start = listIndex - 1;
+  b->at = gen->len;
+  if (lazyCompile == true)
+  {
+    emit(25, 0, 0, deferred->n - 1);
+  }
+  b->proc = proc;
+  b->level = (level <= MAX_LEXI_LEVELS) ? level : 0; // an error already
+  for (i = 0; i <= b->level; i++)
+  {
+    scope = &deferred->scopes[genScopeProc[i]];
+    b->scope_proc[i] = genScopeProc[i];
+    b->scope_len[i] = scope->len;
+    b->scope_addr[i] = (scope->len > 0) ? symbol_table[scope->entries[scope->len - 1]].addr : 0;
+  }
+
+  // A statement ends at a ';', '.' or unmatched end outside of begin and
+  // end; the worker checks that it does
+  for (i = b->start; i < listSize; i++)
+  {
+    t = list[i].type;
+    if (t == beginsym)
+    {
+      depth++;
+    }
+    else if (depth == 0 && (t == semicolonsym || t == periodsym || t == endsym))
+    {
+      break;
+    }
+    else if (t == endsym)
+    {
+      depth--;
+    }
+  }
+  b->end = i;
+  listIndex = b->end;
+  current = getNextToken();
+}
+
+// Compiles body b with the symbol table as it saw it: the entries of its
+// procedure and its ancestors, in order, gathered into *view, which has room
+// for *cap entries and grows as needed
+void body_compile(codegen_job *cg, body_job *b, symbol **view, int *cap)
+{
+  int *entries;
+  int i, e, n;
+
+  for (i = 0, n = 1; i <= b->level; i++)
+  {
+    n += b->scope_len[i];
+  }
+  if (n > *cap)
+  {
+    *cap = n;
+    *view = realloc(*view, *cap * sizeof(symbol));
+  }
+  for (i = 0, n = 0; i <= b->level; i++)
+  {
+    entries = cg->scopes[b->scope_proc[i]].entries;
+    for (e = 0; e < b->scope_len[i]; e++)
+    {
+      (*view)[++n] = cg->symbols[entries[e]];
+    }
+    if (i < b->level && b->scope_len[i] > 0)
+    {
+      (*view)[n].addr = b->scope_addr[i];
+    }
+  }
+
+  symbol_table = *view;
+  gen = &b->code;
+  emitProc = b->proc;
+  listIndex = b->start;
+  current = getNextToken();
+  statement(b->level, &n);
+}
+
+// Compiles the bodies no other worker has taken. Once joining, copies those
+// a second round takes into the linked code.
+void *codegen_worker(void *arg)
+{
+  codegen_job *cg = arg;
+  body_job *b;
+  symbol *view = NULL;
+  instruction *ir;
+  int k, i, cap = 0;
+
+  while ((k = __atomic_fetch_add(&cg->next, 1, __ATOMIC_RELAXED)) < cg->n)
+  {
+    b = &cg->bodies[k];
+    if (cg->joining == true)
+    {
+      memcpy(&cg->out.ins[b->base], b->code.ins, b->code.len * sizeof(instruction));
+      memcpy(&cg->out.line[b->base], b->code.line, b->code.len * sizeof(int));
+      memcpy(&cg->out.proc[b->base], b->code.proc, b->code.len * sizeof(int));
+      for (i = 0; i < b->code.len; i++)
+      {
+        ir = &cg->out.ins[b->base + i];
+        if (ir->op == 7 || ir->op == 8)
+          ir->m += b->base;
+        else if (ir->op == 5)
+          ir->m = cg->map[ir->m];
+      }
+      continue;
+    }
+
+    codegenErrors = &b->errors;
+    body_compile(cg, b, &view, &cap);
+    b->ok = (b->errors == 0 && listIndex - 1 == b->end);
+  }
+  __atomic_fetch_add(&cg->probes, positionProbes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cg->strcmps, strcmpCalls, __ATOMIC_RELAXED);
+  free(view);
+  return NULL;
+}
+
+// Runs the codegen workers of a job, on threads threads
+void codegen_run(codegen_job *cg, int threads)
+{
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  int i;
+
+  cg->next = 0;
+  for (i = 0; i < threads; i++)
+  {
+    pthread_create(&workers[i], NULL, codegen_worker, cg);
+  }
+  for (i = 0; i < threads; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+}
+
+// Compiles the deferred bodies on threads threads, then splices them into
+// the main thread's code. Returns false, leaving that code as it was, if a
+// body had errors or ended elsewhere than block() thought.
+bool codegen_link(codegen_job *cg, int threads)
+{
+  code_buffer *out = &cg->out;
+  int i, j, k, pos;
+  bool ok = true;
+
+  threads = (threads < cg->n) ? threads : cg->n;
+  cg->symbols = symbol_table;
+  codegen_run(cg, threads);
+  positionProbes += cg->probes;
+  strcmpCalls += cg->strcmps;
+  for (j = 0; j < cg->n; j++)
+  {
+    ok = ok && cg->bodies[j].ok;
+  }
+
+  // Where each of block()'s instructions, and each body, ends up
+  if (ok)
+  {
+    cg->map = malloc((mainCode.len + 1) * sizeof(int));
+    for (k = 0, j = 0, pos = 0; k <= mainCode.len; k++)
+    {
+      for (; j < cg->n && cg->bodies[j].at == k; j++)
+      {
+        cg->bodies[j].base = pos;
+        pos += cg->bodies[j].code.len;
+      }
+      cg->map[k] = pos;
+      pos += (k < mainCode.len) ? 1 : 0;
+    }
+
+    out->len = pos;
+    out->cap = (pos > 0) ? pos : 1;
+    out->ins = malloc(out->cap * sizeof(instruction));
+    out->line = malloc(out->cap * sizeof(int));
+    out->proc = malloc(out->cap * sizeof(int));
+    for (k = 0; k < mainCode.len; k++)
+    {
+      out->ins[cg->map[k]] = mainCode.ins[k];
+      if (mainCode.ins[k].op == 7)
+        out->ins[cg->map[k]].m = cg->map[mainCode.ins[k].m];
+      out->line[cg->map[k]] = mainCode.line[k];
+      out->proc[cg->map[k]] = mainCode.proc[k];
+    }
+    cg->joining = true;
+    codegen_run(cg, threads);
+
+    for (i = 1; i <= symbolTop; i++)
+    {
+      if (symbol_table[i].kind == 3)
+        symbol_table[i].addr = cg->map[symbol_table[i].addr];
+    }
+    free(mainCode.ins);
+    free(mainCode.line);
+    free(mainCode.proc);
+    mainCode = *out;
+    free(cg->map);
+  }
+
+  for (j = 0; j < cg->n; j++)
+  {
+    free(cg->bodies[j].code.ins);
+    free(cg->bodies[j].code.line);
+    free(cg->bodies[j].code.proc);
+  }
+  return ok;
+}
+
+/////////////////////////////// Lazy compilation ///////////////////////////////
+
+// With --lazy, block() leaves every body to be compiled the first time it
+// runs, in its place a stub (opcode 25, naming the body) after its INC and
+// before its RTN, or the main block's halt. Bodies are compiled as codegen
+// workers compile them, then put after the end of the code.
+
+// Publishes the main thread's code as ins, insLine and insProc
+void code_publish()
+{
+  ins = mainCode.ins;
+  insIndex = mainCode.len;
+  insCapacity = mainCode.cap;
+  insLine = mainCode.line;
+  insProc = mainCode.proc;
+}
+
+// Compiles body k the first time its stub runs, printing its errors, and
+// puts it after the code between copies of the INC and RTN around the stub.
+// The INC, the stub, and the CAL at caller (if it is one to this procedure)
+// then jump there. Returns where the body starts, after the INC.
+int lazy_compile(int k, int caller)
+{
+  body_job *b = &deferred->bodies[k];
+  code_buffer *c = &mainCode;
+  symbol *table = symbol_table, *view = NULL;
+  instruction *ir;
+  int cap = 0, inc = b->at - 1, base, i;
+
+  // Its errors go after what the program has written so far
+  io_flush();
+  body_compile(deferred, b, &view, &cap);
+  if (listIndex - 1 != b->end)
+  {
+    print_error(8);
+  }
+  symbol_table = table;
+  gen = &mainCode;
+  free(view);
+
+  while (c->len + b->code.len + 2 > c->cap)
+  {
+    c->cap *= 2;
+    c->ins = realloc(c->ins, c->cap * sizeof(instruction));
+    c->line = realloc(c->line, c->cap * sizeof(int));
+    c->proc = realloc(c->proc, c->cap * sizeof(int));
+  }
+  base = c->len;
+  c->ins[base] = c->ins[inc];
+  c->line[base] = c->line[inc];
+  c->proc[base] = c->proc[inc];
+  memcpy(&c->ins[base + 1], b->code.ins, b->code.len * sizeof(instruction));
+  memcpy(&c->line[base + 1], b->code.line, b->code.len * sizeof(int));
+  memcpy(&c->proc[base + 1], b->code.proc, b->code.len * sizeof(int));
+  for (i = 0; i < b->code.len; i++)
+  {
+    ir = &c->ins[base + 1 + i];
+    if (ir->op == 7 || ir->op == 8)
+      ir->m += base + 1;
+  }
+  c->len = base + 1 + b->code.len;
+  c->ins[c->len] = c->ins[b->at + 1];
+  c->line[c->len] = c->line[b->at + 1];
+  c->proc[c->len] = c->proc[b->at + 1];
+  c->len++;
+
+  c->ins[inc] = (instruction){ 7, 0, 0, base };
+  c->ins[b->at] = (instruction){ 7, 0, 0, base + 1 };
+  if (caller >= 0 && caller < base && c->ins[caller].op == 5 && c->ins[caller].m == inc)
+  {
+    c->ins[caller].m = base;
+  }
+  free(b->code.ins);
+  free(b->code.line);
+  free(b->code.proc);
+  code_publish();
+  return base + 1;
+}
+
+// Adds instruction to the code being generated, growing it as needed
+void emit(int op, int r, int l, int m)
 {
-  ins[insIndex].op = op;
-  ins[insIndex].l = l;
-  ins[insIndex].m = m;
-  insIndex++;
+  code_buffer *c = gen;
+  int last;
+
+  if (c->len == c->cap)
+  {
+    c->cap = (c->cap == 0) ? MAX_CODE_LENGTH : c->cap * 2;
+    c->ins = realloc(c->ins, c->cap * sizeof(instruction));
+    c->line = realloc(c->line, c->cap * sizeof(int));
+    c->proc = realloc(c->proc, c->cap * sizeof(int));
+  }
+  if (r >= MAX_REGISTERS)
+  {
+    print_error(28); // Out of registers
+  }
+  c->ins[c->len].op = op;
+  c->ins[c->len].r = r;
+  c->ins[c->len].l = l;
+  c->ins[c->len].m = m;
+  // Instructions belong to the line of the last token read and to the
+  // procedure being compiled
+  last = (listIndex < listSize) ? listIndex : listSize;
+  c->line[c->len] = (last >= 2) ? token_at(last - 2)->line : 1;
+  c->proc[c->len] = emitProc;
+  c->len++;
 }
 
 // Returns true if the character sent is a valid symbol or false otherwise
@@ -900,89 +2364,89 @@ bool isReserved(char *str)
 {
   if (str[0] == 'b')
   {
-    if (strcmp(reserved[4], str) == 0)
+    if (counted_strcmp(reserved[4], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'c')
   {
-    if (strcmp(reserved[0], str) == 0)
+    if (counted_strcmp(reserved[0], str) == 0)
     {
       return true;
     }
-    else if (strcmp(reserved[3], str) == 0)
+    else if (counted_strcmp(reserved[3], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'd')
   {
-    if (strcmp(reserved[10], str) == 0)
+    if (counted_strcmp(reserved[10], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'e')
   {
-    if (strcmp(reserved[5], str) == 0)
+    if (counted_strcmp(reserved[5], str) == 0)
     {
       return true;
     }
-    else if (strcmp(reserved[8], str) == 0)
+    else if (counted_strcmp(reserved[8], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'i')
   {
-    if (strcmp(reserved[6], str) == 0)
+    if (counted_strcmp(reserved[6], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'o')
   {
-    if (strcmp(reserved[13], str) == 0)
+    if (counted_strcmp(reserved[13], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'p')
   {
-    if (strcmp(reserved[2], str) == 0)
+    if (counted_strcmp(reserved[2], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'r')
   {
-    if (strcmp(reserved[11], str) == 0)
+    if (counted_strcmp(reserved[11], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 't')
   {
-    if (strcmp(reserved[7], str) == 0)
+    if (counted_strcmp(reserved[7], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'v')
   {
-    if (strcmp(reserved[1], str) == 0)
+    if (counted_strcmp(reserved[1], str) == 0)
     {
       return true;
     }
   }
   if (str[0] == 'w')
   {
-    if (strcmp(reserved[9], str) == 0)
+    if (counted_strcmp(reserved[9], str) == 0)
     {
       return true;
     }
-    else if (strcmp(reserved[12], str) == 0)
+    else if (counted_strcmp(reserved[12], str) == 0)
     {
       return true;
     }
@@ -996,89 +2460,89 @@ token_type whatType(char *str)
 {
   if (str[0] == 'b')
   {
-    if (strcmp(reserved[4], str) == 0)
+    if (counted_strcmp(reserved[4], str) == 0)
     {
       return 21;
     }
   }
   if (str[0] == 'c')
   {
-    if (strcmp(reserved[0], str) == 0)
+    if (counted_strcmp(reserved[0], str) == 0)
     {
       return 28;
     }
-    else if (strcmp(reserved[3], str) == 0)
+    else if (counted_strcmp(reserved[3], str) == 0)
     {
       return 27;
     }
   }
   if (str[0] == 'd')
   {
-    if (strcmp(reserved[10], str) == 0)
+    if (counted_strcmp(reserved[10], str) == 0)
     {
       return 26;
     }
   }
   if (str[0] == 'e')
   {
-    if (strcmp(reserved[5], str) == 0)
+    if (counted_strcmp(reserved[5], str) == 0)
     {
       return 22;
     }
-    else if (strcmp(reserved[8], str) == 0)
+    else if (counted_strcmp(reserved[8], str) == 0)
     {
       return 33;
     }
   }
   if (str[0] == 'i')
   {
-    if (strcmp(reserved[6], str) == 0)
+    if (counted_strcmp(reserved[6], str) == 0)
     {
       return 23;
     }
   }
   if (str[0] == 'o')
   {
-    if (strcmp(reserved[13], str) == 0)
+    if (counted_strcmp(reserved[13], str) == 0)
     {
       return 8;
     }
   }
   if (str[0] == 'p')
   {
-    if (strcmp(reserved[2], str) == 0)
+    if (counted_strcmp(reserved[2], str) == 0)
     {
       return 30;
     }
   }
   if (str[0] == 'r')
   {
-    if (strcmp(reserved[11], str) == 0)
+    if (counted_strcmp(reserved[11], str) == 0)
     {
       return 32;
     }
   }
   if (str[0] == 't')
   {
-    if (strcmp(reserved[7], str) == 0)
+    if (counted_strcmp(reserved[7], str) == 0)
     {
       return 24;
     }
   }
   if (str[0] == 'v')
   {
-    if (strcmp(reserved[1], str) == 0)
+    if (counted_strcmp(reserved[1], str) == 0)
     {
       return 29;
     }
   }
   if (str[0] == 'w')
   {
-    if (strcmp(reserved[9], str) == 0)
+    if (counted_strcmp(reserved[9], str) == 0)
     {
       return 25;
     }
-    else if (strcmp(reserved[12], str) == 0)
+    else if (counted_strcmp(reserved[12], str) == 0)
     {
       return 31;
     }
@@ -1093,7 +2557,7 @@ void output(int count, bool l, bool a, bool v)
   int i, j = 0;
   char buffer[13] = {'\0'};
   // Converting instruction array to int array
-  int as_code[MAX_CODE_LENGTH];
+  int *as_code = malloc(insIndex * 4 * sizeof(int));
 
   // debugging ///////////////////////////
   // printf("Contents of ins array:\n");
@@ -1119,6 +2583,7 @@ void output(int count, bool l, bool a, bool v)
   if (l == false && a == false && v == false)
   {
     fprintf(fpout, "in\tout\n");
+    free(as_code);
     return;
   }
 
@@ -1132,7 +2597,7 @@ void output(int count, bool l, bool a, bool v)
       fprintf(fpout, "%d ", list[i].type);
       if(list[i].type == 2 || list[i].type == 3)
       {
-        fprintf(fpout, "%s ", list[i].str);
+        fprintf(fpout, "%s ", token_name(&list[i]));
       }
     }
     fprintf(fpout, "\n\nSymbolic representation:\n");
@@ -1162,11 +2627,17 @@ void output(int count, bool l, bool a, bool v)
     // Printing virtual machine execution trace
     executionCycle(as_code);
   }
+  free(as_code);
 }
 
 // Prints a unique error message for each error code
 void print_error(int errorNum)
 {
+  if (codegenErrors != NULL)
+  {
+    (*codegenErrors)++;
+    return;
+  }
   switch( errorNum )
   {
     case 1:
@@ -1275,6 +2746,11 @@ void print_error(int errorNum)
 
     case 27:
       fprintf(fpout, "Invalid symbol\n");
+      break;
+
+    case 28:
+      fprintf(fpout, "Expression too complex, out of registers\n");
+      break;
 
     default:
     fprintf(fpout, "Invalid instruction\n");
@@ -1355,56 +2831,121 @@ void print_token(int tokenRep)
   }
 }
 
+// bench/micro.c includes this file for the functions below and brings its
+// own main
+#ifndef HW4_NO_MAIN
 int main(int argc, char **argv)
 {
-  fpin = fopen(argv[1], "r");
-  fpout = fopen(argv[2], "w+");
-  char aSingleLine[MAX_CODE_LENGTH], code[MAX_CODE_LENGTH] = {'\0'},
-       trimmed[MAX_CODE_LENGTH] = {'\0'}, commands[3][3], c;
-  int list_size, i, tokens[MAX_SYMBOL_TABLE_SIZE] = {'\0'};
+  char *code = NULL;
+  size_t codeCapacity = 0, got;
+  int list_size, i, threads = 0;
+  char *batchFile = NULL, *inputFile = NULL, *checkpointFile = NULL,
+       *resumeFile = NULL, *foldedFile = NULL,
+       *statsFile = NULL;
+  int instances = 0;
+  long long slice = 0, limit = 0, every = 0;
   token current;
-  bool l = false, a = false, v = false;
+  bool l = false, a = false, v = false, r = false, j = false, jitCheck = false,
+       emitC = false, lanes = false, profiling = false, stream = false,
+       lazy = false, optimize = false;
+  FILE *parserOut = NULL;
+  char *parsed = NULL;
+  size_t parsedLen = 0;
 
   // debugging
   // printf("Here\nwe\ngo\n\n\n");
 
   // In case user doesn't know how to use program
-  if (argc < 3 || argc > 6)
+  if (argc < 3)
   {
-    printf("Err: incorrect number of arguments\nTo use compiler, type: ./a.out <inputfilename.txt> <outputfilename.txt> <up to one of each of the following commands: -l -a -v>\n");
+    printf("Err: incorrect number of arguments\nTo use compiler, type: ./a.out <inputfilename.txt> <outputfilename.txt> <up to one of each of the following commands: -l -a -v -r -j -O --jit-check --trace-loops --emit-c --stack <slots> --batch <inputs> --threads <n> --lanes --input <values> --sched <instances> --slice <n> --max-instructions <n> --checkpoint <file> --checkpoint-every <n> --resume <file> --profile --folded <file> --stats <file> --timings --trace-file <file> --trace-pc <a-b> --trace-proc <name> --trace-first <n> --trace-every <n> --trace-last <n> --stream --lazy>\n");
     return 0;
   }
-  if (argc == 4)
-  {
-    strcpy(commands[0], argv[3]);
-  }
-  if (argc == 5)
-  {
-    strcpy(commands[0], argv[3]);
-    strcpy(commands[1], argv[4]);
-  }
-  if (argc == 6)
-  {
-    strcpy(commands[0], argv[3]);
-    strcpy(commands[1], argv[4]);
-    strcpy(commands[2], argv[5]);
-  }
-  for (i = 0; i < (argc - 3); i++)
+  for (i = 3; i < argc; i++)
   {
-    if (strcmp(commands[i], "-l") == 0)
+    if (strcmp(argv[i], "-l") == 0)
       l = true;
-    if (strcmp(commands[i], "-a") == 0)
+    else if (strcmp(argv[i], "-a") == 0)
       a = true;
-    if (strcmp(commands[i], "-v") == 0)
+    else if (strcmp(argv[i], "-v") == 0)
       v = true;
+    else if (strcmp(argv[i], "-r") == 0)
+      r = true;
+    else if (strcmp(argv[i], "-j") == 0)
+      j = true;
+    else if (strcmp(argv[i], "-O") == 0)
+      optimize = true;
+    else if (strcmp(argv[i], "--jit-check") == 0)
+      jitCheck = true;
+    else if (strcmp(argv[i], "--trace-loops") == 0)
+      traceLoops = true;
+    else if (strcmp(argv[i], "--emit-c") == 0)
+      emitC = true;
+    else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+      stackSlots = atol(argv[++i]);
+    else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+      batchFile = argv[++i];
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--lanes") == 0)
+      lanes = true;
+    else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+      inputFile = argv[++i];
+    else if (strcmp(argv[i], "--sched") == 0 && i + 1 < argc)
+      instances = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc)
+      slice = atoll(argv[++i]);
+    else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+      limit = atoll(argv[++i]);
+    else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+      checkpointFile = argv[++i];
+    else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc)
+      every = atoll(argv[++i]);
+    else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc)
+      resumeFile = argv[++i];
+    else if (strcmp(argv[i], "--profile") == 0)
+      profiling = true;
+    else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc)
+      foldedFile = argv[++i];
+    else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+      statsFile = argv[++i];
+    else if (strcmp(argv[i], "--timings") == 0)
+      timings = true;
+    else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc)
+      traceFile = argv[++i];
+    else if (strcmp(argv[i], "--stream") == 0)
+      stream = true;
+    else if (strcmp(argv[i], "--lazy") == 0)
+      lazy = true;
+    else if (strcmp(argv[i], "--trace-pc") == 0 && i + 1 < argc)
+    {
+      traceFilter.ranges = realloc(traceFilter.ranges, (traceFilter.range_count + 1) * sizeof(*traceFilter.ranges));
+      if (sscanf(argv[++i], "%d-%d", &traceFilter.ranges[traceFilter.range_count][0],
+                 &traceFilter.ranges[traceFilter.range_count][1]) == 1)
+        traceFilter.ranges[traceFilter.range_count][1] = traceFilter.ranges[traceFilter.range_count][0];
+      traceFilter.range_count++;
+    }
+    else if (strcmp(argv[i], "--trace-proc") == 0 && i + 1 < argc)
+    {
+      traceFilter.procs = realloc(traceFilter.procs, (traceFilter.proc_count + 1) * sizeof(char *));
+      traceFilter.procs[traceFilter.proc_count++] = argv[++i];
+    }
+    else if (strcmp(argv[i], "--trace-first") == 0 && i + 1 < argc)
+      traceFilter.first = atoll(argv[++i]);
+    else if (strcmp(argv[i], "--trace-every") == 0 && i + 1 < argc)
+      traceFilter.every = atoll(argv[++i]);
+    else if (strcmp(argv[i], "--trace-last") == 0 && i + 1 < argc)
+      traceFilter.last = atoll(argv[++i]);
+    else
+    {
+      printf("Err: unknown command %s\n", argv[i]);
+      return 0;
+    }
   }
 
-  // Initializing lexeme list
-  for (i = 0; i < MAX_CODE_LENGTH; i++)
-  {
-    list[i].type = nulsym;
-    list[i].str[0] = '\0';
-  }
+  // A resumed run carries on with the output file of the checkpointed one
+  fpin = fopen(argv[1], "r");
+  fpout = fopen(argv[2], (resumeFile != NULL) ? "r+" : "w+");
 
   // Preventing segfault by checking for failures to open files
   if (fpin == NULL)
@@ -1417,19 +2958,61 @@ int main(int argc, char **argv)
     printf("File not found\n");
     return 0;
   }
+  if (io_open(inputFile) == false)
+  {
+    printf("Input file not found\n");
+    return 0;
+  }
 
-  // Scanning file into code array
-  while(fgets(aSingleLine, MAX_CODE_LENGTH, fpin))
+  lexThreads = threads;
+  // Bodies are only compiled lazily for a plain run on the interpreter;
+  // everything else wants all of the code at once
+  lazyCompile = lazy && r && !a && !v && !j && !jitCheck && !emitC && !stream &&
+                !traceLoops && batchFile == NULL && instances == 0 &&
+                checkpointFile == NULL && resumeFile == NULL && !profiling &&
+                foldedFile == NULL && statsFile == NULL;
+  if (timings == true)
   {
-    strcat(code, aSingleLine);
+    timings_open();
   }
 
+  // Scanning file into code array, which doubles until the file fits
+  phase_begin(0);
+  do
+  {
+    if (sourceBytes + 1 >= (long long)codeCapacity)
+    {
+      codeCapacity = (codeCapacity == 0) ? MAX_CODE_LENGTH : codeCapacity * 2;
+      code = realloc(code, codeCapacity);
+    }
+    got = fread(code + sourceBytes, 1, codeCapacity - sourceBytes - 1, fpin);
+    sourceBytes += got;
+  } while (got > 0);
+  code[sourceBytes] = '\0';
+  phase_end();
+
   // Removing all comments from code
-  strcpy(code, trim(code));
+  phase_begin(1);
+  code = trim(code);
+  phase_end();
 
   // Filling lexeme array and capturing number of elements of lexeme array
-  // (or 0 if parse found errors)
-  list_size = parse(code);
+  // (or 0 if parse found errors). With --stream the lexer runs alongside
+  // program() instead, unless -l needs the whole list, and what the parser
+  // prints waits for the lexer's errors.
+  phase_begin(2);
+  if (stream == true && l == false)
+  {
+    token_stream_start(code);
+    parserOut = fpout;
+    fpout = open_memstream(&parsed, &parsedLen);
+    list_size = 1;
+  }
+  else
+  {
+    list_size = parse(code);
+  }
+  phase_end();
 
   if (list_size == 0)
   {
@@ -1437,26 +3020,114 @@ int main(int argc, char **argv)
     return 0;
   }
 
-  // Initializing instruction array
-  ins = malloc(listIndex * sizeof(instruction));
+  // Instruction array is allocated and grown by emit(), the symbol table
+  // by enter()
   listIndex = 0;
+  symbolCapacity = MAX_SYMBOL_TABLE_SIZE;
+  symbol_table = calloc(symbolCapacity, sizeof(symbol));
 
+  phase_begin(3);
   program();
+  if (parserOut != NULL)
+  {
+    fclose(fpout);
+    fpout = parserOut;
+    list_size = token_stream_finish();
+    if (list_size == 0)
+    {
+      fprintf(fpout, "Error(s), program is not syntactically correct\n");
+      return 0;
+    }
+    fwrite(parsed, 1, parsedLen, fpout);
+    free(parsed);
+  }
+  // With -O the finished code is rewritten to run faster; a --lazy program
+  // is never finished
+  if (optimize == true && lazyCompile == false)
+  {
+    promote_vars(&mainCode);
+    code_publish();
+    light_calls(ins, insProc, insIndex, procCount);
+    tail_calls(ins, insIndex);
+  }
+  phase_end();
 
-  output(list_size, l, a, v);
-
-  fclose(fpin);
-  fclose(fpout);
-  return 0;
-}
+  // The C translation replaces every other kind of output
+  if (emitC == true)
+  {
+    phase_begin(4);
+    emit_c(ins, insIndex, argv[1]);
+    phase_end();
+    timings_report();
+    fclose(fpin);
+    fclose(fpout);
+    return 0;
+  }
 
-// Given the four values that make up an instruction, returns the address of
-// an instruction type object
-instruction *create_instruction(int op, int r, int l, int m)
-{
-	instruction *i = calloc(1, sizeof(instruction));
-	i->op = op;
-  i->r = r;
+  phase_begin(4);
+  if (resumeFile == NULL)
+  {
+    output(list_size, l, a, v);
+  }
+  phase_end();
+
+  // Running the program without a trace, on the interpreter and/or the JIT,
+  // or once per line of a batch input file (on the JIT with -j, or on the
+  // SPMD lanes interpreter with --lanes), as many scheduled instances, or
+  // on the interpreter with checkpoints, the profiler or counters
+  phase_begin(5);
+  if (batchFile != NULL)
+  {
+    run_batch(batchFile, threads, j, lanes);
+  }
+  else if (instances > 0)
+  {
+    run_sched(instances, threads, slice, limit);
+  }
+  else if (checkpointFile != NULL || resumeFile != NULL)
+  {
+    run_checkpointed(checkpointFile, resumeFile, every);
+  }
+  else if (profiling == true || foldedFile != NULL)
+  {
+    run_profiled(argv[1], foldedFile);
+  }
+  else if (statsFile != NULL)
+  {
+    run_stats(statsFile);
+  }
+  else
+  {
+    if (r == true)
+    {
+      run_program(false);
+    }
+    if (j == true)
+    {
+      run_program(true);
+    }
+  }
+  if (jitCheck == true && jit_check() == false)
+  {
+    return 1;
+  }
+  io_flush();
+  phase_end();
+  timings_report();
+
+  fclose(fpin);
+  fclose(fpout);
+  return 0;
+}
+#endif
+
+// Given the four values that make up an instruction, returns the address of
+// an instruction type object
+instruction *create_instruction(int op, int r, int l, int m)
+{
+	instruction *i = calloc(1, sizeof(instruction));
+	i->op = op;
+  i->r = r;
   i->l = l;
   i->m = m;
 
@@ -1505,306 +3176,5669 @@ void super_output(int pc, int bp, int sp,int data_stack[], int reg[], int activa
   return;
 }
 
-// takes in a single instruction and executes the command of that instruction
+// takes in a single instruction and executes the command of that instruction.
+// The trace is not printed here: every instruction leaves a trace_record in
+// a ring that a writer thread formats into fpout, or saves to --trace-file.
+// With trace filters, a step outside them costs one comparison, or a lookup
+// in the mask of traced instructions while a window of steps is open. The
+// first traced step after a gap is preceded by the state it starts from.
 void executionCycle(int *as_code)
 {
-  int sp = 0, bp = 1, pc = 0, halt = 1, i = 0, activate = 0, x;
-  int data_stack[MAX_DATA_STACK_HEIGHT] = {0}, reg[8] = {0};
+  int sp = 0, bp = 1, pc = 0, halt = 1, at = 0, hw = 0, called = 0;
+  volatile int pc0 = 0;
+  int *data_stack, reg[8] = {0};
+  long long steps = 0, traced = 0, start, end;
+  bool tracing;
+  char *mask;
   instruction *ir = create_instruction(0, 0, 0, 0);
+  instruction overflow;
+  vm_stack *stack = vm_stack_acquire(vm_stack_slots());
+  trace_ring *tr;
+  sigjmp_buf env;
 
-  // Capturing instruction integers indicated by program counter
-  ir = fetchCycle(as_code, ir, pc);
-
-  fprintf(fpout, "\t\tpc\tbp\tsp\tregisters\n");
-  fprintf(fpout, "Initial values\t%d\t%d\t%d\t", pc, bp, sp);
-  for (x = 0; x < 8; x++)
+  if (stack == NULL)
   {
-    fprintf(fpout, "%d ", reg[x]);
+    fprintf(fpout, "Could not allocate the data stack\n");
+    return;
   }
-  fprintf(fpout, "\nStack: ");
-  for (x = 0; x < MAX_DATA_STACK_HEIGHT; x++)
+  data_stack = stack->slots;
+  tr = trace_start(as_code, insIndex, stack->size);
+  if (tr == NULL)
   {
-    fprintf(fpout, "%d ", data_stack[x]);
+    fprintf(fpout, "Could not open the trace file\n");
+    vm_stack_release(stack);
+    return;
   }
-  fprintf(fpout, "\n");
+  mask = trace_mask(insIndex);
+  trace_window(0, &start, &end);
+  if (sigsetjmp(env, 1) != 0)
+  {
+    vm_overflow_jmp = NULL;
+    overflow = (instruction){ TRACE_OVERFLOW, ir->r, ir->l, ir->m };
+    trace_push(tr, pc0, &overflow, ir->op, 0, 0, reg);
+    trace_finish(tr);
+    free(mask);
+    vm_stack_release(stack);
+    return;
+  }
+  vm_overflow_jmp = &env;
+
+  // Capturing instruction integers indicated by program counter
+  ir = fetchCycle(as_code, ir, pc);
 
   while (halt == 1)
   {
+    pc0 = pc;
+    tracing = steps >= start && (mask == NULL || (at < insIndex && mask[at] != 0));
+    if (tracing && steps != traced)
+    {
+      trace_push_sync(tr, pc, steps, called, bp, sp, reg, data_stack, hw);
+    }
     switch(ir->op)
     {
        case 1:
-        fprintf(fpout, "%d lit %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
         reg[ir->r] = ir->m;
-        super_output(pc, bp, sp, data_stack, reg, activate);
         break;
 
        case 2:
-        fprintf(fpout, "%d rtn %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
         sp = bp - 1;
         bp = data_stack[sp + 3];
         pc = data_stack[sp + 4];
-        super_output(pc, bp, sp, data_stack, reg, activate);
         break;
 
        case 3:
-        fprintf(fpout, "%d lod %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
         reg[ir->r] = data_stack[vm_base(ir->l, bp, data_stack) + ir->m];
-        super_output(pc, bp, sp, data_stack, reg, activate);
         break;
 
        case 4:
-        fprintf(fpout, "%d sto %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
         data_stack[ vm_base(ir->l, bp, data_stack) + ir->m] = reg[ir->r];
-        super_output(pc, bp, sp, data_stack, reg, activate);
         break;
 
        case 5:
-        fprintf(fpout, "%d cal %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
         data_stack[sp + 1]  = 0;
         data_stack[sp + 2]  = vm_base(ir->l, bp, data_stack);
         data_stack[sp + 3]  = bp;
         data_stack[sp + 4]  = pc;
         bp = sp + 1;
         pc = ir->m;
-        super_output(pc, bp, sp, data_stack, reg, activate);
-        activate = 1;
+        called = 1;
         break;
 
        case 6:
-         fprintf(fpout, "%d inc %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
          sp = sp + ir->m;
-         super_output(pc, bp, sp, data_stack, reg, activate);
+         // The trace shows the stack up to sp, which has to be on the stack
+         if (sp < 0 || (size_t)sp + 1 >= stack->size)
+         {
+           siglongjmp(env, 1);
+         }
+         hw = (sp > hw) ? sp : hw;
          break;
 
        case 7:
-         fprintf(fpout, "%d jmp %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
          pc = ir->m;
-         super_output(pc, bp, sp, data_stack, reg, activate);
          break;
 
        case 8:
-         fprintf(fpout, "%d jpc %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
          if(reg[ir->r] == 0)
          {
              pc = ir->m;
          }
-         super_output(pc, bp, sp, data_stack, reg, activate);
          break;
 
-////////////////////////////////////?????????????????????
+       // The value written only shows in the trace
        case 9:
-         fprintf(fpout, "%d sio %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
-         fprintf(fpout, "%d", reg[ir->r]);
-         super_output(pc, bp, sp, data_stack, reg, activate);
          break;
 
          case 10:
-           fprintf(fpout, "%d sio %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
-           //stated in class to let the user know what they were scanning in
-           printf("Value: ");
-           scanf("%d", &reg[ir->r]);
-           super_output(pc, bp, sp, data_stack, reg, activate);
+           reg[ir->r] = io_read();
            break;
 
         case 11:
-          fprintf(fpout, "%d sio %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           halt = 0;
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 12:
-          fprintf(fpout, "%d neg %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = -reg[ir->r];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 13:
-          fprintf(fpout, "%d add %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] + reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 14:
-          fprintf(fpout, "%d sub %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] - reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 15:
-          fprintf(fpout, "%d mul %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] * reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 16:
-          fprintf(fpout, "%d div %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] / reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 17:
-          fprintf(fpout, "%d odd %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] % 2;
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 18:
-          fprintf(fpout, "%d mod %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] %  reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 19:
-          fprintf(fpout, "%d eql %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] == reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 20:
-          fprintf(fpout, "%d neq %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] != reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 21:
-          fprintf(fpout, "%d lss %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] < reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
         case 22:
-          fprintf(fpout, "%d leq %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] <= reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
           break;
 
          case 23:
-          fprintf(fpout, "%d gtr %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
-          reg[ir->r] = reg[ir->l] <= reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
+          reg[ir->r] = reg[ir->l] > reg[ir->m];
           break;
 
         case 24:
-          fprintf(fpout, "%d geq %d %d %d\t", ((pc - 1) < 0) ? 0 : pc - 1, ir->r, ir->l, ir->m);
           reg[ir->r] = reg[ir->l] >= reg[ir->m];
-          super_output(pc, bp, sp, data_stack, reg, activate);
+          break;
+
+        case 26:
+          if (ir->l >= 0)
+          {
+            data_stack[sp + 2] = vm_base(ir->l, bp, data_stack);
+          }
+          data_stack[sp + 3] = bp;
+          data_stack[sp + 4] = pc;
+          bp = sp + 1;
+          sp = sp + as_code[ir->m * 4 + 3];
+          if (sp < 0 || (size_t)sp + 1 >= stack->size)
+          {
+            siglongjmp(env, 1);
+          }
+          hw = (sp > hw) ? sp : hw;
+          pc = ir->m + 1;
+          called = 1;
+          break;
+
+        case 27:
+          if (ir->l >= 0)
+          {
+            data_stack[bp + 1] = vm_base(ir->l, bp, data_stack);
+          }
+          sp = bp - 1 + as_code[ir->m * 4 + 3];
+          if (sp < 0 || (size_t)sp + 1 >= stack->size)
+          {
+            siglongjmp(env, 1);
+          }
+          hw = (sp > hw) ? sp : hw;
+          pc = ir->m + 1;
+          break;
+
+        case 28:
+          reg[ir->r] = reg[ir->l];
+          break;
 
         default:
           printf("\tInvalid opcode\n");
       }
+      if (tracing && ir->op >= 1 && ir->op <= 28 && ir->op != 25)
+      {
+        trace_push(tr, pc0, ir, pc, bp, sp, reg);
+        traced = steps + 1;
+      }
+      at = pc;
       ir = fetchCycle(as_code, ir, pc++);
+      if (++steps == end)
+      {
+        trace_window(steps, &start, &end);
+      }
       // debugging
       // printf("ir->op == %d\n", ir->op);
   }
+  vm_overflow_jmp = NULL;
+  if (steps != traced)
+  {
+    trace_push_sync(tr, pc, steps, called, bp, sp, reg, data_stack, hw);
+  }
+  trace_finish(tr);
+  free(mask);
+  vm_stack_release(stack);
   return;
 }
 
-int vm_base(int l, int vm_base, int* data_stack)
+/////////////////////////////////// Trace writer ///////////////////////////////
+
+// The -v trace used to be printed by the VM itself, which then spent most of
+// its time in fprintf. Now the VM only fills a fixed size trace_record per
+// instruction into a single producer, single consumer ring, and a writer
+// thread either formats the records into fpout or encodes them into the
+// --trace-file, which tools/render_trace.c turns into the same text.
+// The stack is not in the records: the writer keeps its own copy, by
+// replaying the only two instructions that write to the stack, sto and cal.
+//
+// A trace file holds the program, then one step per instruction with only
+// what the instruction changed: pc when it is not the next one, bp, sp and
+// the registers as deltas, and the stack slots written. Every so often a
+// keyframe holds the whole state, and an index of the keyframes at the end
+// lets a reader start from the closest one to any step. Numbers are LEB128
+// varints, signed ones zigzag encoded.
+//
+//   header    trace_file_header, then code_len * 4 int32s of code
+//   step      flags byte (TRACE_*), then in this order whatever it flags:
+//             pc, next pc, bp delta, sp delta, a register mask byte and
+//             the deltas of those registers, and written slots as (index
+//             from sp, or from the previous slot + 1; value)
+//   keyframe  TRACE_KEYFRAME, step, next pc, bp, sp, 8 registers,
+//             activate, stack length and the stack
+//   overflow  TRACE_OVERFLOW_MARK, pc of the instruction that overflowed
+//   index     TRACE_INDEX_MARK, (step, offset) uint64 pairs, then
+//             trace_file_footer
+
+#define TRACE_RING_SIZE (1 << 16)  // records, a power of two
+#define TRACE_MAGIC "PL0T"
+#define TRACE_INDEX_MAGIC "PL0TIDX"
+#define TRACE_VERSION 2
+#define TRACE_KEY_STEPS 4096       // fewest steps between keyframes
+#define TRACE_PC 0x01              // step flags
+#define TRACE_NEXT_PC 0x02
+#define TRACE_BP 0x04
+#define TRACE_SP 0x08
+#define TRACE_REGS 0x10
+#define TRACE_SLOTS_SHIFT 5        // two bits: 0, 1, 4 or 3 slots written
+#define TRACE_INDEX_MARK 0xfd
+#define TRACE_OVERFLOW_MARK 0xfe
+#define TRACE_KEYFRAME 0xff
+
+char *traceNames[29] = { "", "lit", "rtn", "lod", "sto", "cal", "inc", "jmp",
+                         "jpc", "sio", "sio", "sio", "neg", "add", "sub", "mul",
+                         "div", "odd", "mod", "eql", "neq", "lss", "leq", "gtr",
+                         "geq", "lzy", "lcl", "tcl", "mov" };
+
+// Sets up a copy of a stack of slots slots, which starts out cleared like
+// every stack vm_stack_acquire() hands out
+bool trace_shadow_init(trace_shadow *sh, size_t slots)
 {
-  int b1; // find vm_base L levels down
-  b1 = vm_base;
-  while (l > 0)
+  memset(sh, 0, sizeof(trace_shadow));
+  sh->stack = calloc(slots, sizeof(int));
+  sh->slots = slots;
+  sh->bp = 1;
+  return sh->stack != NULL && slots >= MAX_DATA_STACK_HEIGHT;
+}
+
+// Prints the lines the trace starts with, before any instruction has run
+void trace_print_start()
+{
+  int x;
+
+  fprintf(fpout, "\t\tpc\tbp\tsp\tregisters\n");
+  fprintf(fpout, "Initial values\t%d\t%d\t%d\t", 0, 1, 0);
+  for (x = 0; x < 8; x++)
   {
-    b1 = data_stack[b1 + 1];
-    l--;
+    fprintf(fpout, "%d ", 0);
   }
-  return b1;
+  fprintf(fpout, "\nStack: ");
+  for (x = 0; x < MAX_DATA_STACK_HEIGHT; x++)
+  {
+    fprintf(fpout, "%d ", 0);
+  }
+  fprintf(fpout, "\n");
 }
 
-void print_stack(int* as_code, int i)
+// Writes value to slot i of the copy of the stack, if the slot is on it
+void trace_shadow_store(trace_shadow *sh, int i, int value)
 {
-    int* op, r, l, m;
-    fprintf(fpout, "Line \t OP \t R \t L \t M\n");
-    int lines = i/4;
-    int k =0;
-    for(int j=0; j<=lines; j++)
+  if (i >= 0 && (size_t)i < sh->slots)
+  {
+    sh->stack[i] = value;
+    if (i >= sh->top)
     {
-        fprintf(fpout, "%d \t", j); // line
-        switch (as_code[k])
-        {
-          case 1:
-            fprintf(fpout, "lit \t");
-            break;
-
-          case 2:
-            fprintf(fpout, "rtn \t");
-            break;
-
-          case 3:
-            fprintf(fpout, "lod \t");
-            break;
+      sh->top = i + 1;
+    }
+  }
+}
 
-          case 4:
-            fprintf(fpout, "sto \t");
-            break;
+// Replays the stack writes of one record on the copy of the stack and
+// returns how many slots it wrote, listing them in slots
+int trace_replay(trace_shadow *sh, trace_record *t, int *slots)
+{
+  int i;
 
-          case 5:
-            fprintf(fpout, "cal \t");
-            break;
+  if (t->op == 4)
+  {
+    slots[0] = vm_base(t->l, sh->bp, sh->stack) + t->m;
+    trace_shadow_store(sh, slots[0], t->reg[t->r]);
+    return 1;
+  }
+  if (t->op == 5)
+  {
+    for (i = 0; i < 4; i++)
+    {
+      slots[i] = t->sp + 1 + i;
+    }
+    trace_shadow_store(sh, t->sp + 1, 0);
+    trace_shadow_store(sh, t->sp + 2, vm_base(t->l, sh->bp, sh->stack));
+    trace_shadow_store(sh, t->sp + 3, sh->bp);
+    trace_shadow_store(sh, t->sp + 4, t->pc);
+    return 4;
+  }
+  // A light call writes no return value, and no static link with l < 0,
+  // leaving that slot as it was
+  if (t->op == 26)
+  {
+    for (i = 0; i < 3; i++)
+    {
+      slots[i] = t->bp + 1 + i;
+    }
+    if (t->l >= 0)
+    {
+      trace_shadow_store(sh, t->bp + 1, vm_base(t->l, sh->bp, sh->stack));
+    }
+    trace_shadow_store(sh, t->bp + 2, sh->bp);
+    trace_shadow_store(sh, t->bp + 3, t->pc);
+    return 3;
+  }
+  // A tail call keeps the frame, and its links but the static one
+  if (t->op == 27 && t->l >= 0)
+  {
+    slots[0] = t->bp + 1;
+    trace_shadow_store(sh, slots[0], vm_base(t->l, sh->bp, sh->stack));
+    return 1;
+  }
+  return 0;
+}
 
-          case 6:
-            fprintf(fpout, "inc \t");
-            break;
+// Prints one record the way executionCycle() printed the instruction, once
+// the copy of the stack has its writes
+void trace_print(trace_shadow *sh, trace_record *t)
+{
+  // The instruction that overflowed the stack, whose opcode is in next_pc
+  if (t->op == TRACE_OVERFLOW)
+  {
+    if (t->next_pc >= 1 && t->next_pc <= 27)
+    {
+      fprintf(fpout, "%d %s %d %d %d\t", ((t->pc - 1) < 0) ? 0 : t->pc - 1,
+              traceNames[t->next_pc], t->r, t->l, t->m);
+    }
+    fprintf(fpout, "\nStack overflow\n");
+    return;
+  }
+  fprintf(fpout, "%d %s %d %d %d\t", ((t->pc - 1) < 0) ? 0 : t->pc - 1,
+          traceNames[t->op], t->r, t->l, t->m);
+  if (t->op == 9)
+  {
+    fprintf(fpout, "%d", t->reg[t->r]);
+  }
+  super_output(t->next_pc, t->bp, t->sp, sh->stack, t->reg, sh->activate);
+  if (t->op == 5 || t->op == 26)
+  {
+    sh->activate = 1;
+  }
+  sh->bp = t->bp;
+}
 
-          case 7:
-            fprintf(fpout, "jmp \t");
-            break;
+// Appends the bytes of a trace file to the encoder's buffer
+void trace_put(trace_encoder *e, void *bytes, size_t len)
+{
+  if (e->len + len > sizeof(e->buf))
+  {
+    fwrite(e->buf, 1, e->len, e->fp);
+    e->len = 0;
+  }
+  if (len > sizeof(e->buf))
+  {
+    fwrite(bytes, 1, len, e->fp);
+  }
+  else
+  {
+    memcpy(e->buf + e->len, bytes, len);
+    e->len += len;
+  }
+  e->offset += len;
+}
 
-          case 8:
-            fprintf(fpout, "jpc \t");
-            break;
+void trace_put_byte(trace_encoder *e, int byte)
+{
+  uint8_t b = byte;
 
-          case 9:
-            fprintf(fpout, "sio \t");
-            break;
+  trace_put(e, &b, 1);
+}
 
-          case 10:
-            fprintf(fpout, "sio \t");
-            break;
+void trace_put_varint(trace_encoder *e, uint64_t v)
+{
+  uint8_t bytes[10];
+  int n = 0;
 
-          case 11:
-            fprintf(fpout, "sio \t");
-            break;
+  while (v >= 0x80)
+  {
+    bytes[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  bytes[n++] = v;
+  trace_put(e, bytes, n);
+}
 
-          case 12:
-            fprintf(fpout, "neg \t");
-            break;
+void trace_put_signed(trace_encoder *e, int64_t v)
+{
+  trace_put_varint(e, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
 
-          case 13:
-            fprintf(fpout, "add \t");
-            break;
+// Writes the whole state after the steps so far and adds it to the index
+void trace_keyframe(trace_encoder *e, trace_shadow *sh)
+{
+  int i;
 
-          case 14:
-            fprintf(fpout, "sub \t");
-            break;
+  if (e->keys_len == e->keys_cap)
+  {
+    e->keys_cap = (e->keys_cap == 0) ? 64 : e->keys_cap * 2;
+    e->keys = realloc(e->keys, e->keys_cap * sizeof(trace_key));
+  }
+  e->keys[e->keys_len].step = e->steps;
+  e->keys[e->keys_len++].offset = e->offset;
+  e->key_offset = e->offset;
+  e->key_step = e->steps;
+
+  trace_put_byte(e, TRACE_KEYFRAME);
+  trace_put_varint(e, e->steps);
+  trace_put_signed(e, e->next_pc);
+  trace_put_signed(e, e->bp);
+  trace_put_signed(e, e->sp);
+  for (i = 0; i < MAX_REGISTERS; i++)
+  {
+    trace_put_signed(e, e->reg[i]);
+  }
+  trace_put_byte(e, sh->activate);
+  trace_put_varint(e, sh->top);
+  for (i = 0; i < sh->top; i++)
+  {
+    trace_put_signed(e, sh->stack[i]);
+  }
+  e->key_size = e->offset - e->key_offset;
+}
 
-          case 15:
-            fprintf(fpout, "mul \t");
-            break;
+// Encodes one record as the changes from the state before it. A keyframe
+// goes first once TRACE_KEY_STEPS steps and as many bytes as the last
+// keyframe took have been written since it, so keyframes never take more
+// than about half of a trace.
+void trace_encode(trace_encoder *e, trace_shadow *sh, trace_record *t)
+{
+  int slots[4], count, flags = 0, mask = 0, i, pc = (e->steps == 0) ? 0 : e->next_pc + 1;
 
-          case 16:
-            fprintf(fpout, "div \t");
-            break;
+  if (e->steps - e->key_step >= TRACE_KEY_STEPS
+      && e->offset - e->key_offset >= e->key_size)
+  {
+    trace_keyframe(e, sh);
+  }
+  if (t->op == TRACE_OVERFLOW)
+  {
+    trace_put_byte(e, TRACE_OVERFLOW_MARK);
+    trace_put_varint(e, t->pc);
+    return;
+  }
+  count = trace_replay(sh, t, slots);
+  for (i = 0; i < MAX_REGISTERS; i++)
+  {
+    if (t->reg[i] != e->reg[i])
+    {
+      mask |= 1 << i;
+    }
+  }
+  flags |= (t->pc != pc) ? TRACE_PC : 0;
+  flags |= (t->next_pc != t->pc) ? TRACE_NEXT_PC : 0;
+  flags |= (t->bp != e->bp) ? TRACE_BP : 0;
+  flags |= (t->sp != e->sp) ? TRACE_SP : 0;
+  flags |= (mask != 0) ? TRACE_REGS : 0;
+  flags |= ((count == 4) ? 2 : count) << TRACE_SLOTS_SHIFT;
+
+  trace_put_byte(e, flags);
+  if (flags & TRACE_PC)
+  {
+    trace_put_varint(e, t->pc);
+  }
+  if (flags & TRACE_NEXT_PC)
+  {
+    trace_put_signed(e, t->next_pc);
+  }
+  if (flags & TRACE_BP)
+  {
+    trace_put_signed(e, (int64_t)t->bp - e->bp);
+  }
+  if (flags & TRACE_SP)
+  {
+    trace_put_signed(e, (int64_t)t->sp - e->sp);
+  }
+  if (flags & TRACE_REGS)
+  {
+    trace_put_byte(e, mask);
+    for (i = 0; i < MAX_REGISTERS; i++)
+    {
+      if (mask & (1 << i))
+      {
+        trace_put_signed(e, (int64_t)t->reg[i] - e->reg[i]);
+      }
+    }
+  }
+  for (i = 0; i < count; i++)
+  {
+    trace_put_signed(e, (i == 0) ? (int64_t)slots[0] - t->sp : slots[i] - slots[i - 1] - 1);
+    trace_put_signed(e, sh->stack[slots[i]]);
+  }
+  sh->bp = t->bp;
+  if (t->op == 5 || t->op == 26)
+  {
+    sh->activate = 1;
+  }
+  e->next_pc = t->next_pc;
+  e->bp = t->bp;
+  e->sp = t->sp;
+  memcpy(e->reg, t->reg, sizeof(e->reg));
+  e->steps++;
+}
 
-          case 17:
-            fprintf(fpout, "odd \t");
-            break;
+// Opens a trace file for code and writes its header and the keyframe of the
+// initial state. Returns NULL if the file cannot be written.
+trace_encoder *trace_encoder_open(char *path, int *code, int n, size_t slots)
+{
+  trace_encoder *e = calloc(1, sizeof(trace_encoder));
+  trace_file_header h = { TRACE_MAGIC, TRACE_VERSION, n, slots };
 
-          case 18:
-            fprintf(fpout, "mod \t");
-            break;
+  e->fp = fopen(path, "wb");
+  if (e->fp == NULL)
+  {
+    free(e);
+    return NULL;
+  }
+  e->bp = 1;
+  trace_put(e, &h, sizeof(h));
+  trace_put(e, code, n * 4 * sizeof(int));
+  return e;
+}
 
-          case 19:
-            fprintf(fpout, "eql \t");
-            break;
+// Writes the index of keyframes and closes the trace file
+void trace_encoder_close(trace_encoder *e)
+{
+  trace_file_footer f = { e->offset + 1, e->keys_len, TRACE_INDEX_MAGIC };
+
+  trace_put_byte(e, TRACE_INDEX_MARK);
+  trace_put(e, e->keys, e->keys_len * sizeof(trace_key));
+  trace_put(e, &f, sizeof(f));
+  fwrite(e->buf, 1, e->len, e->fp);
+  fclose(e->fp);
+  free(e->keys);
+  free(e);
+}
 
-          case 20:
-            fprintf(fpout, "neq \t");
-            break;
+// Applies a record to a copy of the state of the VM without writing it out:
+// sh is the copy of the stack, last the registers after the last step, and
+// steps the steps run so far. Used for the records --trace-last drops.
+void trace_apply(trace_shadow *sh, trace_record *last, uint64_t *steps, trace_record *t)
+{
+  int slots[4], i;
 
-          case 21:
-            fprintf(fpout, "lss \t");
-            break;
+  if (t->op == TRACE_STACK)
+  {
+    for (i = 0; i < t->r; i++)
+    {
+      trace_shadow_store(sh, t->pc + i, t->reg[i]);
+    }
+  }
+  else if (t->op == TRACE_SYNC)
+  {
+    *last = *t;
+    last->next_pc = t->pc - 1;
+    sh->bp = t->bp;
+    sh->activate = t->m;
+    *steps = (uint32_t)t->r | (uint64_t)(uint32_t)t->l << 32;
+  }
+  else if (t->op != TRACE_OVERFLOW)
+  {
+    trace_replay(sh, t, slots);
+    sh->bp = t->bp;
+    if (t->op == 5 || t->op == 26)
+    {
+      sh->activate = 1;
+    }
+    *last = *t;
+    (*steps)++;
+  }
+}
+
+// Formats or encodes one record. A sync record becomes a keyframe in a
+// trace file, and a line saying how many steps were not traced in the text.
+void trace_emit(trace_ring *tr, trace_record *t)
+{
+  trace_encoder *e = tr->enc;
+  trace_record last;
+  uint64_t steps = tr->steps;
+  int slots[4];
+
+  if (t->op == TRACE_STACK || t->op == TRACE_SYNC)
+  {
+    trace_apply(&tr->shadow, &last, &tr->steps, t);
+    if (t->op == TRACE_STACK)
+    {
+      return;
+    }
+    if (e != NULL)
+    {
+      e->steps = tr->steps;
+      e->next_pc = last.next_pc;
+      e->bp = last.bp;
+      e->sp = last.sp;
+      memcpy(e->reg, last.reg, sizeof(e->reg));
+      trace_keyframe(e, &tr->shadow);
+    }
+    else if (tr->steps > steps)
+    {
+      fprintf(fpout, "(%llu steps not traced)\n", (unsigned long long)(tr->steps - steps));
+    }
+    return;
+  }
+  if (e != NULL)
+  {
+    trace_encode(e, &tr->shadow, t);
+  }
+  else
+  {
+    if (t->op != TRACE_OVERFLOW)
+    {
+      trace_replay(&tr->shadow, t, slots);
+    }
+    trace_print(&tr->shadow, t);
+  }
+  tr->steps += (t->op != TRACE_OVERFLOW);
+}
+
+// Keeps a record for --trace-last, dropping the oldest records into the
+// state before the kept ones once more steps than asked for are kept
+void trace_keep(trace_ring *tr, trace_record *t)
+{
+  trace_record *old = tr->kept;
+  uint64_t i;
+
+  if (tr->kept_tail - tr->kept_head == tr->kept_cap)
+  {
+    tr->kept_cap = (tr->kept_cap == 0) ? 1024 : tr->kept_cap * 2;
+    tr->kept = malloc(tr->kept_cap * sizeof(trace_record));
+    for (i = tr->kept_head; i < tr->kept_tail; i++)
+    {
+      tr->kept[i & (tr->kept_cap - 1)] = old[i & (tr->kept_cap / 2 - 1)];
+    }
+    free(old);
+  }
+  tr->kept[tr->kept_tail++ & (tr->kept_cap - 1)] = *t;
+  tr->kept_steps += (t->op >= 1 || t->op == TRACE_OVERFLOW);
+  while (tr->kept_steps > (uint64_t)traceFilter.last)
+  {
+    t = &tr->kept[tr->kept_head++ & (tr->kept_cap - 1)];
+    tr->kept_steps -= (t->op >= 1 || t->op == TRACE_OVERFLOW);
+    trace_apply(&tr->snap, &tr->snap_last, &tr->snap_steps, t);
+  }
+}
+
+// Writes out the kept records, after the state before them if records were
+// dropped. A sync at the front is folded into that state, so there is one
+// line about the steps left out.
+void trace_flush_kept(trace_ring *tr)
+{
+  trace_record t, *front;
+  int i;
+
+  while (tr->kept_head < tr->kept_tail)
+  {
+    front = &tr->kept[tr->kept_head & (tr->kept_cap - 1)];
+    if (front->op != TRACE_STACK && front->op != TRACE_SYNC)
+    {
+      break;
+    }
+    trace_apply(&tr->snap, &tr->snap_last, &tr->snap_steps, front);
+    tr->kept_head++;
+  }
+  if (tr->snap_steps > 0)
+  {
+    for (i = 0; i < tr->snap.top; i += MAX_REGISTERS)
+    {
+      memset(&t, 0, sizeof(t));
+      t.op = TRACE_STACK;
+      t.pc = i;
+      t.r = (tr->snap.top - i < MAX_REGISTERS) ? tr->snap.top - i : MAX_REGISTERS;
+      memcpy(t.reg, tr->snap.stack + i, t.r * sizeof(int));
+      trace_emit(tr, &t);
+    }
+    t = tr->snap_last;
+    t.op = TRACE_SYNC;
+    t.pc = tr->snap_last.next_pc + 1;
+    t.r = (int32_t)(uint32_t)tr->snap_steps;
+    t.l = (int32_t)(uint32_t)(tr->snap_steps >> 32);
+    t.m = tr->snap.activate;
+    trace_emit(tr, &t);
+  }
+  for (; tr->kept_head < tr->kept_tail; tr->kept_head++)
+  {
+    trace_emit(tr, &tr->kept[tr->kept_head & (tr->kept_cap - 1)]);
+  }
+}
+
+// Takes the records the VM has published and formats or encodes them,
+// until the VM is done and the ring is empty
+void *trace_writer(void *arg)
+{
+  trace_ring *tr = arg;
+  uint64_t head = tr->head, tail, n, k;
+  struct timespec nap = { 0, 50000 };
+  trace_record *t;
+  bool done;
+
+  while (1)
+  {
+    done = __atomic_load_n(&tr->done, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+      if (done)
+      {
+        break;
+      }
+      nanosleep(&nap, NULL);
+      continue;
+    }
+    n = tail - head;
+    for (k = 0; k < n; k++)
+    {
+      t = &tr->slots[(head + k) & (TRACE_RING_SIZE - 1)];
+      if (traceFilter.last > 0)
+      {
+        trace_keep(tr, t);
+      }
+      else
+      {
+        trace_emit(tr, t);
+      }
+    }
+    head += n;
+    __atomic_store_n(&tr->head, head, __ATOMIC_RELEASE);
+  }
+  if (traceFilter.last > 0)
+  {
+    trace_flush_kept(tr);
+  }
+  return NULL;
+}
+
+// Marks the instructions in the --trace-pc ranges and --trace-proc
+// procedures of a program of n instructions. Procedures are looked up in the
+// symbol table, or by the names block() kept when their entry was reused.
+// Returns NULL when every instruction is traced.
+char *trace_mask(int n)
+{
+  char *mask;
+  int i, k, proc;
+
+  if (traceFilter.range_count == 0 && traceFilter.proc_count == 0)
+  {
+    return NULL;
+  }
+  mask = calloc(n + 1, 1);
+  for (k = 0; k < traceFilter.range_count; k++)
+  {
+    for (i = traceFilter.ranges[k][0]; i <= traceFilter.ranges[k][1] && i < n; i++)
+    {
+      mask[(i < 0) ? 0 : i] = 1;
+    }
+  }
+  for (k = 0; k < traceFilter.proc_count; k++)
+  {
+    proc = -1;
+    for (i = 1; i < symbolCapacity && proc < 0; i++)
+    {
+      if (symbol_table[i].kind == 3 && strcmp(symbol_table[i].name, traceFilter.procs[k]) == 0
+          && symbol_table[i].addr >= 0 && symbol_table[i].addr < n)
+      {
+        proc = insProc[symbol_table[i].addr];
+      }
+    }
+    for (i = 0; i < procCount && proc < 0; i++)
+    {
+      if (strcmp(procNames[i], traceFilter.procs[k]) == 0)
+      {
+        proc = i;
+      }
+    }
+    if (proc < 0)
+    {
+      printf("Err: no procedure %s to trace\n", traceFilter.procs[k]);
+    }
+    for (i = 0; i < n && proc >= 0; i++)
+    {
+      mask[i] |= (insProc[i] == proc);
+    }
+  }
+  return mask;
+}
+
+// Finds the next window of steps, at or after steps, that --trace-first and
+// --trace-every let through: [start, end)
+void trace_window(long long steps, long long *start, long long *end)
+{
+  long long every = traceFilter.every, first = traceFilter.first;
+
+  *start = steps;
+  *end = LLONG_MAX;
+  if (every > 1)
+  {
+    *start = (steps + every - 1) / every * every;
+    *end = *start + 1;
+  }
+  if (first > 0 && *start >= first)
+  {
+    *start = *end = LLONG_MAX;
+  }
+  else if (first > 0 && *end > first)
+  {
+    *end = first;
+  }
+}
+
+// Sets up a ring and starts its writer, for a VM running code of n
+// instructions on a stack of slots slots. Returns NULL if the trace file
+// cannot be written.
+trace_ring *trace_start(int *code, int n, size_t slots)
+{
+  trace_ring *tr = calloc(1, sizeof(trace_ring));
+
+  tr->slots = aligned_alloc(64, TRACE_RING_SIZE * sizeof(trace_record));
+  trace_shadow_init(&tr->shadow, slots);
+  if (traceFilter.last > 0)
+  {
+    trace_shadow_init(&tr->snap, slots);
+  }
+  if (traceFile != NULL)
+  {
+    tr->enc = trace_encoder_open(traceFile, code, n, slots);
+    if (tr->enc == NULL)
+    {
+      free(tr->snap.stack);
+      free(tr->shadow.stack);
+      free(tr->slots);
+      free(tr);
+      return NULL;
+    }
+    trace_keyframe(tr->enc, &tr->shadow);
+  }
+  else
+  {
+    trace_print_start();
+  }
+  pthread_create(&tr->thread, NULL, trace_writer, tr);
+  return tr;
+}
+
+// Returns the next free record of the ring, waiting while the writer is a
+// whole ring behind. trace_publish() hands it to the writer.
+trace_record *trace_slot(trace_ring *tr)
+{
+  while (tr->tail - __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE)
+  {
+    sched_yield();
+  }
+  return &tr->slots[tr->tail & (TRACE_RING_SIZE - 1)];
+}
+
+void trace_publish(trace_ring *tr)
+{
+  __atomic_store_n(&tr->tail, tr->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Publishes the record of one instruction: the pc it ran at, the
+// instruction, and pc, bp, sp and the registers after it
+void trace_push(trace_ring *tr, int pc, instruction *ir, int next_pc, int bp, int sp, int *reg)
+{
+  trace_record *t = trace_slot(tr);
+
+  t->pc = pc;
+  t->op = ir->op;
+  t->r = ir->r;
+  t->l = ir->l;
+  t->m = ir->m;
+  t->next_pc = next_pc;
+  t->bp = bp;
+  t->sp = sp;
+  memcpy(t->reg, reg, sizeof(t->reg));
+  trace_publish(tr);
+}
+
+// Publishes the state of the VM after steps steps, before the next traced
+// one at pc: the stack up to a few slots past the highest sp it reached, in
+// TRACE_STACK records of MAX_REGISTERS slots each, then a TRACE_SYNC record
+// with the step count in r and l, whether a call has run in m, and bp, sp
+// and the registers
+void trace_push_sync(trace_ring *tr, int pc, long long steps, int activate, int bp, int sp, int *reg, int *data_stack, int top)
+{
+  trace_record *t;
+  int slots = ((top > sp) ? top : sp) + 5, i;
+
+  slots = ((size_t)slots > tr->shadow.slots) ? (int)tr->shadow.slots : slots;
+  for (i = 0; i < slots; i += MAX_REGISTERS)
+  {
+    t = trace_slot(tr);
+    t->op = TRACE_STACK;
+    t->pc = i;
+    t->r = (slots - i < MAX_REGISTERS) ? slots - i : MAX_REGISTERS;
+    memcpy(t->reg, data_stack + i, t->r * sizeof(int));
+    trace_publish(tr);
+  }
+  t = trace_slot(tr);
+  t->op = TRACE_SYNC;
+  t->pc = pc;
+  t->r = (int32_t)(uint32_t)steps;
+  t->l = (int32_t)(uint32_t)((uint64_t)steps >> 32);
+  t->m = activate;
+  t->bp = bp;
+  t->sp = sp;
+  memcpy(t->reg, reg, sizeof(t->reg));
+  trace_publish(tr);
+}
+
+// Waits for the writer to drain the ring, then frees it
+void trace_finish(trace_ring *tr)
+{
+  __atomic_store_n(&tr->done, true, __ATOMIC_RELEASE);
+  pthread_join(tr->thread, NULL);
+  if (tr->enc != NULL)
+  {
+    trace_encoder_close(tr->enc);
+  }
+  fflush(fpout);
+  free(tr->kept);
+  free(tr->snap.stack);
+  free(tr->shadow.stack);
+  free(tr->slots);
+  free(tr);
+}
+
+////////////////////////////////// Trace reader ////////////////////////////////
+
+// Reads the byte at the reader's position, or returns -1 at the end
+int trace_get_byte(trace_reader *rd)
+{
+  if (rd->pos == rd->len)
+  {
+    rd->len = fread(rd->buf, 1, sizeof(rd->buf), rd->fp);
+    rd->pos = 0;
+    if (rd->len == 0)
+    {
+      return -1;
+    }
+  }
+  return rd->buf[rd->pos++];
+}
+
+uint64_t trace_get_varint(trace_reader *rd)
+{
+  uint64_t v = 0;
+  int shift = 0, b;
+
+  do
+  {
+    b = trace_get_byte(rd);
+    if (b < 0)
+    {
+      rd->bad = true;
+      return 0;
+    }
+    v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while ((b & 0x80) && shift < 64);
+  return v;
+}
+
+int64_t trace_get_signed(trace_reader *rd)
+{
+  uint64_t v = trace_get_varint(rd);
+
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Moves the reader to the keyframe at a byte offset of the file and loads
+// it. Returns false if there is no keyframe there.
+bool trace_seek_keyframe(trace_reader *rd, uint64_t offset)
+{
+  fseek(rd->fp, offset, SEEK_SET);
+  rd->len = rd->pos = 0;
+  if (trace_get_byte(rd) != TRACE_KEYFRAME)
+  {
+    return false;
+  }
+  trace_read_keyframe(rd);
+  return !rd->bad;
+}
+
+// Opens a trace file and reads its program and index. Returns NULL if it is
+// not a trace file.
+trace_reader *trace_open(char *path)
+{
+  trace_reader *rd = calloc(1, sizeof(trace_reader));
+  trace_file_header h;
+  trace_file_footer f;
+
+  rd->fp = fopen(path, "rb");
+  if (rd->fp == NULL || fread(&h, sizeof(h), 1, rd->fp) != 1
+      || memcmp(h.magic, TRACE_MAGIC, 4) != 0 || h.version != TRACE_VERSION
+      || h.slots < MAX_DATA_STACK_HEIGHT)
+  {
+    trace_close(rd);
+    return NULL;
+  }
+  rd->n = h.code_len;
+  rd->code = malloc(rd->n * 4 * sizeof(int));
+  if (rd->code == NULL || trace_shadow_init(&rd->shadow, h.slots) == false
+      || fread(rd->code, sizeof(int), rd->n * 4, rd->fp) != (size_t)rd->n * 4)
+  {
+    trace_close(rd);
+    return NULL;
+  }
+  rd->start = sizeof(h) + rd->n * 4 * sizeof(int);
+
+  // A trace cut short by a crash has no index, and is read from the start
+  if (fseek(rd->fp, -(long)sizeof(f), SEEK_END) == 0 && fread(&f, sizeof(f), 1, rd->fp) == 1
+      && memcmp(f.magic, TRACE_INDEX_MAGIC, sizeof(f.magic)) == 0)
+  {
+    rd->keys = malloc(f.keys * sizeof(trace_key));
+    rd->keys_len = f.keys;
+    fseek(rd->fp, f.index_offset, SEEK_SET);
+    if (fread(rd->keys, sizeof(trace_key), f.keys, rd->fp) != f.keys)
+    {
+      rd->keys_len = 0;
+    }
+  }
+  if (trace_seek_keyframe(rd, rd->start) == false)
+  {
+    trace_close(rd);
+    return NULL;
+  }
+  return rd;
+}
+
+void trace_close(trace_reader *rd)
+{
+  if (rd->fp != NULL)
+  {
+    fclose(rd->fp);
+  }
+  free(rd->code);
+  free(rd->keys);
+  free(rd->shadow.stack);
+  free(rd);
+}
+
+// Loads the keyframe whose marker has just been read
+void trace_read_keyframe(trace_reader *rd)
+{
+  trace_shadow *sh = &rd->shadow;
+  uint64_t top;
+  uint64_t step = trace_get_varint(rd);
+  int i;
+
+  // A keyframe past the steps decoded follows steps that were not traced
+  rd->skipped += (step > rd->step) ? step - rd->step : 0;
+  rd->step = step;
+  rd->next_pc = trace_get_signed(rd);
+  rd->bp = trace_get_signed(rd);
+  rd->sp = trace_get_signed(rd);
+  for (i = 0; i < MAX_REGISTERS; i++)
+  {
+    rd->reg[i] = trace_get_signed(rd);
+  }
+  sh->activate = trace_get_byte(rd);
+  sh->bp = rd->bp;
+  top = trace_get_varint(rd);
+  memset(sh->stack, 0, sh->top * sizeof(int));
+  sh->top = 0;
+  for (i = 0; (uint64_t)i < top && !rd->bad; i++)
+  {
+    trace_shadow_store(sh, i, trace_get_signed(rd));
+  }
+}
+
+// Decodes the next step into t, applying its writes to the copy of the
+// stack. Returns false at the end of the trace.
+bool trace_read_step(trace_reader *rd, trace_record *t)
+{
+  int flags, mask, count, i, slot = 0, pc, at;
+
+  while ((flags = trace_get_byte(rd)) == TRACE_KEYFRAME)
+  {
+    trace_read_keyframe(rd);
+  }
+  if (flags < 0 || flags == TRACE_INDEX_MARK || rd->bad)
+  {
+    return false;
+  }
+  pc = (rd->step == 0) ? 0 : rd->next_pc + 1;
+  if (flags == TRACE_OVERFLOW_MARK)
+  {
+    pc = trace_get_varint(rd);
+    at = (pc == 0) ? 0 : pc - 1;
+    memset(t, 0, sizeof(trace_record));
+    t->pc = pc;
+    t->op = TRACE_OVERFLOW;
+    if (at < rd->n)
+    {
+      t->next_pc = rd->code[at * 4];
+      t->r = rd->code[at * 4 + 1];
+      t->l = rd->code[at * 4 + 2];
+      t->m = rd->code[at * 4 + 3];
+    }
+    return true;
+  }
+  if (flags & TRACE_PC)
+  {
+    pc = trace_get_varint(rd);
+  }
+  at = (pc == 0) ? 0 : pc - 1;
+  if (at >= rd->n)
+  {
+    rd->bad = true;
+    return false;
+  }
+  t->pc = pc;
+  t->op = rd->code[at * 4];
+  t->r = rd->code[at * 4 + 1];
+  t->l = rd->code[at * 4 + 2];
+  t->m = rd->code[at * 4 + 3];
+  t->next_pc = (flags & TRACE_NEXT_PC) ? trace_get_signed(rd) : pc;
+  t->bp = rd->bp + ((flags & TRACE_BP) ? trace_get_signed(rd) : 0);
+  t->sp = rd->sp + ((flags & TRACE_SP) ? trace_get_signed(rd) : 0);
+  memcpy(t->reg, rd->reg, sizeof(t->reg));
+  if (flags & TRACE_REGS)
+  {
+    mask = trace_get_byte(rd);
+    for (i = 0; i < MAX_REGISTERS; i++)
+    {
+      if (mask & (1 << i))
+      {
+        t->reg[i] += trace_get_signed(rd);
+      }
+    }
+  }
+  count = (flags >> TRACE_SLOTS_SHIFT) & 3;
+  count = (count == 2) ? 4 : count;
+  for (i = 0; i < count; i++)
+  {
+    slot = (i == 0) ? t->sp + trace_get_signed(rd) : slot + 1 + trace_get_signed(rd);
+    trace_shadow_store(&rd->shadow, slot, trace_get_signed(rd));
+  }
+  rd->next_pc = t->next_pc;
+  rd->bp = t->bp;
+  rd->sp = t->sp;
+  memcpy(rd->reg, t->reg, sizeof(rd->reg));
+  rd->step++;
+  return !rd->bad;
+}
+
+// Renders a trace file into fpout as the text -v prints. Returns false if
+// it is not a trace file.
+bool trace_render_file(char *path)
+{
+  trace_reader *rd = trace_open(path);
+  trace_record t;
+
+  if (rd == NULL)
+  {
+    return false;
+  }
+  trace_print_start();
+  rd->skipped = 0;
+  while (trace_read_step(rd, &t))
+  {
+    if (rd->skipped > 0)
+    {
+      fprintf(fpout, "(%llu steps not traced)\n", (unsigned long long)rd->skipped);
+      rd->skipped = 0;
+    }
+    trace_print(&rd->shadow, &t);
+  }
+  if (rd->skipped > 0)
+  {
+    fprintf(fpout, "(%llu steps not traced)\n", (unsigned long long)rd->skipped);
+  }
+  trace_close(rd);
+  return true;
+}
+
+// Prints the state after step steps of a trace file, starting from the
+// last keyframe before it. Returns false if the trace is shorter, or the
+// step was not traced.
+bool trace_state_at(char *path, uint64_t step)
+{
+  trace_reader *rd = trace_open(path);
+  trace_record t;
+  size_t lo = 0, hi, mid;
+  int x;
+
+  if (rd == NULL)
+  {
+    return false;
+  }
+  if (rd->keys_len > 0)
+  {
+    hi = rd->keys_len;
+    while (hi - lo > 1)
+    {
+      mid = (lo + hi) / 2;
+      if (rd->keys[mid].step <= step)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    if (trace_seek_keyframe(rd, rd->keys[lo].offset) == false)
+    {
+      trace_close(rd);
+      return false;
+    }
+  }
+  while (rd->step < step && trace_read_step(rd, &t))
+    ;
+  if (rd->step != step || rd->bad)
+  {
+    trace_close(rd);
+    return false;
+  }
+  fprintf(fpout, "step %llu\npc %d\nbp %d\nsp %d\nregisters", (unsigned long long)step,
+          rd->next_pc, rd->bp, rd->sp);
+  for (x = 0; x < MAX_REGISTERS; x++)
+  {
+    fprintf(fpout, " %d", rd->reg[x]);
+  }
+  fprintf(fpout, "\nstack");
+  for (x = 1; x <= rd->sp && (size_t)x < rd->shadow.slots; x++)
+  {
+    fprintf(fpout, " %d", rd->shadow.stack[x]);
+  }
+  fprintf(fpout, "\n");
+  trace_close(rd);
+  return true;
+}
+
+int vm_base(int l, int vm_base, int* data_stack)
+{
+  int b1; // find vm_base L levels down
+  b1 = vm_base;
+  while (l > 0)
+  {
+    b1 = data_stack[b1 + 1];
+    l--;
+  }
+  return b1;
+}
+
+////////////////////////////////// Program I/O /////////////////////////////////
+
+// Values for read come from stdin, or the --input file, read in large blocks
+// and parsed by hand. Only an interactive stdin gets the "Value: " prompt.
+// Values written go to a large buffer that is flushed into the output file
+// when it fills up and when the program stops.
+
+#define IO_BUFFER_SIZE (1 << 20)
+
+// Opens the source of program input (stdin if path is NULL). Returns false
+// if the file cannot be opened.
+bool io_open(char *path)
+{
+  io_in.fd = (path == NULL) ? 0 : open(path, O_RDONLY);
+  if (io_in.fd < 0)
+  {
+    return false;
+  }
+  io_in.prompt = (path == NULL && isatty(0));
+  io_in.buf = malloc(IO_BUFFER_SIZE);
+  io_out.buf = malloc(IO_BUFFER_SIZE);
+  return true;
+}
+
+// Moves the unread input to the front of the buffer and reads more after it.
+// Returns false at the end of the input.
+bool io_fill()
+{
+  ssize_t got;
+
+  memmove(io_in.buf, io_in.buf + io_in.pos, io_in.len - io_in.pos);
+  io_in.len -= io_in.pos;
+  io_in.pos = 0;
+  do
+  {
+    got = read(io_in.fd, io_in.buf + io_in.len, IO_BUFFER_SIZE - io_in.len);
+  } while (got < 0 && errno == EINTR);
+  if (got <= 0)
+  {
+    io_in.eof = true;
+    return false;
+  }
+  io_in.len += got;
+  return true;
+}
+
+// Parses the next integer of the input into *value. Returns false, leaving
+// *value alone, at the end of the input or if the next word is not a number,
+// which like scanf is then never consumed.
+bool io_read_int(int *value)
+{
+  size_t end;
+  unsigned result = 0;
+  bool negative = false;
+
+  if (io_in.buf == NULL && !io_open(NULL))
+  {
+    return false;
+  }
+  for (;;)
+  {
+    while (io_in.pos < io_in.len && isspace((unsigned char)io_in.buf[io_in.pos]))
+      io_in.pos++;
+    if (io_in.pos < io_in.len || io_in.eof || !io_fill())
+      break;
+  }
+  // The whole word has to be in the buffer
+  for (;;)
+  {
+    for (end = io_in.pos; end < io_in.len && !isspace((unsigned char)io_in.buf[end]); end++)
+      ;
+    if (end < io_in.len || io_in.eof || io_in.len - io_in.pos == IO_BUFFER_SIZE || !io_fill())
+      break;
+  }
+  if (io_in.pos == end)
+  {
+    return false;
+  }
+
+  if (io_in.buf[io_in.pos] == '-' || io_in.buf[io_in.pos] == '+')
+  {
+    negative = (io_in.buf[io_in.pos] == '-');
+    if (io_in.pos + 1 == end || !isdigit((unsigned char)io_in.buf[io_in.pos + 1]))
+      return false;
+    io_in.pos++;
+  }
+  if (!isdigit((unsigned char)io_in.buf[io_in.pos]))
+  {
+    return false;
+  }
+  while (io_in.pos < end && isdigit((unsigned char)io_in.buf[io_in.pos]))
+  {
+    result = result * 10 + (io_in.buf[io_in.pos++] - '0');
+  }
+  *value = (int)(negative ? 0u - result : result);
+  io_in.consumed++;
+  return true;
+}
+
+// Reads one value for SIO read from the program input
+int io_read()
+{
+  int value = 0;
+
+  //stated in class to let the user know what they were scanning in
+  if (io_in.prompt)
+  {
+    printf("Value: ");
+    fflush(stdout);
+  }
+  io_read_int(&value);
+  return value;
+}
+
+// Writes all buffered program output to the output file
+void io_flush()
+{
+  if (io_out.len > 0)
+  {
+    fwrite(io_out.buf, 1, io_out.len, fpout);
+    io_out.len = 0;
+  }
+}
+
+// Writes one value for SIO write on its own line of the program output
+void io_write(int value)
+{
+  char digits[12];
+  unsigned magnitude = (value < 0) ? 0u - (unsigned)value : (unsigned)value;
+  int n = 0;
+
+  if (io_out.buf == NULL && !io_open(NULL))
+  {
+    fprintf(fpout, "%d\n", value);
+    return;
+  }
+  if (io_out.len + sizeof(digits) + 1 > IO_BUFFER_SIZE)
+  {
+    io_flush();
+  }
+  do
+  {
+    digits[n++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0)
+  {
+    io_out.buf[io_out.len++] = '-';
+  }
+  while (n > 0)
+  {
+    io_out.buf[io_out.len++] = digits[--n];
+  }
+  io_out.buf[io_out.len++] = '\n';
+}
+
+//////////////////////////////////// Timings ///////////////////////////////////
+
+// --timings measures every phase of a run with the wall clock and, where
+// perf_event_open is allowed, the cycles, instructions and cache misses the
+// process spends in user mode. It also counts the operations that dominate
+// compiling: symbols probed by position(), strcmp() calls and emitted
+// instructions.
+
+char *phaseNames[PHASE_COUNT] = { "load", "trim", "lex", "parse+codegen",
+                                  "output", "execute" };
+
+// Opens the hardware counters, leaving -1 for those that are not available
+void timings_open()
+{
+  struct perf_event_attr attr;
+  unsigned long long config[3] = { PERF_COUNT_HW_CPU_CYCLES,
+                                   PERF_COUNT_HW_INSTRUCTIONS,
+                                   PERF_COUNT_HW_CACHE_MISSES };
+  int k;
+
+  for (k = 0; k < 3; k++)
+  {
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config[k];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perfFds[k] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+// Reads the clock and the hardware counters into values
+void timings_read(long long values[4])
+{
+  struct timespec now;
+  int k;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  values[0] = now.tv_sec * 1000000000LL + now.tv_nsec;
+  for (k = 0; k < 3; k++)
+  {
+    if (perfFds[k] < 0 || read(perfFds[k], &values[k + 1], sizeof(long long)) != sizeof(long long))
+      values[k + 1] = 0;
+  }
+}
+
+void phase_begin(int id)
+{
+  if (timings)
+    timings_read(phaseStart);
+  currentPhase = id;
+}
+
+// Adds what the current phase used since phase_begin to its totals
+void phase_end()
+{
+  long long now[4];
+  int k;
+
+  if (!timings)
+    return;
+  timings_read(now);
+  for (k = 0; k < 4; k++)
+  {
+    phaseTotals[currentPhase][k] += now[k] - phaseStart[k];
+  }
+}
+
+// Prints the totals of every phase and the operation counts
+void timings_report()
+{
+  long long sum[4] = {0};
+  char cell[32];
+  int id, k;
+
+  if (!timings)
+    return;
+  printf("%-14s %12s %14s %14s %12s\n", "phase", "ms", "cycles", "instructions", "cache-miss");
+  for (id = 0; id <= PHASE_COUNT; id++)
+  {
+    long long *t = (id < PHASE_COUNT) ? phaseTotals[id] : sum;
+    printf("%-14s %12.3f", (id < PHASE_COUNT) ? phaseNames[id] : "total", t[0] / 1e6);
+    for (k = 1; k < 4; k++)
+    {
+      if (perfFds[k - 1] < 0)
+        strcpy(cell, "n/a");
+      else
+        sprintf(cell, "%lld", t[k]);
+      printf(" %*s", (k == 3) ? 12 : 14, cell);
+    }
+    printf("\n");
+    for (k = 0; id < PHASE_COUNT && k < 4; k++)
+    {
+      sum[k] += t[k];
+    }
+  }
+  printf("\n%-22s %lld\n", "position() probes", positionProbes);
+  printf("%-22s %lld\n", "strcmp() calls", strcmpCalls);
+  printf("%-22s %lld\n", "source bytes", sourceBytes);
+  printf("%-22s %d\n", "tokens", listSize);
+  printf("%-22s %d\n", "instructions emitted", insIndex);
+}
+
+/////////////////////////////// VM data stacks /////////////////////////////////
+
+// Data stacks are mmap'd regions with inaccessible guard pages on both sides,
+// so a program that runs off its stack faults in hardware instead of every
+// push being checked. The fault handler unwinds to the run that owns the
+// stack. Released stacks go back to a pool and are handed out again already
+// faulted in, so repeated runs do not pay for page faults again.
+
+#define DEFAULT_STACK_SLOTS (1 << 20)
+#define STACK_GUARD_BYTES (64 * 1024)
+
+// Returns true if addr is inside the guard pages of one of the stacks
+bool vm_stack_guard_hit(char *addr)
+{
+  vm_stack *s;
+  char *lo, *hi;
+
+  for (s = stack_all; s != NULL; s = s->all_next)
+  {
+    lo = (char *)s->slots - STACK_GUARD_BYTES;
+    hi = (char *)s->slots + s->size * sizeof(int);
+    if ((addr >= lo && addr < (char *)s->slots) || (addr >= hi && addr < lo + s->mapped))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void vm_overflow_handler(int sig, siginfo_t *info, void *context)
+{
+  if (vm_overflow_jmp != NULL && vm_stack_guard_hit(info->si_addr))
+  {
+    siglongjmp(*vm_overflow_jmp, 1);
+  }
+  // Any other fault is a real crash
+  signal(sig, SIG_DFL);
+}
+
+void vm_overflow_install()
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = vm_overflow_handler;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigaction(SIGSEGV, &sa, NULL);
+  sigaction(SIGBUS, &sa, NULL);
+}
+
+// Returns a zeroed stack of at least the given number of slots
+vm_stack *vm_stack_acquire(size_t slots)
+{
+  static pthread_once_t handler = PTHREAD_ONCE_INIT;
+  vm_stack **p, *s;
+  size_t page = sysconf(_SC_PAGESIZE), bytes;
+  char *mem;
+
+  pthread_once(&handler, vm_overflow_install);
+
+  bytes = (slots * sizeof(int) + page - 1) / page * page;
+  pthread_mutex_lock(&stack_lock);
+  for (p = &stack_pool; *p != NULL; p = &(*p)->next)
+  {
+    if ((*p)->size * sizeof(int) == bytes)
+    {
+      s = *p;
+      *p = s->next;
+      pthread_mutex_unlock(&stack_lock);
+      return s;
+    }
+  }
+  pthread_mutex_unlock(&stack_lock);
+
+  mem = mmap(NULL, bytes + 2 * STACK_GUARD_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    return NULL;
+  }
+  if (mprotect(mem + STACK_GUARD_BYTES, bytes, PROT_READ | PROT_WRITE) != 0)
+  {
+    munmap(mem, bytes + 2 * STACK_GUARD_BYTES);
+    return NULL;
+  }
+  s = calloc(1, sizeof(vm_stack));
+  s->slots = (int *)(mem + STACK_GUARD_BYTES);
+  s->size = bytes / sizeof(int);
+  s->mapped = bytes + 2 * STACK_GUARD_BYTES;
+  pthread_mutex_lock(&stack_lock);
+  s->all_next = stack_all;
+  stack_all = s;
+  pthread_mutex_unlock(&stack_lock);
+  return s;
+}
+
+// Zeroes a stack for the next run. Only the pages the last run touched are
+// cleared, which keeps them mapped.
+void vm_stack_clear(vm_stack *s)
+{
+  size_t page = sysconf(_SC_PAGESIZE), pages = s->size * sizeof(int) / page, i;
+  unsigned char *resident = malloc(pages);
+
+  if (mincore(s->slots, pages * page, resident) == 0)
+  {
+    for (i = 0; i < pages; i++)
+    {
+      if (resident[i] & 1)
+        memset((char *)s->slots + i * page, 0, page);
+    }
+  }
+  else
+  {
+    memset(s->slots, 0, s->size * sizeof(int));
+  }
+  free(resident);
+}
+
+// Clears a stack and returns it to the pool
+void vm_stack_release(vm_stack *s)
+{
+  vm_stack_clear(s);
+  pthread_mutex_lock(&stack_lock);
+  s->next = stack_pool;
+  stack_pool = s;
+  pthread_mutex_unlock(&stack_lock);
+}
+
+// Number of slots for the stack of the current program: --stack if given,
+// otherwise what stack depth analysis finds, or a default for recursion or
+// for a --lazy program, whose calls are not compiled yet
+size_t vm_stack_slots()
+{
+  size_t slots = stackSlots;
+
+  if (slots == 0 && lazyCompile == false)
+  {
+    slots = stack_depth(ins, insIndex);
+  }
+  if (slots == 0)
+  {
+    slots = DEFAULT_STACK_SLOTS;
+  }
+  return (slots < MAX_DATA_STACK_HEIGHT) ? MAX_DATA_STACK_HEIGHT : slots;
+}
+
+// Runs the program on the JIT (if jc is not NULL) or the interpreter with
+// stack overflow detection. An overflow stops the program with halted = -2.
+void vm_execute(vm_state *vm, instruction *code, int n, jit_code *jc)
+{
+  sigjmp_buf env;
+
+  if (sigsetjmp(env, 1) != 0)
+  {
+    vm_overflow_jmp = NULL;
+    vm->halted = -2;
+    io_flush();
+    return;
+  }
+  vm_overflow_jmp = &env;
+  if (jc != NULL)
+    jit_run(jc, vm);
+  else
+    vm_run(vm, code, n);
+  vm_overflow_jmp = NULL;
+  io_flush();
+}
+
+// Resets a virtual machine to its initial state on the given (zeroed) stack
+void vm_init(vm_state *vm, vm_stack *stack)
+{
+  memset(vm, 0, sizeof(vm_state));
+  vm->bp = 1;
+  vm->budget = LLONG_MAX;
+  vm->stack = stack;
+  vm->data_stack = stack->slots;
+}
+
+// Reads one value for SIO read, either from the captured input or the program
+// input
+int vm_read(vm_state *vm)
+{
+  int value = 0;
+
+  if (vm->capture)
+  {
+    if (vm->input_pos < vm->input_len)
+    {
+      value = vm->input[vm->input_pos++];
+    }
+    return value;
+  }
+  return io_read();
+}
+
+// Writes one value for SIO write, either to the captured output or the
+// buffered program output
+void vm_write(vm_state *vm, int value)
+{
+  if (vm->capture)
+  {
+    if (vm->output_len == vm->output_cap)
+    {
+      vm->output_cap = (vm->output_cap == 0) ? 64 : vm->output_cap * 2;
+      vm->output = realloc(vm->output, vm->output_cap * sizeof(int));
+    }
+    vm->output[vm->output_len++] = value;
+    return;
+  }
+  io_write(value);
+}
+
+// Executes the program on the given VM without printing a trace. This has
+// the same semantics as executionCycle() and runs until the program halts,
+// until vm->budget instructions have run or until a read finds no input while
+// vm->input_open is set (which sets vm->blocked). It can then be resumed.
+void vm_run(vm_state *vm, instruction *code, int n)
+{
+  int pc = vm->pc, bp = vm->bp, sp = vm->sp;
+  int *reg = vm->reg, *data_stack = vm->data_stack;
+  long long budget = vm->budget, *counts = vm->counts;
+  instruction *ir;
+
+  while (vm->halted == 0)
+  {
+    if (budget == 0)
+    {
+      break;
+    }
+    budget--;
+    if (pc < 0 || pc >= n)
+    {
+      vm->halted = -1;
+      break;
+    }
+    ir = &code[pc++];
+    if (counts != NULL)
+    {
+      counts[pc - 1]++;
+    }
+
+    switch (ir->op)
+    {
+      case 1:
+        reg[ir->r] = ir->m;
+        break;
+
+      case 2:
+        if (counts != NULL)
+        {
+          vm->depth--;
+        }
+        sp = bp - 1;
+        bp = data_stack[sp + 3];
+        pc = data_stack[sp + 4];
+        break;
+
+      case 3:
+        reg[ir->r] = data_stack[vm_base(ir->l, bp, data_stack) + ir->m];
+        break;
+
+      case 4:
+        data_stack[vm_base(ir->l, bp, data_stack) + ir->m] = reg[ir->r];
+        break;
+
+      case 5:
+        data_stack[sp + 1] = 0;
+        data_stack[sp + 2] = vm_base(ir->l, bp, data_stack);
+        data_stack[sp + 3] = bp;
+        data_stack[sp + 4] = pc;
+        bp = sp + 1;
+        pc = ir->m;
+        if (counts != NULL && ++vm->depth > vm->max_depth)
+        {
+          vm->max_depth = vm->depth;
+        }
+        break;
+
+      case 6:
+        sp = sp + ir->m;
+        if (counts != NULL && sp > vm->max_sp)
+        {
+          vm->max_sp = sp;
+        }
+        break;
+
+      case 7:
+        pc = ir->m;
+        // Backward jumps close loops, which may be traced once they are hot
+        if (vm->loops != NULL && pc < ir - code)
+        {
+          vm->pc = pc;
+          vm->bp = bp;
+          vm->sp = sp;
+          loop_hot(vm, code, n);
+          pc = vm->pc;
+        }
+        break;
+
+      case 8:
+        if (reg[ir->r] == 0)
+        {
+          pc = ir->m;
+        }
+        break;
+
+      case 9:
+        vm_write(vm, reg[ir->r]);
+        break;
+
+      case 10:
+        if (vm->input_open && vm->input_pos == vm->input_len)
+        {
+          // Nothing to read yet: stop at the read so it runs again once
+          // input has arrived
+          vm->blocked = true;
+          pc--;
+          budget++;
+          goto stop;
+        }
+        reg[ir->r] = vm_read(vm);
+        break;
+
+      case 11:
+        vm->halted = 1;
+        break;
+
+      case 12:
+        reg[ir->r] = -reg[ir->r];
+        break;
+
+      case 13:
+        reg[ir->r] = reg[ir->l] + reg[ir->m];
+        break;
+
+      case 14:
+        reg[ir->r] = reg[ir->l] - reg[ir->m];
+        break;
+
+      case 15:
+        reg[ir->r] = reg[ir->l] * reg[ir->m];
+        break;
+
+      case 16:
+        reg[ir->r] = reg[ir->l] / reg[ir->m];
+        break;
+
+      case 17:
+        reg[ir->r] = reg[ir->l] % 2;
+        break;
+
+      case 18:
+        reg[ir->r] = reg[ir->l] % reg[ir->m];
+        break;
+
+      case 19:
+        reg[ir->r] = reg[ir->l] == reg[ir->m];
+        break;
+
+      case 20:
+        reg[ir->r] = reg[ir->l] != reg[ir->m];
+        break;
+
+      case 21:
+        reg[ir->r] = reg[ir->l] < reg[ir->m];
+        break;
+
+      case 22:
+        reg[ir->r] = reg[ir->l] <= reg[ir->m];
+        break;
+
+      case 23:
+        reg[ir->r] = reg[ir->l] > reg[ir->m];
+        break;
+
+      case 24:
+        reg[ir->r] = reg[ir->l] >= reg[ir->m];
+        break;
+
+      case 25:
+        // A --lazy body run for the first time, after its INC: compiled at
+        // the end of the code, which moves, then run from there
+        pc = lazy_compile(ir->m, data_stack[bp + 3] - 1);
+        code = ins;
+        n = insIndex;
+        break;
+
+      case 26:
+        if (ir->l >= 0)
+        {
+          data_stack[sp + 2] = vm_base(ir->l, bp, data_stack);
+        }
+        data_stack[sp + 3] = bp;
+        data_stack[sp + 4] = pc;
+        bp = sp + 1;
+        sp = sp + code[ir->m].m;
+        pc = ir->m + 1;
+        if (counts != NULL && ++vm->depth > vm->max_depth)
+        {
+          vm->max_depth = vm->depth;
+        }
+        if (counts != NULL && sp > vm->max_sp)
+        {
+          vm->max_sp = sp;
+        }
+        break;
+
+      case 27:
+        if (ir->l >= 0)
+        {
+          data_stack[bp + 1] = vm_base(ir->l, bp, data_stack);
+        }
+        sp = bp - 1 + code[ir->m].m;
+        pc = ir->m + 1;
+        if (counts != NULL && sp > vm->max_sp)
+        {
+          vm->max_sp = sp;
+        }
+        break;
+
+      case 28:
+        reg[ir->r] = reg[ir->l];
+        break;
+
+      default:
+        printf("\tInvalid opcode\n");
+    }
+  }
+stop:
+  vm->pc = pc;
+  vm->bp = bp;
+  vm->sp = sp;
+  vm->budget = budget;
+}
+
+////////////////////////////////// x86-64 JIT //////////////////////////////////
+
+// The JIT translates every instruction of the program into a fixed x86-64
+// template. VM state is pinned to host registers for the whole run:
+//   rbx = data_stack, r12 = vm_state, r13d = bp, r14d = sp
+//   reg[0..7] = r15d, ebp, r8d, r9d, r10d, r11d, esi, edi
+// eax, ecx and edx are scratch. The VM pc only exists as the native address,
+// so RTN dispatches through a table holding the address of each instruction.
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define JIT_DS RBX
+#define JIT_VM R12
+#define JIT_BP R13
+#define JIT_SP R14
+#define NO_INDEX RSP
+
+int jit_vmreg[MAX_REGISTERS] = { R15, RBP, R8, R8 + 1, R8 + 2, R8 + 3, RSI, RDI };
+
+// Machine code under construction, with the jumps still to be resolved
+typedef struct
+{
+  unsigned char *buf;
+  int len, cap;
+  int *fixup_pos, *fixup_target, fixups;
+  int *offset; // code offset of each instruction
+} jit_asm;
+
+void jit_byte(jit_asm *as, int b)
+{
+  if (as->len == as->cap)
+  {
+    as->cap = (as->cap == 0) ? 4096 : as->cap * 2;
+    as->buf = realloc(as->buf, as->cap);
+  }
+  as->buf[as->len++] = (unsigned char)b;
+}
+
+void jit_dword(jit_asm *as, int d)
+{
+  int i;
+  for (i = 0; i < 4; i++)
+  {
+    jit_byte(as, (d >> (8 * i)) & 0xff);
+  }
+}
+
+void jit_qword(jit_asm *as, uint64_t q)
+{
+  jit_dword(as, (int)(q & 0xffffffff));
+  jit_dword(as, (int)(q >> 32));
+}
+
+// Emits a REX prefix when one is needed for 64 bit operands or r8-r15
+void jit_rex(jit_asm *as, int w, int reg, int index, int base)
+{
+  int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+  if (rex != 0x40)
+  {
+    jit_byte(as, rex);
+  }
+}
+
+// Emits a one or two byte opcode
+void jit_opcode(jit_asm *as, int opcode)
+{
+  if (opcode > 0xff)
+  {
+    jit_byte(as, opcode >> 8);
+  }
+  jit_byte(as, opcode & 0xff);
+}
+
+// opcode reg, rm (both registers)
+void jit_rr(jit_asm *as, int w, int opcode, int reg, int rm)
+{
+  jit_rex(as, w, reg, 0, rm);
+  jit_opcode(as, opcode);
+  jit_byte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// opcode reg, [base + index * 2^scale + disp]; always uses a SIB byte and a
+// 32 bit displacement so every base register encodes the same way
+void jit_rm(jit_asm *as, int w, int opcode, int reg, int base, int index, int scale, int disp)
+{
+  jit_rex(as, w, reg, index, base);
+  jit_opcode(as, opcode);
+  jit_byte(as, 0x80 | ((reg & 7) << 3) | 4);
+  jit_byte(as, (scale << 6) | ((index & 7) << 3) | (base & 7));
+  jit_dword(as, disp);
+}
+
+void jit_mov_imm(jit_asm *as, int reg, int imm)
+{
+  jit_rex(as, 0, 0, 0, reg);
+  jit_byte(as, 0xb8 + (reg & 7));
+  jit_dword(as, imm);
+}
+
+void jit_mov_imm64(jit_asm *as, int reg, uint64_t imm)
+{
+  jit_rex(as, 1, 0, 0, reg);
+  jit_byte(as, 0xb8 + (reg & 7));
+  jit_qword(as, imm);
+}
+
+// Group 1 arithmetic with an immediate: ext is 0 for add, 5 for sub, 7 for cmp
+void jit_alu_imm(jit_asm *as, int w, int ext, int reg, int imm)
+{
+  jit_rex(as, w, 0, 0, reg);
+  jit_byte(as, 0x81);
+  jit_byte(as, 0xc0 | (ext << 3) | (reg & 7));
+  jit_dword(as, imm);
+}
+
+// mov dword [base + index * 2^scale + disp], imm
+void jit_store_imm(jit_asm *as, int base, int index, int scale, int disp, int imm)
+{
+  jit_rm(as, 0, 0xc7, 0, base, index, scale, disp);
+  jit_dword(as, imm);
+}
+
+void jit_push(jit_asm *as, int reg)
+{
+  jit_rex(as, 0, 0, 0, reg);
+  jit_byte(as, 0x50 + (reg & 7));
+}
+
+void jit_pop(jit_asm *as, int reg)
+{
+  jit_rex(as, 0, 0, 0, reg);
+  jit_byte(as, 0x58 + (reg & 7));
+}
+
+// Emits a jump (cc < 0) or conditional jump to a VM instruction or to one of
+// the exit stubs, which use negative targets
+void jit_jump(jit_asm *as, int cc, int target)
+{
+  if (cc < 0)
+  {
+    jit_byte(as, 0xe9);
+  }
+  else
+  {
+    jit_byte(as, 0x0f);
+    jit_byte(as, 0x80 + cc);
+  }
+  as->fixup_pos = realloc(as->fixup_pos, (as->fixups + 1) * sizeof(int));
+  as->fixup_target = realloc(as->fixup_target, (as->fixups + 1) * sizeof(int));
+  as->fixup_pos[as->fixups] = as->len;
+  as->fixup_target[as->fixups] = target;
+  as->fixups++;
+  jit_dword(as, 0);
+}
+
+#define JIT_EXIT (-1)    // leaves the native code with the state saved
+#define JIT_BAD_PC (-2)  // eax holds a pc outside of the program
+
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+
+// Resolves the recorded jumps now that every target has been placed
+void jit_link(jit_asm *as, int exit_offset, int bad_pc_offset)
+{
+  int i, target, offset;
+
+  for (i = 0; i < as->fixups; i++)
+  {
+    target = as->fixup_target[i];
+    if (target == JIT_EXIT)
+      offset = exit_offset;
+    else if (target == JIT_BAD_PC)
+      offset = bad_pc_offset;
+    else
+      offset = as->offset[target];
+    offset -= as->fixup_pos[i] + 4;
+    memcpy(as->buf + as->fixup_pos[i], &offset, 4);
+  }
+}
+
+// Copies the assembled code into a fresh mapping. The code is written while
+// the mapping is writable, then it is made executable and never written again.
+unsigned char *jit_map(jit_asm *as, size_t *size)
+{
+  unsigned char *mem;
+
+  *size = as->len;
+  mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    return NULL;
+  }
+  memcpy(mem, as->buf, as->len);
+  if (mprotect(mem, *size, PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(mem, *size);
+    return NULL;
+  }
+  return mem;
+}
+
+
+// Leaves vm_base(l, bp) in eax
+void jit_base(jit_asm *as, int l)
+{
+  jit_rr(as, 0, 0x89, JIT_BP, RAX); // mov eax, r13d
+  while (l-- > 0)
+  {
+    jit_rm(as, 0, 0x8b, RAX, JIT_DS, RAX, 2, 4); // mov eax, [rbx + rax*4 + 4]
+  }
+}
+
+// Writes the pinned VM state back into the vm_state
+void jit_save_state(jit_asm *as)
+{
+  int i;
+  jit_rm(as, 0, 0x89, JIT_BP, JIT_VM, NO_INDEX, 0, offsetof(vm_state, bp));
+  jit_rm(as, 0, 0x89, JIT_SP, JIT_VM, NO_INDEX, 0, offsetof(vm_state, sp));
+  for (i = 0; i < MAX_REGISTERS; i++)
+  {
+    jit_rm(as, 0, 0x89, jit_vmreg[i], JIT_VM, NO_INDEX, 0, offsetof(vm_state, reg) + 4 * i);
+  }
+}
+
+void jit_load_regs(jit_asm *as)
+{
+  int i;
+  for (i = 0; i < MAX_REGISTERS; i++)
+  {
+    jit_rm(as, 0, 0x8b, jit_vmreg[i], JIT_VM, NO_INDEX, 0, offsetof(vm_state, reg) + 4 * i);
+  }
+}
+
+// Calls a C helper taking the vm_state as its first argument
+void jit_call(jit_asm *as, void *fn)
+{
+  jit_rr(as, 1, 0x89, JIT_VM, RDI); // mov rdi, r12
+  jit_mov_imm64(as, RAX, (uint64_t)(uintptr_t)fn);
+  jit_byte(as, 0xff); // call rax
+  jit_byte(as, 0xd0);
+}
+
+// Jumps to the native code of the pc held in eax
+void jit_dispatch(jit_asm *as, void **targets, int n)
+{
+  jit_alu_imm(as, 0, 7, RAX, n); // cmp eax, n
+  jit_jump(as, CC_AE, JIT_BAD_PC);
+  jit_mov_imm64(as, RCX, (uint64_t)(uintptr_t)targets);
+  jit_rm(as, 0, 0xff, 4, RCX, RAX, 3, 0); // jmp [rcx + rax*8]
+}
+
+// Jumps to a VM instruction known at compile time
+void jit_goto(jit_asm *as, int cc, int target, int n)
+{
+  if (target >= 0 && target < n)
+  {
+    jit_jump(as, cc, target);
+    return;
+  }
+  // Conditional jumps out of the program skip over the exit when not taken
+  if (cc >= 0)
+  {
+    jit_byte(as, 0x70 + (cc ^ 1));
+    jit_byte(as, 10);
+  }
+  jit_mov_imm(as, RAX, target);
+  jit_jump(as, -1, JIT_BAD_PC);
+}
+
+// out = in1 <op> in2 for the two operand ALU instructions
+void jit_arith(jit_asm *as, int opcode, int out, int in1, int in2)
+{
+  jit_rr(as, 0, 0x89, in1, RAX); // mov eax, in1
+  if (opcode == 0x0faf)
+  {
+    jit_rr(as, 0, opcode, RAX, in2); // imul eax, in2
+  }
+  else
+  {
+    jit_rr(as, 0, opcode, in2, RAX); // op eax, in2
+  }
+  jit_rr(as, 0, 0x89, RAX, out);
+}
+
+// Signed division of in1 by the divisor register, keeping the quotient (eax)
+// or the remainder (edx)
+void jit_divide(jit_asm *as, int out, int in1, int divisor, int result)
+{
+  jit_rr(as, 0, 0x89, in1, RAX);
+  jit_byte(as, 0x99); // cdq
+  jit_rr(as, 0, 0xf7, 7, divisor); // idiv divisor
+  jit_rr(as, 0, 0x89, result, out);
+}
+
+void jit_compare(jit_asm *as, int cc, int out, int in1, int in2)
+{
+  jit_rr(as, 0, 0x89, in1, RAX);
+  jit_rr(as, 0, 0x39, in2, RAX); // cmp eax, in2
+  jit_byte(as, 0x0f); // setcc al
+  jit_byte(as, 0x90 + cc);
+  jit_byte(as, 0xc0);
+  jit_byte(as, 0x0f); // movzx eax, al
+  jit_byte(as, 0xb6);
+  jit_byte(as, 0xc0);
+  jit_rr(as, 0, 0x89, RAX, out);
+}
+
+void jit_invalid_opcode(vm_state *vm)
+{
+  printf("\tInvalid opcode\n");
+}
+
+// Translates one VM instruction at index i
+bool jit_instruction(jit_asm *as, instruction *ir, int i, int n, void **targets)
+{
+  int r, l, m;
+
+  // Register operands must name one of the VM registers
+  if (ir->r < 0 || ir->r >= MAX_REGISTERS)
+  {
+    return false;
+  }
+  if (((ir->op >= 13 && ir->op <= 24) || ir->op == 28)
+      && (ir->l < 0 || ir->l >= MAX_REGISTERS || ir->m < 0 || ir->m >= MAX_REGISTERS))
+  {
+    return false;
+  }
+  r = jit_vmreg[ir->r];
+  l = ((ir->op >= 13 && ir->op <= 24) || ir->op == 28) ? jit_vmreg[ir->l] : 0;
+  m = (ir->op >= 13 && ir->op <= 24 && ir->op != 17) ? jit_vmreg[ir->m] : 0;
+
+  switch (ir->op)
+  {
+    case 1: // LIT
+      jit_mov_imm(as, r, ir->m);
+      break;
+
+    case 2: // RTN
+      jit_rr(as, 0, 0x89, JIT_BP, RCX);
+      jit_alu_imm(as, 0, 5, RCX, 1);
+      jit_rr(as, 0, 0x89, RCX, JIT_SP);
+      jit_rm(as, 0, 0x8b, JIT_BP, JIT_DS, RCX, 2, 12);
+      jit_rm(as, 0, 0x8b, RAX, JIT_DS, RCX, 2, 16);
+      jit_dispatch(as, targets, n);
+      break;
+
+    case 3: // LOD
+      if (ir->l == 0)
+      {
+        jit_rm(as, 0, 0x8b, r, JIT_DS, JIT_BP, 2, 4 * ir->m);
+      }
+      else
+      {
+        jit_base(as, ir->l);
+        jit_rm(as, 0, 0x8b, r, JIT_DS, RAX, 2, 4 * ir->m);
+      }
+      break;
+
+    case 4: // STO
+      if (ir->l == 0)
+      {
+        jit_rm(as, 0, 0x89, r, JIT_DS, JIT_BP, 2, 4 * ir->m);
+      }
+      else
+      {
+        jit_base(as, ir->l);
+        jit_rm(as, 0, 0x89, r, JIT_DS, RAX, 2, 4 * ir->m);
+      }
+      break;
+
+    case 5: // CAL
+      jit_base(as, ir->l);
+      jit_rr(as, 0, 0x89, JIT_SP, RCX);
+      jit_store_imm(as, JIT_DS, RCX, 2, 4, 0);
+      jit_rm(as, 0, 0x89, RAX, JIT_DS, RCX, 2, 8);
+      jit_rm(as, 0, 0x89, JIT_BP, JIT_DS, RCX, 2, 12);
+      jit_store_imm(as, JIT_DS, RCX, 2, 16, i + 1);
+      jit_rr(as, 0, 0x89, RCX, JIT_BP);
+      jit_alu_imm(as, 0, 0, JIT_BP, 1);
+      jit_goto(as, -1, ir->m, n);
+      break;
+
+    case 6: // INC
+      jit_alu_imm(as, 0, 0, JIT_SP, ir->m);
+      break;
+
+    case 7: // JMP
+      jit_goto(as, -1, ir->m, n);
+      break;
+
+    case 8: // JPC
+      jit_rr(as, 0, 0x85, r, r);
+      jit_goto(as, CC_E, ir->m, n);
+      break;
+
+    case 9: // SIO write
+      jit_save_state(as);
+      jit_rm(as, 0, 0x8b, RSI, JIT_VM, NO_INDEX, 0, offsetof(vm_state, reg) + 4 * ir->r);
+      jit_call(as, vm_write);
+      jit_load_regs(as);
+      break;
+
+    case 10: // SIO read
+      jit_save_state(as);
+      jit_call(as, vm_read);
+      jit_load_regs(as);
+      jit_rr(as, 0, 0x89, RAX, r);
+      break;
+
+    case 11: // SIO halt
+      jit_store_imm(as, JIT_VM, NO_INDEX, 0, offsetof(vm_state, pc), i + 1);
+      jit_store_imm(as, JIT_VM, NO_INDEX, 0, offsetof(vm_state, halted), 1);
+      jit_jump(as, -1, JIT_EXIT);
+      break;
+
+    case 12: // NEG
+      jit_rr(as, 0, 0xf7, 3, r);
+      break;
+
+    case 13: // ADD
+      jit_arith(as, 0x01, r, l, m);
+      break;
+
+    case 14: // SUB
+      jit_arith(as, 0x29, r, l, m);
+      break;
+
+    case 15: // MUL
+      jit_arith(as, 0x0faf, r, l, m);
+      break;
+
+    case 16: // DIV
+      jit_divide(as, r, l, m, RAX);
+      break;
+
+    case 17: // ODD
+      jit_mov_imm(as, RCX, 2);
+      jit_divide(as, r, l, RCX, RDX);
+      break;
+
+    case 18: // MOD
+      jit_divide(as, r, l, m, RDX);
+      break;
+
+    case 19: // EQL
+      jit_compare(as, CC_E, r, l, m);
+      break;
+
+    case 20: // NEQ
+      jit_compare(as, CC_NE, r, l, m);
+      break;
+
+    case 21: // LSS
+      jit_compare(as, CC_L, r, l, m);
+      break;
+
+    case 22: // LEQ
+      jit_compare(as, CC_LE, r, l, m);
+      break;
+
+    case 23: // GTR
+      jit_compare(as, CC_G, r, l, m);
+      break;
+
+    case 24: // GEQ
+      jit_compare(as, CC_GE, r, l, m);
+      break;
+
+    case 26: // LCL, with the INC at m
+      if (ir->m < 0 || ir->m >= n)
+      {
+        return false;
+      }
+      if (ir->l >= 0)
+      {
+        jit_base(as, ir->l);
+      }
+      jit_rr(as, 0, 0x89, JIT_SP, RCX);
+      if (ir->l >= 0)
+      {
+        jit_rm(as, 0, 0x89, RAX, JIT_DS, RCX, 2, 8);
+      }
+      jit_rm(as, 0, 0x89, JIT_BP, JIT_DS, RCX, 2, 12);
+      jit_store_imm(as, JIT_DS, RCX, 2, 16, i + 1);
+      jit_rr(as, 0, 0x89, RCX, JIT_BP);
+      jit_alu_imm(as, 0, 0, JIT_BP, 1);
+      jit_alu_imm(as, 0, 0, JIT_SP, (ir - i)[ir->m].m);
+      jit_goto(as, -1, ir->m + 1, n);
+      break;
+
+    case 27: // TCL, with the INC at m
+      if (ir->m < 0 || ir->m >= n)
+      {
+        return false;
+      }
+      if (ir->l >= 0)
+      {
+        jit_base(as, ir->l);
+        jit_rm(as, 0, 0x89, RAX, JIT_DS, JIT_BP, 2, 4);
+      }
+      jit_rr(as, 0, 0x89, JIT_BP, JIT_SP);
+      jit_alu_imm(as, 0, 0, JIT_SP, (ir - i)[ir->m].m - 1);
+      jit_goto(as, -1, ir->m + 1, n);
+      break;
+
+    case 28: // MOV
+      jit_rr(as, 0, 0x89, l, r);
+      break;
+
+    default:
+      jit_save_state(as);
+      jit_call(as, jit_invalid_opcode);
+      jit_load_regs(as);
+  }
+  return true;
+}
+
+// Translates the whole program into native code. Returns NULL when the JIT is
+// not available on this host or the program cannot be translated.
+jit_code *jit_compile(instruction *code, int n)
+{
+#if defined(__x86_64__) && defined(__linux__)
+  jit_asm as = {0};
+  jit_code *jc;
+  int i, exit_offset, bad_pc_offset;
+  int saved[6] = { RBX, RBP, R12, R13, R14, R15 };
+  bool ok = true;
+
+  jc = calloc(1, sizeof(jit_code));
+  jc->n = n;
+  jc->targets = calloc(n, sizeof(void *));
+  as.offset = calloc(n, sizeof(int));
+
+  // Prologue: save callee saved registers, pin the VM state and enter at vm->pc
+  for (i = 0; i < 6; i++)
+  {
+    jit_push(&as, saved[i]);
+  }
+  jit_alu_imm(&as, 1, 5, RSP, 8); // keep the stack 16 byte aligned for calls
+  jit_rr(&as, 1, 0x89, RDI, JIT_VM);
+  jit_rm(&as, 1, 0x8b, JIT_DS, JIT_VM, NO_INDEX, 0, offsetof(vm_state, data_stack));
+  jit_rm(&as, 0, 0x8b, JIT_BP, JIT_VM, NO_INDEX, 0, offsetof(vm_state, bp));
+  jit_rm(&as, 0, 0x8b, JIT_SP, JIT_VM, NO_INDEX, 0, offsetof(vm_state, sp));
+  jit_load_regs(&as);
+  jit_rm(&as, 0, 0x8b, RAX, JIT_VM, NO_INDEX, 0, offsetof(vm_state, pc));
+  jit_dispatch(&as, jc->targets, n);
+
+  for (i = 0; i < n && ok; i++)
+  {
+    as.offset[i] = as.len;
+    ok = jit_instruction(&as, &code[i], i, n, jc->targets);
+  }
+  // Falling off the end of the program leaves through the bad pc exit
+  jit_mov_imm(&as, RAX, n);
+
+  // Exit stubs: a bad pc is recorded as an error, then the state is saved
+  bad_pc_offset = as.len;
+  jit_rm(&as, 0, 0x89, RAX, JIT_VM, NO_INDEX, 0, offsetof(vm_state, pc));
+  jit_store_imm(&as, JIT_VM, NO_INDEX, 0, offsetof(vm_state, halted), -1);
+  exit_offset = as.len;
+  jit_save_state(&as);
+  jit_alu_imm(&as, 1, 0, RSP, 8);
+  for (i = 5; i >= 0; i--)
+  {
+    jit_pop(&as, saved[i]);
+  }
+  jit_byte(&as, 0xc3); // ret
+
+  if (ok)
+  {
+    jit_link(&as, exit_offset, bad_pc_offset);
+    jc->mem = jit_map(&as, &jc->size);
+    if (jc->mem == NULL)
+    {
+      ok = false;
+    }
+    else
+    {
+      for (i = 0; i < n; i++)
+      {
+        jc->targets[i] = jc->mem + as.offset[i];
+      }
+    }
+  }
+
+  free(as.buf);
+  free(as.fixup_pos);
+  free(as.fixup_target);
+  free(as.offset);
+  if (!ok)
+  {
+    jit_free(jc);
+    return NULL;
+  }
+  return jc;
+#else
+  return NULL;
+#endif
+}
+
+// Runs the native code on the given VM from vm->pc until the program halts
+void jit_run(jit_code *jc, vm_state *vm)
+{
+  void (*entry)(vm_state *) = (void (*)(vm_state *))jc->mem;
+  entry(vm);
+}
+
+void jit_free(jit_code *jc)
+{
+  if (jc == NULL)
+  {
+    return;
+  }
+  if (jc->mem != NULL)
+  {
+    munmap(jc->mem, jc->size);
+  }
+  free(jc->targets);
+  free(jc);
+}
+
+////////////////////////////// Tracing JIT for loops ///////////////////////////
+
+// The interpreter counts how often each backward JMP is taken. Once a loop
+// header gets hot, one iteration of the loop body is recorded as a linear
+// trace, optimized and compiled to native code. Each JPC on the trace becomes
+// a guard that leaves the trace and resumes the interpreter when the other
+// direction is taken. Inside the trace:
+//   - LIT values are propagated and ALU ops on constants are folded
+//   - every stack slot the loop touches lives in a host register for as long
+//     as the trace runs; static-link walks happen once on entry
+//   - stores are only written back to data_stack when the trace exits
+// Loops containing CAL, RTN, INC, reads or inner loops are not traced.
+
+#define HOT_LOOP_THRESHOLD 50
+#define MAX_TRACE_LENGTH 256
+#define TRACE_BLACKLISTED (-1000000000)
+#define TRACE_HOSTS 10
+
+typedef struct loop_trace
+{
+  unsigned char *mem;
+  size_t size;
+} loop_trace;
+
+// One recorded instruction and, for JPC, whether the jump was taken
+typedef struct
+{
+  instruction ir;
+  int pc;
+  bool taken;
+} trace_step;
+
+// Where the value of a VM register is while the trace is compiled: a known
+// constant or a host register
+typedef struct
+{
+  bool is_const;
+  int value;
+} trace_value;
+
+// A guard's way back to the interpreter
+typedef struct
+{
+  int pc;
+  trace_value reg[MAX_REGISTERS];
+} trace_exit;
+
+int trace_hosts[TRACE_HOSTS] = { RBP, RSI, RDI, R8, R8 + 1, R8 + 2, R8 + 3, R13, R14, R15 };
+
+// Result of ALU opcodes 12-24, wrapping on overflow like the host does
+int vm_alu(int op, int a, int b)
+{
+  switch (op)
+  {
+    case 12: return (int)(0u - (unsigned)a);
+    case 13: return (int)((unsigned)a + (unsigned)b);
+    case 14: return (int)((unsigned)a - (unsigned)b);
+    case 15: return (int)((unsigned)a * (unsigned)b);
+    case 16: return a / b;
+    case 17: return a % 2;
+    case 18: return a % b;
+    case 19: return a == b;
+    case 20: return a != b;
+    case 21: return a < b;
+    case 22: return a <= b;
+    case 23: return a > b;
+    case 24: return a >= b;
+  }
+  return 0;
+}
+
+// Returns true if the instruction can appear in a loop trace
+bool loop_traceable(instruction *ir)
+{
+  if (ir->r < 0 || ir->r >= MAX_REGISTERS)
+  {
+    return false;
+  }
+  if ((ir->op >= 13 && ir->op <= 24) || ir->op == 28)
+  {
+    return ir->l >= 0 && ir->l < MAX_REGISTERS && ir->m >= 0 && ir->m < MAX_REGISTERS;
+  }
+  return ir->op == 1 || ir->op == 3 || ir->op == 4 || ir->op == 7 || ir->op == 8
+      || ir->op == 9 || ir->op == 12;
+}
+
+// Interprets one iteration of the loop starting at vm->pc, recording every
+// instruction executed. Returns true if control came back to the header;
+// otherwise the recording stopped before an instruction that cannot be traced
+// and vm->pc is where the interpreter has to carry on.
+bool loop_record(vm_state *vm, instruction *code, int n, trace_step *steps, int *len)
+{
+  int header = vm->pc, pc = header, bp = vm->bp;
+  int *reg = vm->reg, *data_stack = vm->data_stack;
+  instruction *ir;
+  bool closed = false;
+
+  *len = 0;
+  while (!closed && *len < MAX_TRACE_LENGTH && pc >= 0 && pc < n)
+  {
+    ir = &code[pc];
+    if (!loop_traceable(ir) || (ir->op == 7 && ir->m < pc && ir->m != header))
+    {
+      break;
+    }
+    steps[*len].ir = *ir;
+    steps[*len].pc = pc;
+    steps[*len].taken = false;
+    (*len)++;
+    pc++;
+
+    switch (ir->op)
+    {
+      case 1:
+        reg[ir->r] = ir->m;
+        break;
+
+      case 3:
+        reg[ir->r] = data_stack[vm_base(ir->l, bp, data_stack) + ir->m];
+        break;
+
+      case 4:
+        data_stack[vm_base(ir->l, bp, data_stack) + ir->m] = reg[ir->r];
+        break;
+
+      case 7:
+        pc = ir->m;
+        closed = (pc == header);
+        break;
+
+      case 8:
+        if (reg[ir->r] == 0)
+        {
+          pc = ir->m;
+          steps[*len - 1].taken = true;
+        }
+        break;
+
+      case 9:
+        vm_write(vm, reg[ir->r]);
+        break;
+
+      case 28:
+        reg[ir->r] = reg[ir->l];
+        break;
+
+      default:
+        reg[ir->r] = vm_alu(ir->op, (ir->op == 12) ? reg[ir->r] : reg[ir->l], reg[ir->m]);
+    }
+  }
+  vm->pc = pc;
+  return closed;
+}
+
+// Loads a trace value into eax
+void trace_load(jit_asm *as, trace_value v)
+{
+  if (v.is_const)
+    jit_mov_imm(as, RAX, v.value);
+  else
+    jit_rr(as, 0, 0x89, v.value, RAX);
+}
+
+// Leaves vm_base(l, bp) in eax, reading bp from the vm_state
+void trace_base(jit_asm *as, int l)
+{
+  jit_rm(as, 0, 0x8b, RAX, JIT_VM, NO_INDEX, 0, offsetof(vm_state, bp));
+  while (l-- > 0)
+  {
+    jit_rm(as, 0, 0x8b, RAX, JIT_DS, RAX, 2, 4);
+  }
+}
+
+// eax = a <op> b for ALU opcodes 13-24, then the result goes to out
+void trace_binary(jit_asm *as, int op, int out, trace_value a, trace_value b)
+{
+  int cc[6] = { CC_E, CC_NE, CC_L, CC_LE, CC_G, CC_GE };
+  int divisor = RCX, result = RAX;
+
+  trace_load(as, a);
+  switch (op)
+  {
+    case 13:
+    case 14:
+      if (b.is_const)
+        jit_alu_imm(as, 0, (op == 13) ? 0 : 5, RAX, b.value);
+      else
+        jit_rr(as, 0, (op == 13) ? 0x01 : 0x29, b.value, RAX);
+      break;
+
+    case 15:
+      if (b.is_const)
+      {
+        jit_mov_imm(as, RCX, b.value);
+        jit_rr(as, 0, 0x0faf, RAX, RCX);
+      }
+      else
+      {
+        jit_rr(as, 0, 0x0faf, RAX, b.value);
+      }
+      break;
+
+    case 16:
+    case 17:
+    case 18:
+      if (op == 17)
+        jit_mov_imm(as, RCX, 2);
+      else if (b.is_const)
+        jit_mov_imm(as, RCX, b.value);
+      else
+        divisor = b.value;
+      jit_byte(as, 0x99); // cdq
+      jit_rr(as, 0, 0xf7, 7, divisor);
+      result = (op == 16) ? RAX : RDX;
+      break;
+
+    default:
+      if (b.is_const)
+        jit_alu_imm(as, 0, 7, RAX, b.value);
+      else
+        jit_rr(as, 0, 0x39, b.value, RAX);
+      jit_byte(as, 0x0f);
+      jit_byte(as, 0x90 + cc[op - 19]);
+      jit_byte(as, 0xc0);
+      jit_byte(as, 0x0f);
+      jit_byte(as, 0xb6);
+      jit_byte(as, 0xc0);
+  }
+  jit_rr(as, 0, 0x89, result, out);
+}
+
+// Compiles a recorded loop iteration into native code. Returns NULL if the
+// loop needs more registers than the host has to spare.
+loop_trace *loop_compile(trace_step *steps, int len)
+{
+#if defined(__x86_64__) && defined(__linux__)
+  jit_asm as = {0};
+  loop_trace *lt = NULL;
+  trace_value val[MAX_REGISTERS], a, b;
+  trace_exit *exits = calloc(len, sizeof(trace_exit));
+  int slot_l[MAX_TRACE_LENGTH], slot_m[MAX_TRACE_LENGTH], slot_host[MAX_TRACE_LENGTH];
+  bool slot_stored[MAX_TRACE_LENGTH], touched[MAX_REGISTERS] = {false};
+  int reg_host[MAX_REGISTERS];
+  int saved[6] = { RBX, RBP, R12, R13, R14, R15 };
+  int caller_saved[6] = { RSI, RDI, R8, R8 + 1, R8 + 2, R8 + 3 };
+  int nslots = 0, nexits = 0, hosts = 0, i, j, k, s;
+  instruction *ir;
+
+  // Assigning a host register to every stack slot and VM register the loop uses
+  for (i = 0; i < len; i++)
+  {
+    ir = &steps[i].ir;
+    touched[ir->r] = true;
+    if ((ir->op >= 13 && ir->op <= 24) || ir->op == 28)
+    {
+      touched[ir->l] = true;
+      touched[ir->m] = true;
+    }
+    if (ir->op == 3 || ir->op == 4)
+    {
+      for (s = 0; s < nslots && (slot_l[s] != ir->l || slot_m[s] != ir->m); s++)
+        ;
+      if (s == nslots)
+      {
+        slot_l[s] = ir->l;
+        slot_m[s] = ir->m;
+        slot_stored[s] = false;
+        nslots++;
+      }
+      slot_stored[s] |= (ir->op == 4);
+    }
+  }
+  for (s = 0; s < nslots && hosts < TRACE_HOSTS; s++)
+  {
+    slot_host[s] = trace_hosts[hosts++];
+  }
+  for (k = 0; k < MAX_REGISTERS && hosts <= TRACE_HOSTS; k++)
+  {
+    if (touched[k])
+    {
+      reg_host[k] = (hosts < TRACE_HOSTS) ? trace_hosts[hosts] : -1;
+      hosts++;
+    }
+  }
+  if (hosts > TRACE_HOSTS)
+  {
+    free(exits);
+    return NULL;
+  }
+  as.offset = calloc(len + 1, sizeof(int));
+
+  // Entry: pin the VM, load every slot once and the VM registers
+  for (i = 0; i < 6; i++)
+  {
+    jit_push(&as, saved[i]);
+  }
+  jit_alu_imm(&as, 1, 5, RSP, 8);
+  jit_rr(&as, 1, 0x89, RDI, JIT_VM);
+  jit_rm(&as, 1, 0x8b, JIT_DS, JIT_VM, NO_INDEX, 0, offsetof(vm_state, data_stack));
+  for (s = 0; s < nslots; s++)
+  {
+    trace_base(&as, slot_l[s]);
+    jit_rm(&as, 0, 0x8b, slot_host[s], JIT_DS, RAX, 2, 4 * slot_m[s]);
+  }
+  for (k = 0; k < MAX_REGISTERS; k++)
+  {
+    if (touched[k])
+    {
+      jit_rm(&as, 0, 0x8b, reg_host[k], JIT_VM, NO_INDEX, 0, offsetof(vm_state, reg) + 4 * k);
+      val[k].is_const = false;
+      val[k].value = reg_host[k];
+    }
+  }
+
+  // Loop body
+  as.offset[0] = as.len;
+  for (i = 0; i < len; i++)
+  {
+    ir = &steps[i].ir;
+    for (s = 0; (ir->op == 3 || ir->op == 4) && (slot_l[s] != ir->l || slot_m[s] != ir->m); s++)
+      ;
+
+    switch (ir->op)
+    {
+      case 1:
+        val[ir->r].is_const = true;
+        val[ir->r].value = ir->m;
+        break;
+
+      case 3:
+        val[ir->r].is_const = false;
+        val[ir->r].value = slot_host[s];
+        break;
+
+      case 4:
+        // Registers still reading the old slot value get their own copy first
+        for (k = 0; k < MAX_REGISTERS; k++)
+        {
+          if (k != ir->r && touched[k] && !val[k].is_const && val[k].value == slot_host[s])
+          {
+            jit_rr(&as, 0, 0x89, slot_host[s], reg_host[k]);
+            val[k].value = reg_host[k];
+          }
+        }
+        if (val[ir->r].is_const)
+          jit_mov_imm(&as, slot_host[s], val[ir->r].value);
+        else if (val[ir->r].value != slot_host[s])
+          jit_rr(&as, 0, 0x89, val[ir->r].value, slot_host[s]);
+        break;
+
+      case 7:
+        break;
+
+      case 8:
+        if (val[ir->r].is_const)
+        {
+          break;
+        }
+        jit_rr(&as, 0, 0x85, val[ir->r].value, val[ir->r].value);
+        exits[nexits].pc = steps[i].taken ? steps[i].pc + 1 : ir->m;
+        memcpy(exits[nexits].reg, val, sizeof(val));
+        jit_jump(&as, steps[i].taken ? CC_NE : CC_E, 1 + nexits);
+        nexits++;
+        break;
+
+      case 9:
+        trace_load(&as, val[ir->r]);
+        for (j = 0; j < 6; j++)
+        {
+          jit_push(&as, caller_saved[j]);
+        }
+        jit_rr(&as, 0, 0x89, RAX, RSI);
+        jit_call(&as, vm_write);
+        for (j = 5; j >= 0; j--)
+        {
+          jit_pop(&as, caller_saved[j]);
+        }
+        break;
+
+      // A copy into the register's own host register, which no other
+      // register's value is ever kept in
+      case 28:
+        a = val[ir->l];
+        if (a.is_const)
+        {
+          val[ir->r] = a;
+          break;
+        }
+        if (a.value != reg_host[ir->r])
+          jit_rr(&as, 0, 0x89, a.value, reg_host[ir->r]);
+        val[ir->r].is_const = false;
+        val[ir->r].value = reg_host[ir->r];
+        break;
+
+      default:
+        a = val[(ir->op == 12) ? ir->r : ir->l];
+        b = val[ir->m];
+        if (ir->op == 12 || ir->op == 17)
+        {
+          b.is_const = true;
+          b.value = 0;
+        }
+        // Folding, except where the host would trap at run time
+        if (a.is_const && b.is_const
+            && !((ir->op == 16 || ir->op == 18)
+                 && (b.value == 0 || (b.value == -1 && a.value == (-2147483647 - 1)))))
+        {
+          val[ir->r].value = vm_alu(ir->op, a.value, b.value);
+          val[ir->r].is_const = true;
+          break;
+        }
+        if (ir->op == 12)
+        {
+          trace_load(&as, a);
+          jit_rr(&as, 0, 0xf7, 3, RAX); // neg eax
+          jit_rr(&as, 0, 0x89, RAX, reg_host[ir->r]);
+        }
+        else
+        {
+          trace_binary(&as, ir->op, reg_host[ir->r], a, b);
+        }
+        val[ir->r].is_const = false;
+        val[ir->r].value = reg_host[ir->r];
+    }
+  }
+
+  // Back edge: VM registers go back to their own host registers
+  for (k = 0; k < MAX_REGISTERS; k++)
+  {
+    if (!touched[k])
+      continue;
+    if (val[k].is_const)
+      jit_mov_imm(&as, reg_host[k], val[k].value);
+    else if (val[k].value != reg_host[k])
+      jit_rr(&as, 0, 0x89, val[k].value, reg_host[k]);
+  }
+  jit_jump(&as, -1, 0);
+
+  // Exits write back the stored slots and the VM registers, then the pc
+  for (i = 0; i < nexits; i++)
+  {
+    as.offset[1 + i] = as.len;
+    for (s = 0; s < nslots; s++)
+    {
+      if (slot_stored[s])
+      {
+        trace_base(&as, slot_l[s]);
+        jit_rm(&as, 0, 0x89, slot_host[s], JIT_DS, RAX, 2, 4 * slot_m[s]);
+      }
+    }
+    for (k = 0; k < MAX_REGISTERS; k++)
+    {
+      if (!touched[k])
+        continue;
+      if (exits[i].reg[k].is_const)
+        jit_store_imm(&as, JIT_VM, NO_INDEX, 0, offsetof(vm_state, reg) + 4 * k, exits[i].reg[k].value);
+      else
+        jit_rm(&as, 0, 0x89, exits[i].reg[k].value, JIT_VM, NO_INDEX, 0, offsetof(vm_state, reg) + 4 * k);
+    }
+    jit_store_imm(&as, JIT_VM, NO_INDEX, 0, offsetof(vm_state, pc), exits[i].pc);
+    jit_jump(&as, -1, JIT_EXIT);
+  }
+  k = as.len;
+  jit_alu_imm(&as, 1, 0, RSP, 8);
+  for (i = 5; i >= 0; i--)
+  {
+    jit_pop(&as, saved[i]);
+  }
+  jit_byte(&as, 0xc3);
+
+  // A trace without a guard never leaves the loop, so it is not compiled
+  if (nexits > 0)
+  {
+    jit_link(&as, k, k);
+    lt = calloc(1, sizeof(loop_trace));
+    lt->mem = jit_map(&as, &lt->size);
+    if (lt->mem == NULL)
+    {
+      free(lt);
+      lt = NULL;
+    }
+  }
+  free(as.buf);
+  free(as.fixup_pos);
+  free(as.fixup_target);
+  free(as.offset);
+  free(exits);
+  return lt;
+#else
+  return NULL;
+#endif
+}
+
+// Called by the interpreter whenever a backward JMP to vm->pc is taken. Runs
+// the loop's trace if it has one, and records and compiles it once the loop
+// is hot. On return vm->pc is where the interpreter continues.
+void loop_hot(vm_state *vm, instruction *code, int n)
+{
+  loop_jit *lj = vm->loops;
+  trace_step steps[MAX_TRACE_LENGTH];
+  int header = vm->pc, len;
+  loop_trace *lt = lj->traces[header];
+
+  if (lt == NULL)
+  {
+    if (++lj->counts[header] < HOT_LOOP_THRESHOLD)
+    {
+      return;
+    }
+    lj->counts[header] = TRACE_BLACKLISTED;
+    if (!loop_record(vm, code, n, steps, &len))
+    {
+      return;
+    }
+    lt = loop_compile(steps, len);
+    if (lt == NULL)
+    {
+      return;
+    }
+    lj->traces[header] = lt;
+  }
+  ((void (*)(vm_state *))lt->mem)(vm);
+}
+
+loop_jit *loop_jit_create(int n)
+{
+  loop_jit *lj = calloc(1, sizeof(loop_jit));
+  lj->n = n;
+  lj->counts = calloc(n, sizeof(int));
+  lj->traces = calloc(n, sizeof(loop_trace *));
+  return lj;
+}
+
+void loop_jit_free(loop_jit *lj)
+{
+  int i;
+
+  for (i = 0; i < lj->n; i++)
+  {
+    if (lj->traces[i] != NULL)
+    {
+      munmap(lj->traces[i]->mem, lj->traces[i]->size);
+      free(lj->traces[i]);
+    }
+  }
+  free(lj->counts);
+  free(lj->traces);
+  free(lj);
+}
+
+///////////////////////// Procedures in generated code ////////////////////////
+
+// Follows a chain of JMPs to the instruction that does the work. CAL targets
+// of procedures still being compiled point at their JMP over nested code.
+int proc_entry(instruction *code, int n, int pc)
+{
+  int hops = 0;
+
+  while (pc >= 0 && pc < n && code[pc].op == 7 && hops++ < n)
+  {
+    pc = code[pc].m;
+  }
+  return pc;
+}
+
+// Marks every instruction reachable inside the procedure starting at entry
+void proc_reach(instruction *code, int n, int entry, bool *reach, bool *label)
+{
+  int *work = malloc((n + 1) * sizeof(int)), top = 0, pc;
+
+  work[top++] = entry;
+  while (top > 0)
+  {
+    pc = work[--top];
+    if (pc < 0 || pc >= n || reach[pc])
+    {
+      continue;
+    }
+    reach[pc] = true;
+    switch (code[pc].op)
+    {
+      case 2:
+      case 11:
+        break;
+
+      case 7:
+      case 8:
+        if (code[pc].m >= 0 && code[pc].m < n)
+        {
+          label[code[pc].m] = true;
+          work[top++] = code[pc].m;
+        }
+        if (code[pc].op == 8)
+        {
+          work[top++] = pc + 1;
+        }
+        break;
+
+      default:
+        work[top++] = pc + 1;
+    }
+  }
+  free(work);
+}
+
+// Returns the frame size reserved by the procedure starting at entry and
+// marks the procedures it calls in called
+int proc_frame(instruction *code, int n, int entry, bool *called)
+{
+  bool *reach = calloc(n, sizeof(bool)), *label = calloc(n, sizeof(bool));
+  int pc, size = 0;
+
+  proc_reach(code, n, entry, reach, label);
+  for (pc = 0; pc < n; pc++)
+  {
+    if (!reach[pc])
+      continue;
+    if (code[pc].op == 6 && code[pc].m > size)
+      size = code[pc].m;
+    if (code[pc].op == 5 || code[pc].op == 26 || code[pc].op == 27)
+      called[proc_entry(code, n, code[pc].m)] = true;
+  }
+  free(reach);
+  free(label);
+  return size;
+}
+
+// Deepest stack reached below the procedure at entry: its own frame plus the
+// deepest of its callees. Returns -1 if a call chain leads back to a
+// procedure already on it, in which case the depth is unbounded.
+long proc_depth(instruction *code, int n, int entry, long *depth, bool *active)
+{
+  bool *called = calloc(n, sizeof(bool));
+  long deepest = 0, d;
+  int frame, pc;
+
+  if (active[entry])
+  {
+    free(called);
+    return -1;
+  }
+  if (depth[entry] != 0)
+  {
+    free(called);
+    return depth[entry];
+  }
+  active[entry] = true;
+  frame = proc_frame(code, n, entry, called);
+  for (pc = 0; pc < n && deepest >= 0; pc++)
+  {
+    if (called[pc])
+    {
+      d = proc_depth(code, n, pc, depth, active);
+      deepest = (d < 0) ? -1 : (d > deepest ? d : deepest);
+    }
+  }
+  active[entry] = false;
+  free(called);
+  depth[entry] = (deepest < 0) ? -1 : frame + deepest;
+  return depth[entry];
+}
+
+// Compile time stack depth analysis: the number of data_stack slots the
+// program can use, or 0 if it is recursive and needs a default sized stack
+size_t stack_depth(instruction *code, int n)
+{
+  long *depth = calloc(n, sizeof(long)), d = -1;
+  bool *active = calloc(n, sizeof(bool));
+  int main_entry = proc_entry(code, n, 0);
+
+  if (main_entry >= 0 && main_entry < n)
+  {
+    d = proc_depth(code, n, main_entry, depth, active);
+  }
+  free(depth);
+  free(active);
+  // The main frame starts at slot 1 and CAL writes 4 slots above sp
+  return (d < 0) ? 0 : (size_t)d + 5;
+}
+
+// With -O, turns every CAL into a light call (LCL), which does the callee's
+// INC too and leaves the return value slot alone. It writes the static link
+// only if something may follow it: links[p] is how many static links, from
+// the frame of procedure p out, the LODs, STOs and CALs of p may follow, and
+// those of the procedures p calls, from the frames their static links lead
+// to. proc gives the procedure of each instruction.
+void light_calls(instruction *code, int *proc, int n, int procs)
+{
+  int *links = calloc(procs, sizeof(int));
+  int pc, m, need, rounds;
+  bool changed = true;
+
+  // Links only grow, and bodies mostly call procedures compiled before them,
+  // so this settles in a few rounds
+  for (rounds = 0; changed && rounds <= procs; rounds++)
+  {
+    changed = false;
+    for (pc = 0; pc < n; pc++)
+    {
+      if (code[pc].op < 3 || code[pc].op > 5)
+        continue;
+      need = code[pc].l;
+      m = code[pc].m;
+      if (code[pc].op == 5 && m >= 0 && m < n && links[proc[m]] > 1)
+        need = code[pc].l + links[proc[m]] - 1;
+      if (need > links[proc[pc]])
+      {
+        links[proc[pc]] = need;
+        changed = true;
+      }
+    }
+  }
+
+  for (pc = 0; pc < n; pc++)
+  {
+    m = code[pc].m;
+    if (code[pc].op == 5 && m >= 0 && m < n && code[m].op == 6)
+      code[pc] = (instruction){ 26, 0, (links[proc[m]] == 0) ? -1 : code[pc].l, m };
+  }
+  free(links);
+}
+
+// With -O, turns the light calls light_calls() made that return right away,
+// maybe through JMPs, into tail calls (TCL), which reuse the caller's frame
+// with its dynamic link and return address: tail recursion then runs in
+// constant stack space. The callee's static link must not lead to that
+// frame, so a call with l = 0 stays, unless the callee has no static link.
+void tail_calls(instruction *code, int n)
+{
+  int pc, next, hops;
+
+  for (pc = 0; pc < n; pc++)
+  {
+    if (code[pc].op != 26 || code[pc].l == 0)
+      continue;
+    next = pc + 1;
+    for (hops = 0; next >= 0 && next < n && code[next].op == 7 && hops < n; hops++)
+    {
+      next = code[next].m;
+    }
+    if (next >= 0 && next < n && code[next].op == 2)
+      code[pc].op = 27;
+  }
+}
+
+// Whether the instruction reads VM register k
+bool reg_reads(instruction *ir, int k)
+{
+  switch (ir->op)
+  {
+    case 4:
+    case 8:
+    case 9:
+    case 12:
+      return ir->r == k;
+
+    case 17:
+    case 28:
+      return ir->l == k;
+
+    default:
+      return ir->op >= 13 && ir->op <= 24 && (ir->l == k || ir->m == k);
+  }
+}
+
+// Whether the instruction writes VM register k
+bool reg_writes(instruction *ir, int k)
+{
+  return ir->r == k && (ir->op == 1 || ir->op == 3 || ir->op == 10 || ir->op == 28
+                        || (ir->op >= 12 && ir->op <= 24));
+}
+
+// Makes the instruction read register to where it read from
+void reg_rename(instruction *ir, int from, int to)
+{
+  if ((ir->op == 4 || ir->op == 8 || ir->op == 9) && ir->r == from)
+    ir->r = to;
+  if (((ir->op >= 13 && ir->op <= 24) || ir->op == 28) && ir->l == from)
+    ir->l = to;
+  if (ir->op >= 13 && ir->op <= 24 && ir->op != 17 && ir->m == from)
+    ir->m = to;
+}
+
+// Whether register k is dead after pc, skipping the instructions gone. The
+// parser keeps values in registers only within a statement, so k is dead
+// once written, or at a jump or a jump target, unless read before.
+bool reg_dead_after(instruction *code, int n, int pc, int k, bool *gone, bool *label)
+{
+  for (pc++; pc < n; pc++)
+  {
+    if (label[pc])
+      return true;
+    if (gone[pc])
+      continue;
+    if (reg_reads(&code[pc], k))
+      return false;
+    if (reg_writes(&code[pc], k) || code[pc].op == 2 || code[pc].op == 5
+        || code[pc].op == 7 || code[pc].op == 8 || code[pc].op == 11)
+      return true;
+  }
+  return true;
+}
+
+// Whether promote_vars() can rewrite the instruction in a loop: a CAL, a JMP,
+// or one working on registers, which must then be in range
+bool reg_promotable(instruction *ir)
+{
+  bool alu = ir->op >= 13 && ir->op <= 24;
+
+  if (ir->op == 5 || ir->op == 7)
+    return true;
+  if (ir->op != 1 && ir->op != 3 && ir->op != 4 && !(ir->op >= 8 && ir->op <= 10)
+      && ir->op != 12 && !alu)
+    return false;
+  return ir->r >= 0 && ir->r < MAX_REGISTERS
+      && (!alu || (ir->l >= 0 && ir->l < MAX_REGISTERS && ir->m >= 0 && ir->m < MAX_REGISTERS));
+}
+
+// Picks the variables of a loop to keep in the registers it leaves free,
+// from the highest down, and turns their LODs and STOs into MOVs. Each one
+// must be used more often than the CALs in the loop make it be loaded and
+// stored again.
+void promote_pick(instruction *code, reg_loop *lp)
+{
+  int cand_l[PROMOTE_CANDIDATES], cand_m[PROMOTE_CANDIDATES], refs[PROMOTE_CANDIDATES];
+  bool stored[PROMOTE_CANDIDATES], used[MAX_REGISTERS] = {false};
+  int cands = 0, calls = 0, free_reg = MAX_REGISTERS - 1, best, c, k, v;
+  instruction *ir;
+
+  for (k = lp->head; k <= lp->back; k++)
+  {
+    ir = &code[k];
+    if (ir->op == 5)
+      calls++;
+    if (ir->op == 5 || ir->op == 7)
+      continue;
+    used[ir->r] = true;
+    if (ir->op >= 13 && ir->op <= 24)
+    {
+      used[ir->l] = true;
+      used[ir->m] = true;
+    }
+    if (ir->op != 3 && ir->op != 4)
+      continue;
+    for (c = 0; c < cands && (cand_l[c] != ir->l || cand_m[c] != ir->m); c++)
+      ;
+    if (c == PROMOTE_CANDIDATES)
+      continue;
+    if (c == cands)
+    {
+      cand_l[c] = ir->l;
+      cand_m[c] = ir->m;
+      refs[c] = 0;
+      stored[c] = false;
+      cands++;
+    }
+    refs[c]++;
+    stored[c] |= (ir->op == 4);
+  }
+
+  lp->vars = lp->stores = 0;
+  memset(lp->held, 0, sizeof(lp->held));
+  while (1)
+  {
+    for (; free_reg >= 0 && used[free_reg]; free_reg--)
+      ;
+    best = -1;
+    for (c = 0; c < cands; c++)
+    {
+      if (refs[c] > calls * (stored[c] ? 2 : 1) && (best < 0 || refs[c] > refs[best]))
+        best = c;
+    }
+    if (free_reg < 0 || best < 0)
+      break;
+    v = lp->vars++;
+    lp->var_l[v] = cand_l[best];
+    lp->var_m[v] = cand_m[best];
+    lp->reg[v] = free_reg;
+    lp->stored[v] = stored[best];
+    lp->stores += stored[best];
+    lp->held[free_reg] = true;
+    used[free_reg] = true;
+    refs[best] = 0;
+  }
+
+  for (k = lp->head; k <= lp->back; k++)
+  {
+    ir = &code[k];
+    for (v = 0; (ir->op == 3 || ir->op == 4) && v < lp->vars; v++)
+    {
+      if (ir->l != lp->var_l[v] || ir->m != lp->var_m[v])
+        continue;
+      if (ir->op == 3)
+        *ir = (instruction){ 28, ir->r, lp->reg[v], 0 };
+      else
+        *ir = (instruction){ 28, lp->reg[v], ir->r, 0 };
+      break;
+    }
+  }
+}
+
+// Folds the MOVs of a loop into the instructions around them: a MOV out of
+// a variable's register into the next instruction reading the copy, and a
+// MOV into one into the instruction computing the value, when the copy is
+// not used after. The MOVs folded are gone.
+void promote_fold(instruction *code, int n, reg_loop *lp, bool *gone, bool *label)
+{
+  instruction *ir;
+  int k, x, p, t;
+
+  for (k = lp->head; k <= lp->back; k++)
+  {
+    ir = &code[k];
+    if (gone[k] || ir->op != 28 || !lp->held[ir->l] || lp->held[ir->r])
+      continue;
+    t = ir->r;
+    for (x = k + 1; x <= lp->back; x++)
+    {
+      if (label[x])
+        break;
+      if (gone[x])
+        continue;
+      if (reg_reads(&code[x], t) || reg_writes(&code[x], t) || reg_writes(&code[x], ir->l)
+          || code[x].op == 5 || code[x].op == 7 || code[x].op == 8)
+        break;
+    }
+    // NEG reads and writes the same register
+    if (x > lp->back || label[x] || code[x].op == 12 || !reg_reads(&code[x], t)
+        || (!reg_writes(&code[x], t) && !reg_dead_after(code, n, x, t, gone, label)))
+      continue;
+    reg_rename(&code[x], t, ir->l);
+    gone[k] = true;
+  }
+
+  for (k = lp->head + 1; k <= lp->back; k++)
+  {
+    ir = &code[k];
+    if (gone[k] || label[k] || ir->op != 28 || !lp->held[ir->r] || lp->held[ir->l])
+      continue;
+    for (p = k - 1; p > lp->head && gone[p] && !label[p]; p--)
+      ;
+    if (gone[p] || code[p].op == 12
+        || !reg_writes(&code[p], ir->l) || !reg_dead_after(code, n, k, ir->l, gone, label))
+      continue;
+    code[p].r = ir->r;
+    gone[k] = true;
+  }
+}
+
+// Appends an instruction to the code promote_vars() rebuilds
+void promote_put(code_buffer *c, instruction ir, int line, int proc)
+{
+  c->ins[c->len] = ir;
+  c->line[c->len] = line;
+  c->proc[c->len++] = proc;
+}
+
+// Appends the LODs (op 3) of the variables a loop keeps in registers, or the
+// STOs (op 4) of those it writes
+void promote_spill(code_buffer *c, reg_loop *lp, int op, int line, int proc)
+{
+  int v;
+
+  for (v = 0; v < lp->vars; v++)
+  {
+    if (op == 3 || lp->stored[v])
+      promote_put(c, (instruction){ op, lp->reg[v], lp->var_l[v], lp->var_m[v] }, line, proc);
+  }
+}
+
+// With -O, keeps the variables each innermost while loop uses most, like its
+// counter, in the VM registers its expressions leave free. Their LODs and
+// STOs become MOVs (opcode 28, reg[r] = reg[l]), and most of those fold
+// into the instructions around them, so i := i + 1 is LIT and ADD. The
+// registers are loaded before the loop and the variables written are stored
+// on the way out; a CAL in the loop stores them before and loads them after,
+// as the callee may use the variables or the registers. A read goes straight
+// into the register. Jumps into the loop from outside go through the loads,
+// the loop's own jumps to its header past them, and only jumps out of the
+// loop through the stores. Loops with other ways in, or with RTN or INC, are
+// left alone.
+void promote_vars(code_buffer *c)
+{
+  instruction *code = c->ins, *ir;
+  int n = c->len, count = 0, cap = 16, size, h, i, j, k, l, t;
+  int *loop_of = malloc((n + 1) * sizeof(int)), *head_of = malloc((n + 1) * sizeof(int));
+  int *exit_of = malloc((n + 1) * sizeof(int)), *at = malloc(3 * (n + 1) * sizeof(int));
+  bool *label = calloc(n + 1, sizeof(bool)), *gone = calloc(n + 1, sizeof(bool)), ok;
+  reg_loop *loops = malloc(cap * sizeof(reg_loop));
+  code_buffer out;
+
+  for (i = 0; i <= n; i++)
+  {
+    loop_of[i] = head_of[i] = exit_of[i] = -1;
+    if (i < n && (code[i].op == 5 || code[i].op == 7 || code[i].op == 8)
+        && code[i].m >= 0 && code[i].m < n)
+      label[code[i].m] = true;
+  }
+
+  // Innermost loops: a JMP back with no other inside, and every jump in the
+  // loop to somewhere in it or to its exit
+  for (j = 0; j < n; j++)
+  {
+    h = code[j].m;
+    if (code[j].op != 7 || h < 0 || h > j || loop_of[h] >= 0)
+      continue;
+    for (k = h, ok = true; k <= j && ok; k++)
+    {
+      ir = &code[k];
+      ok = reg_promotable(ir);
+      if (ir->op == 7 || ir->op == 8)
+        ok = ok && ir->m >= h && ir->m <= j + 1 && (k == j || ir->m > k);
+    }
+    if (!ok)
+      continue;
+    if (count == cap)
+    {
+      cap *= 2;
+      loops = realloc(loops, cap * sizeof(reg_loop));
+    }
+    loops[count].head = h;
+    loops[count].back = j;
+    loops[count].vars = 0;
+    for (k = h; k <= j; k++)
+    {
+      loop_of[k] = count;
+    }
+    count++;
+  }
+
+  // A loop jumped into from outside anywhere but its header keeps its code
+  for (k = 0; k < n; k++)
+  {
+    t = code[k].m;
+    if ((code[k].op == 5 || code[k].op == 7 || code[k].op == 8) && t >= 0 && t < n
+        && loop_of[t] >= 0 && loop_of[t] != loop_of[k] && t != loops[loop_of[t]].head)
+      loops[loop_of[t]].vars = -1;
+  }
+  for (l = 0; l < count; l++)
+  {
+    if (loops[l].vars < 0)
+    {
+      loops[l].vars = loops[l].stores = 0;
+      continue;
+    }
+    promote_pick(code, &loops[l]);
+    promote_fold(code, n, &loops[l], gone, label);
+    head_of[loops[l].head] = l;
+    exit_of[loops[l].back + 1] = l;
+  }
+
+  // Where each instruction goes: after the stores on a loop's way out, then
+  // the loads before a loop or the stores before a CAL in one
+  for (i = 0, size = 0; i <= n; i++)
+  {
+    l = (i < n && code[i].op == 5) ? loop_of[i] : -1;
+    at[3 * i] = size;
+    size += (exit_of[i] >= 0) ? loops[exit_of[i]].stores : 0;
+    at[3 * i + 1] = size;
+    size += (head_of[i] >= 0) ? loops[head_of[i]].vars : 0;
+    size += (l >= 0) ? loops[l].stores : 0;
+    at[3 * i + 2] = size;
+    size += (i < n && !gone[i]) + ((l >= 0) ? loops[l].vars : 0);
+  }
+
+  out.len = 0;
+  out.cap = size;
+  out.ins = malloc(size * sizeof(instruction));
+  out.line = malloc(size * sizeof(int));
+  out.proc = malloc(size * sizeof(int));
+  for (i = 0; i <= n; i++)
+  {
+    if (exit_of[i] >= 0)
+    {
+      j = loops[exit_of[i]].back;
+      promote_spill(&out, &loops[exit_of[i]], 4, c->line[j], c->proc[j]);
+    }
+    if (i == n)
+      break;
+    l = (code[i].op == 5) ? loop_of[i] : -1;
+    if (head_of[i] >= 0)
+      promote_spill(&out, &loops[head_of[i]], 3, c->line[i], c->proc[i]);
+    if (l >= 0)
+      promote_spill(&out, &loops[l], 4, c->line[i], c->proc[i]);
+    if (!gone[i])
+    {
+      ir = &code[i];
+      t = ir->m;
+      if ((ir->op == 5 || ir->op == 7 || ir->op == 8) && t >= 0)
+      {
+        j = (ir->op != 5) ? loop_of[i] : -1;
+        if (t > n)
+          t += size - n;
+        else if (j >= 0 && t == loops[j].head)
+          t = at[3 * t + 2];
+        else if (j >= 0 && t == loops[j].back + 1)
+          t = at[3 * t];
+        else
+          t = at[3 * t + 1];
+      }
+      promote_put(&out, (instruction){ ir->op, ir->r, ir->l, t }, c->line[i], c->proc[i]);
+    }
+    if (l >= 0)
+      promote_spill(&out, &loops[l], 3, c->line[i], c->proc[i]);
+  }
+
+  // Procedures are found by their address in the symbol table too
+  for (i = 1; i < symbolCapacity; i++)
+  {
+    if (symbol_table[i].kind == 3 && symbol_table[i].addr >= 0 && symbol_table[i].addr <= n)
+      symbol_table[i].addr = at[3 * symbol_table[i].addr + 1];
+  }
+  free(c->ins);
+  free(c->line);
+  free(c->proc);
+  *c = out;
+  free(loop_of);
+  free(head_of);
+  free(exit_of);
+  free(at);
+  free(label);
+  free(gone);
+  free(loops);
+}
+
+////////////////////////////////// C backend ///////////////////////////////////
+
+// Translates the generated program into a single C translation unit that the
+// system compiler can build into a native binary. Every procedure (every CAL
+// target, plus the main program) becomes a C function whose frame is a struct
+// with an explicit static link; LOD and STO follow that link l times. JMP and
+// JPC become gotos inside the function, CAL a direct call and RTN a return.
+// VM registers are locals of each function, kept in step with the shared reg
+// array around calls so their values survive a call exactly as on the VM.
+
+// Prints the frame holding the l-th static link of the current frame
+void emit_c_frame(int l)
+{
+  fprintf(fpout, "f");
+  while (l-- > 0)
+  {
+    fprintf(fpout, "->sl");
+  }
+}
+
+// Prints the statements for a single instruction
+void emit_c_instruction(instruction *code, int n, int pc, bool *used)
+{
+  instruction *ir = &code[pc];
+  char *ops[] = { "+", "-", "*", "/", "%", "%", "==", "!=", "<", "<=", ">", ">=" };
+  int i;
+
+  switch (ir->op)
+  {
+    case 1:
+      fprintf(fpout, "  r%d = %d;\n", ir->r, ir->m);
+      break;
+
+    case 2:
+      fprintf(fpout, "  goto leave;\n");
+      break;
+
+    case 3:
+      fprintf(fpout, "  r%d = ", ir->r);
+      emit_c_frame(ir->l);
+      fprintf(fpout, "->v[%d];\n", ir->m);
+      break;
+
+    case 4:
+      fprintf(fpout, "  ");
+      emit_c_frame(ir->l);
+      fprintf(fpout, "->v[%d] = r%d;\n", ir->m, ir->r);
+      break;
+
+    case 5:
+    case 26:
+    case 27:
+      for (i = 0; i < MAX_REGISTERS; i++)
+      {
+        if (used[i])
+          fprintf(fpout, "  reg[%d] = r%d;\n", i, i);
+      }
+      fprintf(fpout, "  p%d(", proc_entry(code, n, ir->m));
+      // A light call without a static link passes none
+      if (ir->op >= 26 && ir->l < 0)
+        fprintf(fpout, "NULL");
+      else
+        emit_c_frame(ir->l);
+      fprintf(fpout, ");\n");
+      for (i = 0; i < MAX_REGISTERS; i++)
+      {
+        if (used[i])
+          fprintf(fpout, "  r%d = reg[%d];\n", i, i);
+      }
+      break;
+
+    case 6:
+      break;
+
+    case 7:
+      if (ir->m < 0 || ir->m >= n)
+        fprintf(fpout, "  exit(1);\n");
+      else
+        fprintf(fpout, "  goto L%d;\n", ir->m);
+      break;
+
+    case 8:
+      if (ir->m < 0 || ir->m >= n)
+        fprintf(fpout, "  if (r%d == 0) exit(1);\n", ir->r);
+      else
+        fprintf(fpout, "  if (r%d == 0) goto L%d;\n", ir->r, ir->m);
+      break;
+
+    case 9:
+      fprintf(fpout, "  printf(\"%%d\\n\", r%d);\n", ir->r);
+      break;
+
+    case 10:
+      fprintf(fpout, "  r%d = pl0_read();\n", ir->r);
+      break;
+
+    case 11:
+      fprintf(fpout, "  exit(0);\n");
+      break;
+
+    case 12:
+      fprintf(fpout, "  r%d = (int)(0u - (unsigned)r%d);\n", ir->r, ir->r);
+      break;
+
+    case 13:
+    case 14:
+    case 15:
+      // Wrapping like the VM instead of signed overflow
+      fprintf(fpout, "  r%d = (int)((unsigned)r%d %s (unsigned)r%d);\n",
+              ir->r, ir->l, ops[ir->op - 13], ir->m);
+      break;
+
+    case 17:
+      fprintf(fpout, "  r%d = r%d %% 2;\n", ir->r, ir->l);
+      break;
+
+    case 28:
+      fprintf(fpout, "  r%d = r%d;\n", ir->r, ir->l);
+      break;
+
+    default:
+      if (ir->op >= 16 && ir->op <= 24)
+        fprintf(fpout, "  r%d = r%d %s r%d;\n", ir->r, ir->l, ops[ir->op - 13], ir->m);
+      else
+        fprintf(fpout, "  printf(\"\\tInvalid opcode\\n\");\n");
+  }
+}
+
+// Returns true if the instruction uses reg[k]
+bool emit_c_uses(instruction *ir, int k)
+{
+  if (ir->op == 1 || ir->op == 3 || ir->op == 4 || ir->op == 8 || ir->op == 9
+      || ir->op == 10 || ir->op == 12 || ir->op == 17 || ir->op == 28)
+  {
+    return ir->r == k || ((ir->op == 17 || ir->op == 28) && ir->l == k);
+  }
+  if (ir->op >= 13 && ir->op <= 24)
+  {
+    return ir->r == k || ir->l == k || ir->m == k;
+  }
+  return false;
+}
+
+// Marks the procedures called from the procedure starting at entry
+void emit_c_calls(instruction *code, int n, int entry, bool *called)
+{
+  bool *reach = calloc(n, sizeof(bool)), *label = calloc(n, sizeof(bool));
+  int pc;
+
+  proc_reach(code, n, entry, reach, label);
+  for (pc = 0; pc < n; pc++)
+  {
+    if (reach[pc] && (code[pc].op == 5 || code[pc].op == 26 || code[pc].op == 27))
+    {
+      called[proc_entry(code, n, code[pc].m)] = true;
+    }
+  }
+  free(reach);
+  free(label);
+}
+
+// Prints the C function for the procedure whose code starts at entry
+void emit_c_function(instruction *code, int n, int entry)
+{
+  bool *reach = calloc(n, sizeof(bool)), *label = calloc(n, sizeof(bool));
+  bool used[MAX_REGISTERS] = {false}, returns = false;
+  int pc, k, size = 4, first = -1, last = -1;
+
+  proc_reach(code, n, entry, reach, label);
+  for (pc = 0; pc < n; pc++)
+  {
+    if (!reach[pc])
+      continue;
+    if (first < 0)
+      first = pc;
+    last = pc;
+    returns |= (code[pc].op == 2);
+    for (k = 0; k < MAX_REGISTERS; k++)
+    {
+      used[k] |= emit_c_uses(&code[pc], k);
+    }
+    // The frame holds everything INC reserves and every local slot used
+    if (code[pc].op == 6 && code[pc].m > size)
+      size = code[pc].m;
+    if ((code[pc].op == 3 || code[pc].op == 4) && code[pc].l == 0 && code[pc].m >= size)
+      size = code[pc].m + 1;
+  }
+
+  fprintf(fpout, "\nstatic void p%d(frame *sl)\n{\n", entry);
+  fprintf(fpout, "  int v[%d] = {0};\n", size);
+  fprintf(fpout, "  frame self = { sl, v }, *f = &self;\n");
+  for (k = 0; k < MAX_REGISTERS; k++)
+  {
+    if (used[k])
+      fprintf(fpout, "  int r%d = reg[%d];\n", k, k);
+  }
+  if (first != entry)
+  {
+    label[entry] = true;
+    fprintf(fpout, "  goto L%d;\n", entry);
+  }
+  for (pc = 0; pc < n; pc++)
+  {
+    if (!reach[pc])
+      continue;
+    if (label[pc])
+      fprintf(fpout, "L%d:\n", pc);
+    emit_c_instruction(code, n, pc, used);
+  }
+  // Control falling off the end of the program
+  if (last >= 0 && code[last].op != 2 && code[last].op != 7 && code[last].op != 11)
+  {
+    fprintf(fpout, "  exit(1);\n");
+  }
+  if (returns)
+  {
+    fprintf(fpout, "leave:\n");
+  }
+  for (k = 0; k < MAX_REGISTERS; k++)
+  {
+    if (used[k])
+      fprintf(fpout, "  reg[%d] = r%d;\n", k, k);
+  }
+  fprintf(fpout, "  return;\n}\n");
+
+  free(reach);
+  free(label);
+}
+
+// Writes the whole program as C to the output file
+void emit_c(instruction *code, int n, char *source)
+{
+  bool *called = calloc(n, sizeof(bool)), *done = calloc(n, sizeof(bool));
+  int pc, main_entry = proc_entry(code, n, 0);
+  bool more = true;
+
+  fprintf(fpout, "// Generated from %s by hw4compiler --emit-c\n", source);
+  fprintf(fpout, "#include <stdio.h>\n#include <stdlib.h>\n\n");
+  fprintf(fpout, "// A procedure activation: the static link and the frame slots, indexed\n");
+  fprintf(fpout, "// like data_stack from the frame base\n");
+  fprintf(fpout, "typedef struct frame\n{\n  struct frame *sl;\n  int *v;\n} frame;\n\n");
+  fprintf(fpout, "static int reg[%d];\n\n", MAX_REGISTERS);
+  fprintf(fpout, "// Reads one value for read; missing input reads as 0 like on the VM\n");
+  fprintf(fpout, "static inline int pl0_read(void)\n{\n  int value = 0;\n");
+  fprintf(fpout, "  if (scanf(\"%%d\", &value) != 1)\n    value = 0;\n  return value;\n}\n\n");
+
+  // Finding every procedure reachable through CAL from the main program
+  if (main_entry < n)
+  {
+    called[main_entry] = true;
+  }
+  while (more)
+  {
+    more = false;
+    for (pc = 0; pc < n; pc++)
+    {
+      if (called[pc] && !done[pc])
+      {
+        done[pc] = true;
+        more = true;
+        emit_c_calls(code, n, pc, called);
+      }
+    }
+  }
+
+  for (pc = 0; pc < n; pc++)
+  {
+    if (called[pc])
+      fprintf(fpout, "static void p%d(frame *sl);\n", pc);
+  }
+  for (pc = 0; pc < n; pc++)
+  {
+    if (called[pc])
+      emit_c_function(code, n, pc);
+  }
+
+  fprintf(fpout, "\nint main(void)\n{\n");
+  fprintf(fpout, "  static char in[1 << 16], out[1 << 16];\n");
+  fprintf(fpout, "  setvbuf(stdin, in, _IOFBF, sizeof(in));\n");
+  fprintf(fpout, "  setvbuf(stdout, out, _IOFBF, sizeof(out));\n");
+  if (main_entry < n)
+  {
+    fprintf(fpout, "  p%d(NULL);\n", main_entry);
+  }
+  fprintf(fpout, "  return 0;\n}\n");
+
+  free(called);
+  free(done);
+}
+
+// Runs the generated program without a trace, writing each value the
+// program writes on its own line of the output file
+void run_program(bool jit)
+{
+  vm_stack *stack = vm_stack_acquire(vm_stack_slots());
+  vm_state vm;
+  jit_code *jc = NULL;
+
+  if (stack == NULL)
+  {
+    fprintf(fpout, "Could not allocate the data stack\n");
+    return;
+  }
+  vm_init(&vm, stack);
+  if (jit == true)
+  {
+    jc = jit_compile(ins, insIndex);
+    if (jc == NULL)
+    {
+      printf("JIT not available, using the interpreter\n");
+    }
+  }
+  if (jc == NULL && traceLoops == true)
+  {
+    vm.loops = loop_jit_create(insIndex);
+  }
+  vm_execute(&vm, ins, insIndex, jc);
+  if (vm.halted == -2)
+  {
+    fprintf(fpout, "Stack overflow: the stack has %zu slots, use --stack to enlarge it\n", stack->size);
+  }
+  if (jc != NULL)
+  {
+    jit_free(jc);
+  }
+  if (vm.loops != NULL)
+  {
+    loop_jit_free(vm.loops);
+  }
+  vm_stack_release(stack);
+}
+
+////////////////////////////////// Checkpoints /////////////////////////////////
+
+// A checkpoint holds everything needed to carry on with a run: the VM
+// registers, the live part of the data stack, how many values the program
+// has read and how long the output file was. --resume restores it, skips the
+// input already read and cuts the output file back to where it was, so the
+// resumed run continues exactly where the checkpointed one was.
+
+#define CHECKPOINT_MAGIC "PL0S"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_SLICE 1000000 // instructions between looks at signals
+
+volatile sig_atomic_t checkpointSignal = 0; // 1 to checkpoint, 2 to stop too
+
+void checkpoint_handler(int sig)
+{
+  checkpointSignal = (sig == SIGUSR1) ? 1 : 2;
+}
+
+// Returns a hash of the instructions, so a checkpoint is only resumed on
+// the program it was taken from
+uint64_t program_hash(instruction *code, int n)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    hash = (hash ^ (uint32_t)code[i].op) * 1099511628211ULL;
+    hash = (hash ^ (uint32_t)code[i].r) * 1099511628211ULL;
+    hash = (hash ^ (uint32_t)code[i].l) * 1099511628211ULL;
+    hash = (hash ^ (uint32_t)code[i].m) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Writes a checkpoint of vm, replacing the file at path only once the new
+// one is complete. Returns false if it could not be written.
+bool checkpoint_save(vm_state *vm, char *path, long long executed)
+{
+  checkpoint_header h;
+  char *tmp = malloc(strlen(path) + 5);
+  FILE *fp;
+  bool ok;
+
+  // Slots above sp are live between a CAL and the INC of the new frame
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CHECKPOINT_MAGIC, 4);
+  h.version = CHECKPOINT_VERSION;
+  h.program = program_hash(ins, insIndex);
+  h.pc = vm->pc;
+  h.bp = vm->bp;
+  h.sp = vm->sp;
+  h.halted = vm->halted;
+  memcpy(h.reg, vm->reg, sizeof(h.reg));
+  h.executed = executed;
+  h.values_read = io_in.consumed;
+  h.live = ((vm->sp > vm->bp + 3) ? vm->sp : vm->bp + 3) + 1;
+  fflush(fpout);
+  h.output_offset = ftell(fpout);
+
+  sprintf(tmp, "%s.tmp", path);
+  fp = fopen(tmp, "wb");
+  if (fp == NULL)
+  {
+    free(tmp);
+    return false;
+  }
+  ok = fwrite(&h, sizeof(h), 1, fp) == 1
+       && fwrite(vm->data_stack, sizeof(int), h.live, fp) == (size_t)h.live;
+  ok = (fclose(fp) == 0) && ok && rename(tmp, path) == 0;
+  free(tmp);
+  return ok;
+}
+
+// Restores vm from the checkpoint at path and brings the program input and
+// the output file back to where they were. Returns false, after saying why,
+// if the checkpoint cannot be used.
+bool checkpoint_load(vm_state *vm, char *path, long long *executed)
+{
+  checkpoint_header h;
+  FILE *fp = fopen(path, "rb");
+  long long i;
+  int value;
+
+  if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1
+      || memcmp(h.magic, CHECKPOINT_MAGIC, 4) != 0 || h.version != CHECKPOINT_VERSION)
+  {
+    printf("%s is not a checkpoint\n", path);
+    if (fp != NULL)
+      fclose(fp);
+    return false;
+  }
+  if (h.program != program_hash(ins, insIndex))
+  {
+    printf("%s is a checkpoint of a different program\n", path);
+    fclose(fp);
+    return false;
+  }
+  if (h.live < 0 || (size_t)h.live > vm->stack->size)
+  {
+    printf("The checkpoint needs a stack of %d slots, use --stack to enlarge it\n", h.live);
+    fclose(fp);
+    return false;
+  }
+  if (fread(vm->data_stack, sizeof(int), h.live, fp) != (size_t)h.live)
+  {
+    printf("%s is truncated\n", path);
+    fclose(fp);
+    return false;
+  }
+  fclose(fp);
+
+  vm->pc = h.pc;
+  vm->bp = h.bp;
+  vm->sp = h.sp;
+  vm->halted = h.halted;
+  memcpy(vm->reg, h.reg, sizeof(h.reg));
+  *executed = h.executed;
+  for (i = 0; i < h.values_read; i++)
+  {
+    io_read_int(&value);
+  }
+  fflush(fpout);
+  fseek(fpout, h.output_offset, SEEK_SET);
+  if (ftruncate(fileno(fpout), h.output_offset) != 0)
+  {
+    printf("Could not cut the output file back to the checkpoint\n");
+    return false;
+  }
+  return true;
+}
+
+// Runs the program on the interpreter, starting from the checkpoint resume
+// if it is not NULL. With save, a checkpoint is written every `every`
+// instructions (if every > 0), on SIGUSR1, and on SIGINT or SIGTERM, which
+// then stop the run so that it can be resumed later.
+void run_checkpointed(char *save, char *resume, long long every)
+{
+  vm_stack *stack = vm_stack_acquire(vm_stack_slots());
+  long long executed = 0, slice;
+  struct sigaction sa;
+  vm_state vm;
+
+  if (stack == NULL)
+  {
+    fprintf(fpout, "Could not allocate the data stack\n");
+    return;
+  }
+  vm_init(&vm, stack);
+  if (resume != NULL && checkpoint_load(&vm, resume, &executed) == false)
+  {
+    vm_stack_release(stack);
+    return;
+  }
+  if (save != NULL)
+  {
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = checkpoint_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+  }
+
+  while (vm.halted == 0)
+  {
+    slice = (every > 0) ? every : CHECKPOINT_SLICE;
+    vm.budget = slice;
+    vm_execute(&vm, ins, insIndex, NULL);
+    executed += slice - vm.budget;
+    if (save == NULL || vm.halted != 0 || (every <= 0 && checkpointSignal == 0))
+    {
+      continue;
+    }
+    if (checkpoint_save(&vm, save, executed) == false)
+    {
+      printf("Could not write the checkpoint %s\n", save);
+    }
+    if (checkpointSignal == 2)
+    {
+      printf("Checkpoint written to %s after %lld instructions\n", save, executed);
+      break;
+    }
+    checkpointSignal = 0;
+  }
+  if (vm.halted == -2)
+  {
+    fprintf(fpout, "Stack overflow: the stack has %zu slots, use --stack to enlarge it\n", stack->size);
+  }
+  vm_stack_release(stack);
+}
+
+//////////////////////////////////// Profiler //////////////////////////////////
+
+// --profile samples the running program at PROFILE_HZ of CPU time. The
+// SIGPROF handler only sets a flag; the interpreter runs in slices of a
+// random number of instructions and takes the sample at the end of the first
+// slice after the flag went up, when pc, bp and the stack are consistent.
+// Random slice lengths keep samples from lining up with loops. Each sample
+// is charged to the line and procedure of its pc, and the frames of the
+// stack give the calling procedures for the folded stacks.
+
+#define PROFILE_HZ 1000
+#define PROFILE_SLICE 512   // longest slice between looks at the flag
+#define PROFILE_DEPTH 256   // frames kept in a folded stack
+
+volatile sig_atomic_t profileTick = 0;
+
+void profile_handler(int sig)
+{
+  profileTick = 1;
+}
+
+// Counts one occurrence of a folded stack
+void profile_fold(profile *pf, char *stack)
+{
+  unsigned long hash = 5381;
+  size_t i, old_cap;
+  char *c;
+  folded_stack *old;
+
+  if (2 * (pf->folded_len + 1) > pf->folded_cap)
+  {
+    old = pf->folded;
+    old_cap = pf->folded_cap;
+    pf->folded_cap = (old_cap == 0) ? 64 : old_cap * 2;
+    pf->folded = calloc(pf->folded_cap, sizeof(folded_stack));
+    pf->folded_len = 0;
+    for (i = 0; i < old_cap; i++)
+    {
+      if (old[i].stack != NULL)
+      {
+        profile_fold(pf, old[i].stack);
+        pf->folded[pf->folded_last].count = old[i].count;
+        free(old[i].stack);
+      }
+    }
+    free(old);
+  }
+
+  for (c = stack; *c != '\0'; c++)
+  {
+    hash = hash * 33 + (unsigned char)*c;
+  }
+  for (i = hash & (pf->folded_cap - 1); pf->folded[i].stack != NULL; i = (i + 1) & (pf->folded_cap - 1))
+  {
+    if (strcmp(pf->folded[i].stack, stack) == 0)
+    {
+      pf->folded[i].count++;
+      pf->folded_last = i;
+      return;
+    }
+  }
+  pf->folded[i].stack = strdup(stack);
+  pf->folded[i].count = 1;
+  pf->folded_len++;
+  pf->folded_last = i;
+}
+
+// Records a sample of the stopped VM
+void profile_sample(profile *pf, vm_state *vm)
+{
+  int frames[PROFILE_DEPTH], depth = 0, b = vm->bp, next, ret, i;
+  bool *seen = pf->seen;
+  char *stack = pf->stack;
+  size_t len = 0;
+
+  if (vm->pc < 0 || vm->pc >= insIndex)
+  {
+    return;
+  }
+  pf->samples++;
+  pf->pc_samples[vm->pc]++;
+  pf->line_samples[insLine[vm->pc]]++;
+  pf->self[insProc[vm->pc]]++;
+
+  // The return address of each frame is just after the CAL in its caller
+  frames[depth++] = insProc[vm->pc];
+  while (b > 1 && depth < PROFILE_DEPTH)
+  {
+    ret = vm->data_stack[b + 3];
+    next = vm->data_stack[b + 2];
+    if (ret < 1 || ret > insIndex || next >= b)
+    {
+      break;
+    }
+    frames[depth++] = insProc[ret - 1];
+    b = next;
+  }
+
+  memset(seen, 0, procCount * sizeof(bool));
+  for (i = depth - 1; i >= 0; i--)
+  {
+    if (!seen[frames[i]])
+    {
+      seen[frames[i]] = true;
+      pf->total[frames[i]]++;
+    }
+    len += sprintf(stack + len, (i == depth - 1) ? "%s" : ";%s", procNames[frames[i]]);
+  }
+  profile_fold(pf, stack);
+}
+
+// Writes the per-procedure and per-line report to the output file, and the
+// folded stacks to the file folded if it is not NULL
+void profile_report(profile *pf, char *source, char *folded)
+{
+  FILE *fp;
+  char *text = NULL;
+  size_t cap = 0, i;
+  int p, q, best, *order = malloc(procCount * sizeof(int)), line = 0;
+  double scale = (pf->samples > 0) ? 100.0 / pf->samples : 0;
+
+  fprintf(fpout, "\nProfile: %ld samples at %d Hz\n\n", pf->samples, PROFILE_HZ);
+  fprintf(fpout, "%-12s %8s %7s %8s %7s\n", "procedure", "self", "self%", "total", "total%");
+  for (p = 0; p < procCount; p++)
+  {
+    order[p] = p;
+  }
+  for (p = 0; p < procCount; p++)
+  {
+    best = p;
+    for (q = p + 1; q < procCount; q++)
+    {
+      if (pf->self[order[q]] > pf->self[order[best]])
+        best = q;
+    }
+    q = order[p];
+    order[p] = order[best];
+    order[best] = q;
+    q = order[p];
+    fprintf(fpout, "%-12s %8ld %6.1f%% %8ld %6.1f%%\n", procNames[q], pf->self[q],
+            pf->self[q] * scale, pf->total[q], pf->total[q] * scale);
+  }
+
+  fprintf(fpout, "\n%5s %8s %7s  source\n", "line", "samples", "%");
+  fp = fopen(source, "r");
+  while (fp != NULL && getline(&text, &cap, fp) != -1)
+  {
+    line++;
+    text[strcspn(text, "\n")] = '\0';
+    if (line < pf->lines && pf->line_samples[line] > 0)
+      fprintf(fpout, "%5d %8ld %6.1f%%  %s\n", line, pf->line_samples[line],
+              pf->line_samples[line] * scale, text);
+    else
+      fprintf(fpout, "%5d %8s %7s  %s\n", line, "", "", text);
+  }
+  if (fp != NULL)
+  {
+    fclose(fp);
+  }
+  free(text);
+  free(order);
+
+  if (folded == NULL)
+  {
+    return;
+  }
+  fp = fopen(folded, "w");
+  if (fp == NULL)
+  {
+    printf("Could not write the folded stacks to %s\n", folded);
+    return;
+  }
+  for (i = 0; i < pf->folded_cap; i++)
+  {
+    if (pf->folded[i].stack != NULL)
+      fprintf(fp, "%s %ld\n", pf->folded[i].stack, pf->folded[i].count);
+  }
+  fclose(fp);
+}
+
+// Runs the program on the interpreter under the profiler, then writes the
+// report. source is the PL/0 source file, for the per-line report.
+void run_profiled(char *source, char *folded)
+{
+  vm_stack *stack = vm_stack_acquire(vm_stack_slots());
+  struct itimerval timer;
+  struct sigaction sa;
+  unsigned rng = 1;
+  profile pf;
+  vm_state vm;
+  int pc;
+
+  if (stack == NULL)
+  {
+    fprintf(fpout, "Could not allocate the data stack\n");
+    return;
+  }
+  memset(&pf, 0, sizeof(pf));
+  for (pc = 0; pc < insIndex; pc++)
+  {
+    if (insLine[pc] >= pf.lines)
+      pf.lines = insLine[pc] + 1;
+  }
+  pf.pc_samples = calloc(insIndex, sizeof(long));
+  pf.line_samples = calloc(pf.lines, sizeof(long));
+  pf.self = calloc(procCount, sizeof(long));
+  pf.total = calloc(procCount, sizeof(long));
+  pf.seen = calloc(procCount, sizeof(bool));
+  pf.stack = malloc(PROFILE_DEPTH * MAX_TYPE_LENGTH + 1);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_handler;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, NULL);
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  vm_init(&vm, stack);
+  while (vm.halted == 0)
+  {
+    rng = rng * 1103515245 + 12345;
+    vm.budget = 1 + (rng >> 16) % PROFILE_SLICE;
+    vm_execute(&vm, ins, insIndex, NULL);
+    if (profileTick && vm.halted == 0)
+    {
+      profileTick = 0;
+      profile_sample(&pf, &vm);
+    }
+  }
+
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  if (vm.halted == -2)
+  {
+    fprintf(fpout, "Stack overflow: the stack has %zu slots, use --stack to enlarge it\n", stack->size);
+  }
+  profile_report(&pf, source, folded);
+
+  for (pc = 0; pc < (int)pf.folded_cap; pc++)
+  {
+    free(pf.folded[pc].stack);
+  }
+  free(pf.folded);
+  free(pf.pc_samples);
+  free(pf.line_samples);
+  free(pf.self);
+  free(pf.total);
+  free(pf.seen);
+  free(pf.stack);
+  vm_stack_release(stack);
+}
+
+/////////////////////////////////// Counters ///////////////////////////////////
+
+// --stats <file> runs the program on the interpreter counting how many times
+// each pc executes, along with the deepest call and the largest sp, and
+// writes them as JSON when the program stops. The counts per opcode and per
+// procedure, the calls and the static link hops taken by vm_base() all
+// follow from the counts per pc.
+
+char *opNames[29] = { "", "lit", "rtn", "lod", "sto", "cal", "inc", "jmp", "jpc",
+                      "write", "read", "halt", "neg", "add", "sub", "mul", "div",
+                      "odd", "mod", "eql", "neq", "lss", "leq", "gtr", "geq",
+                      "lazy", "lcl", "tcl", "mov" };
+
+// Writes the counters of a finished run as JSON
+void stats_write(FILE *fp, vm_state *vm)
+{
+  long long total = 0, hops = 0, calls = 0, op_counts[29] = {0};
+  long long *entered = calloc(procCount, sizeof(long long));
+  long long *executed = calloc(procCount, sizeof(long long));
+  int pc, op, p;
+
+  entered[0] = 1; // main
+  for (pc = 0; pc < insIndex; pc++)
+  {
+    op = ins[pc].op;
+    total += vm->counts[pc];
+    executed[insProc[pc]] += vm->counts[pc];
+    if (op > 0 && op < 29)
+      op_counts[op] += vm->counts[pc];
+    if (op == 3 || op == 4 || op == 5 || (op >= 26 && ins[pc].l > 0))
+      hops += vm->counts[pc] * ins[pc].l;
+    if (op == 5 || op == 26 || op == 27)
+    {
+      calls += vm->counts[pc];
+      p = proc_entry(ins, insIndex, ins[pc].m);
+      if (p >= 0 && p < insIndex)
+        entered[insProc[p]] += vm->counts[pc];
+    }
+  }
+
+  fprintf(fp, "{\n  \"halted\": %d,\n  \"instructions\": %lld,\n", vm->halted, total);
+  fprintf(fp, "  \"calls\": %lld,\n  \"max_call_depth\": %d,\n", calls, vm->max_depth);
+  fprintf(fp, "  \"max_sp\": %d,\n  \"static_link_hops\": %lld,\n", vm->max_sp, hops);
+  fprintf(fp, "  \"opcodes\": {");
+  for (op = 1, p = 0; op < 29; op++)
+  {
+    if (op_counts[op] != 0)
+      fprintf(fp, "%s\n    \"%s\": %lld", (p++ == 0) ? "" : ",", opNames[op], op_counts[op]);
+  }
+  fprintf(fp, "\n  },\n  \"procedures\": [");
+  for (p = 0; p < procCount; p++)
+  {
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"entered\": %lld, \"instructions\": %lld}",
+            (p == 0) ? "" : ",", procNames[p], entered[p], executed[p]);
+  }
+  fprintf(fp, "\n  ],\n  \"pc\": [");
+  for (pc = 0; pc < insIndex; pc++)
+  {
+    fprintf(fp, "%s%s%lld", (pc == 0) ? "" : ",", (pc % 16 == 0) ? "\n    " : " ", vm->counts[pc]);
+  }
+  fprintf(fp, "\n  ]\n}\n");
+
+  free(entered);
+  free(executed);
+}
+
+// Runs the program on the interpreter with counters and writes them to path
+void run_stats(char *path)
+{
+  vm_stack *stack = vm_stack_acquire(vm_stack_slots());
+  vm_state vm;
+  FILE *fp;
+
+  if (stack == NULL)
+  {
+    fprintf(fpout, "Could not allocate the data stack\n");
+    return;
+  }
+  vm_init(&vm, stack);
+  vm.counts = calloc(insIndex, sizeof(long long));
+  vm_execute(&vm, ins, insIndex, NULL);
+  if (vm.halted == -2)
+  {
+    fprintf(fpout, "Stack overflow: the stack has %zu slots, use --stack to enlarge it\n", stack->size);
+  }
+
+  fp = fopen(path, "w");
+  if (fp == NULL)
+  {
+    printf("Could not write the counters to %s\n", path);
+  }
+  else
+  {
+    stats_write(fp, &vm);
+    fclose(fp);
+  }
+  free(vm.counts);
+  vm_stack_release(stack);
+}
+
+// Compares the values written and the final state of two runs of the
+// program, reporting the first difference. name describes the second run.
+bool vm_same(vm_state *vm1, vm_state *vm2, char *name)
+{
+  int i;
+
+  if (vm1->output_len != vm2->output_len)
+  {
+    fprintf(fpout, "JIT check failed: interpreter wrote %d values, %s wrote %d\n",
+            vm1->output_len, name, vm2->output_len);
+    return false;
+  }
+  for (i = 0; i < vm1->output_len; i++)
+  {
+    if (vm1->output[i] != vm2->output[i])
+    {
+      fprintf(fpout, "JIT check failed: value %d is %d on the interpreter, %d on the %s\n",
+              i, vm1->output[i], vm2->output[i], name);
+      return false;
+    }
+  }
+  // An overflow leaves the rest of the state wherever the engine was
+  if (vm1->halted == -2 && vm2->halted == -2)
+  {
+    return true;
+  }
+  if (vm1->pc != vm2->pc || vm1->bp != vm2->bp || vm1->sp != vm2->sp
+      || vm1->halted != vm2->halted
+      || memcmp(vm1->reg, vm2->reg, sizeof(vm1->reg)) != 0
+      || memcmp(vm1->data_stack, vm2->data_stack, vm1->stack->size * sizeof(int)) != 0)
+  {
+    fprintf(fpout, "JIT check failed: final VM state differs on the %s\n", name);
+    return false;
+  }
+  return true;
+}
+
+// Differential test of the engines: runs the program on the interpreter and
+// on the JIT (and with --trace-loops, on the interpreter with loop traces)
+// with the same input, read from stdin up front, and checks that all of them
+// write the same values and finish in the same state
+bool jit_check()
+{
+  size_t slots = vm_stack_slots();
+  int *input = NULL, len = 0, cap = 0, value;
+  vm_state vm1, vm2, vm3;
+  jit_code *jc;
+  bool same = true;
+
+  while (io_read_int(&value))
+  {
+    if (len == cap)
+    {
+      cap = (cap == 0) ? 64 : cap * 2;
+      input = realloc(input, cap * sizeof(int));
+    }
+    input[len++] = value;
+  }
+
+  jc = jit_compile(ins, insIndex);
+  if (jc == NULL)
+  {
+    fprintf(fpout, "JIT check skipped: JIT not available\n");
+    free(input);
+    return true;
+  }
+
+  vm_init(&vm1, vm_stack_acquire(slots));
+  vm_init(&vm2, vm_stack_acquire(slots));
+  vm_init(&vm3, vm_stack_acquire(slots));
+  vm1.capture = vm2.capture = vm3.capture = true;
+  vm1.input = vm2.input = vm3.input = input;
+  vm1.input_len = vm2.input_len = vm3.input_len = len;
+
+  vm_execute(&vm1, ins, insIndex, NULL);
+  vm_execute(&vm2, ins, insIndex, jc);
+  same = vm_same(&vm1, &vm2, "JIT");
+  if (same && traceLoops == true)
+  {
+    vm3.loops = loop_jit_create(insIndex);
+    vm_execute(&vm3, ins, insIndex, NULL);
+    same = vm_same(&vm1, &vm3, "loop traces");
+    loop_jit_free(vm3.loops);
+  }
+  if (same)
+  {
+    fprintf(fpout, "JIT check passed: %d values written by all engines\n", vm1.output_len);
+  }
+
+  jit_free(jc);
+  vm_stack_release(vm1.stack);
+  vm_stack_release(vm2.stack);
+  vm_stack_release(vm3.stack);
+  free(vm1.output);
+  free(vm2.output);
+  free(vm3.output);
+  free(input);
+  return same;
+}
+
+////////////////////////////////// Batch runs //////////////////////////////////
+
+// Reads a --batch input file, one input vector per line. Returns the runs
+// and stores their number in *count, or returns NULL if the file cannot be read.
+batch_run *batch_read(char *path, int *count)
+{
+  FILE *fp = fopen(path, "r");
+  batch_run *runs = NULL;
+  char *line = NULL, *p, *end;
+  size_t line_cap = 0;
+  int n = 0, cap = 0, input_cap;
+  long value;
+
+  if (fp == NULL)
+  {
+    return NULL;
+  }
+  while (getline(&line, &line_cap, fp) != -1)
+  {
+    if (n == cap)
+    {
+      cap = (cap == 0) ? 64 : cap * 2;
+      runs = realloc(runs, cap * sizeof(batch_run));
+    }
+    memset(&runs[n], 0, sizeof(batch_run));
+    input_cap = 0;
+    for (p = line; ; p = end)
+    {
+      value = strtol(p, &end, 10);
+      if (end == p)
+      {
+        break;
+      }
+      if (runs[n].input_len == input_cap)
+      {
+        input_cap = (input_cap == 0) ? 8 : input_cap * 2;
+        runs[n].input = realloc(runs[n].input, input_cap * sizeof(int));
+      }
+      runs[n].input[runs[n].input_len++] = (int)value;
+    }
+    n++;
+  }
+  free(line);
+  fclose(fp);
+  *count = n;
+  return (runs == NULL) ? calloc(1, sizeof(batch_run)) : runs;
+}
+
+// Runs batch inputs until there are none left. Each worker keeps its own VM,
+// stack, output buffer and loop traces and reuses them from run to run; the
+// instructions and the JIT code are shared read only.
+void *batch_worker(void *arg)
+{
+  batch_job *job = arg;
+  vm_stack *stack = vm_stack_acquire(job->slots);
+  loop_jit *loops = NULL;
+  int *output = NULL, output_cap = 0, i, last;
+  batch_run *run;
+  vm_state vm;
+
+  if (job->jc == NULL && traceLoops == true)
+  {
+    loops = loop_jit_create(insIndex);
+  }
+  while (stack != NULL
+         && (i = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED)) < job->n)
+  {
+    last = (i + job->chunk < job->n) ? i + job->chunk : job->n;
+    for (; i < last; i++)
+    {
+      run = &job->runs[i];
+      vm_init(&vm, stack);
+      vm.capture = true;
+      vm.input = run->input;
+      vm.input_len = run->input_len;
+      vm.output = output;
+      vm.output_cap = output_cap;
+      vm.loops = loops;
+      vm_execute(&vm, ins, insIndex, job->jc);
+
+      run->halted = vm.halted;
+      run->output_len = vm.output_len;
+      run->output = malloc((vm.output_len + 1) * sizeof(int));
+      memcpy(run->output, vm.output, vm.output_len * sizeof(int));
+      output = vm.output;
+      output_cap = vm.output_cap;
+      vm_stack_clear(stack);
+    }
+  }
+
+  if (stack != NULL)
+  {
+    vm_stack_release(stack);
+  }
+  if (loops != NULL)
+  {
+    loop_jit_free(loops);
+  }
+  free(output);
+  return NULL;
+}
+
+// Writes the values one run of the program wrote on one line of the output
+// file, followed by the reason it stopped if it did not halt normally
+void print_run(int *output, int len, int halted)
+{
+  int k;
+
+  for (k = 0; k < len; k++)
+  {
+    fprintf(fpout, (k == 0) ? "%d" : " %d", output[k]);
+  }
+  if (halted == -2 || halted == -3)
+  {
+    if (k > 0)
+      fprintf(fpout, " ");
+    fprintf(fpout, (halted == -2) ? "Stack overflow" : "Instruction limit reached");
+  }
+  fprintf(fpout, "\n");
+}
+
+// Runs the program once for every line of the input file on a pool of
+// threads, then writes the values each run wrote on one line of the output
+// file, in input order
+void run_batch(char *path, int threads, bool jit, bool lanes)
+{
+  pthread_t *workers;
+  batch_job job;
+  int i;
+
+  memset(&job, 0, sizeof(job));
+  job.runs = batch_read(path, &job.n);
+  if (job.runs == NULL)
+  {
+    fprintf(fpout, "Could not read batch inputs from %s\n", path);
+    return;
+  }
+  job.slots = vm_stack_slots();
+  job.lanes = lanes;
+  if (jit == true && lanes == false)
+  {
+    job.jc = jit_compile(ins, insIndex);
+    if (job.jc == NULL)
+    {
+      printf("JIT not available, using the interpreter\n");
+    }
+  }
+  if (threads < 1)
+  {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > job.n)
+  {
+    threads = (job.n > 0) ? job.n : 1;
+  }
+  // Hand out runs in chunks so that short runs do not all contend on the
+  // shared counter
+  job.chunk = job.n / (threads * 64);
+  if (job.chunk < 1)
+  {
+    job.chunk = 1;
+  }
+  // Lane workers fill all lanes of every group but the last
+  if (lanes == true)
+  {
+    job.chunk = (job.chunk + LANES - 1) / LANES * LANES;
+  }
+
+  workers = malloc(threads * sizeof(pthread_t));
+  for (i = 0; i < threads; i++)
+  {
+    pthread_create(&workers[i], NULL, lanes ? lane_worker : batch_worker, &job);
+  }
+  for (i = 0; i < threads; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+
+  for (i = 0; i < job.n; i++)
+  {
+    if (job.runs[i].output == NULL)
+      fprintf(fpout, "Could not allocate the data stack\n");
+    else
+      print_run(job.runs[i].output, job.runs[i].output_len, job.runs[i].halted);
+    free(job.runs[i].input);
+    free(job.runs[i].output);
+  }
+
+  jit_free(job.jc);
+  free(workers);
+  free(job.runs);
+}
+
+/////////////////////////////////// Scheduler //////////////////////////////////
+
+// With --sched N, N instances of the program run as green threads on a pool
+// of --threads workers. A worker runs an instance for a slice of --slice
+// instructions and then puts it at the back of the ready queue, so one
+// instance stuck in a loop cannot hold up the others. An instance that has
+// run --max-instructions in total is stopped. The values its reads consume
+// arrive on the program input as pairs "instance value"; a read with nothing
+// to consume parks the instance until a value for it arrives or the input
+// ends, after which reads give 0 as usual.
+
+#define DEFAULT_SLICE 10000
+
+// Appends an instance to the back of the ready queue. The lock must be held.
+void sched_ready(scheduler *sc, sched_task *t)
+{
+  t->state = TASK_READY;
+  t->next = NULL;
+  if (sc->tail == NULL)
+    sc->head = t;
+  else
+    sc->tail->next = t;
+  sc->tail = t;
+  pthread_cond_signal(&sc->wake);
+}
+
+// Moves the values that arrived for an instance into its input. The lock
+// must be held; the instance must not be running.
+void sched_take_input(sched_task *t)
+{
+  vm_state *vm = &t->vm;
+
+  if (t->pending_len == 0)
+  {
+    return;
+  }
+  if (vm->input_len + t->pending_len > t->input_cap)
+  {
+    t->input_cap = 2 * (vm->input_len + t->pending_len);
+    vm->input = realloc(vm->input, t->input_cap * sizeof(int));
+  }
+  memcpy(vm->input + vm->input_len, t->pending, t->pending_len * sizeof(int));
+  vm->input_len += t->pending_len;
+  t->pending_len = 0;
+}
+
+// Stops an instance for good. The lock must be held.
+void sched_finish(scheduler *sc, sched_task *t)
+{
+  t->state = TASK_DONE;
+  if (++sc->done == sc->n)
+  {
+    pthread_cond_broadcast(&sc->wake);
+  }
+}
+
+void *sched_worker(void *arg)
+{
+  scheduler *sc = arg;
+  sched_task *t;
+  long long slice;
+
+  pthread_mutex_lock(&sc->lock);
+  for (;;)
+  {
+    while (sc->head == NULL && sc->done < sc->n)
+    {
+      pthread_cond_wait(&sc->wake, &sc->lock);
+    }
+    if (sc->done == sc->n)
+    {
+      break;
+    }
+    t = sc->head;
+    sc->head = t->next;
+    if (sc->head == NULL)
+    {
+      sc->tail = NULL;
+    }
+    t->state = TASK_RUNNING;
+    sched_take_input(t);
+    t->vm.input_open = sc->input_open;
+    pthread_mutex_unlock(&sc->lock);
+
+    slice = (sc->limit - t->executed < sc->slice) ? sc->limit - t->executed : sc->slice;
+    t->vm.budget = slice;
+    t->vm.blocked = false;
+    vm_execute(&t->vm, ins, insIndex, NULL);
+    t->executed += slice - t->vm.budget;
+
+    pthread_mutex_lock(&sc->lock);
+    if (t->vm.halted != 0)
+    {
+      sched_finish(sc, t);
+    }
+    else if (t->executed >= sc->limit)
+    {
+      t->vm.halted = -3;
+      sched_finish(sc, t);
+    }
+    else if (t->vm.blocked && t->pending_len == 0 && sc->input_open)
+    {
+      t->state = TASK_BLOCKED;
+    }
+    else
+    {
+      sched_ready(sc, t);
+    }
+  }
+  pthread_mutex_unlock(&sc->lock);
+  return NULL;
+}
+
+// Runs count instances of the program under the scheduler, feeding them the
+// program input, then writes the values each one wrote on one line of the
+// output file, in instance order
+void run_sched(int count, int threads, long long slice, long long limit)
+{
+  scheduler sc;
+  pthread_t *workers;
+  sched_task *t;
+  size_t slots = vm_stack_slots();
+  int i, id, value;
+
+  memset(&sc, 0, sizeof(sc));
+  pthread_mutex_init(&sc.lock, NULL);
+  pthread_cond_init(&sc.wake, NULL);
+  sc.n = count;
+  sc.slice = (slice > 0) ? slice : DEFAULT_SLICE;
+  sc.limit = (limit > 0) ? limit : LLONG_MAX;
+  sc.input_open = true;
+  sc.tasks = calloc(count, sizeof(sched_task));
+  for (i = 0; i < count; i++)
+  {
+    t = &sc.tasks[i];
+    t->id = i;
+    vm_init(&t->vm, vm_stack_acquire(slots));
+    t->vm.capture = true;
+    t->vm.output = malloc(sizeof(int));
+    t->vm.output_cap = 1;
+    sched_ready(&sc, t);
+  }
+  if (threads < 1)
+  {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  workers = malloc(threads * sizeof(pthread_t));
+  for (i = 0; i < threads; i++)
+  {
+    pthread_create(&workers[i], NULL, sched_worker, &sc);
+  }
+
+  // Delivering input as it arrives, until it ends or every instance is done
+  while (sc.done < sc.n && io_read_int(&id) && io_read_int(&value))
+  {
+    if (id < 0 || id >= count)
+    {
+      continue;
+    }
+    t = &sc.tasks[id];
+    pthread_mutex_lock(&sc.lock);
+    if (t->pending_len == t->pending_cap)
+    {
+      t->pending_cap = (t->pending_cap == 0) ? 16 : t->pending_cap * 2;
+      t->pending = realloc(t->pending, t->pending_cap * sizeof(int));
+    }
+    t->pending[t->pending_len++] = value;
+    if (t->state == TASK_BLOCKED)
+    {
+      sched_ready(&sc, t);
+    }
+    pthread_mutex_unlock(&sc.lock);
+  }
+  pthread_mutex_lock(&sc.lock);
+  sc.input_open = false;
+  for (i = 0; i < count; i++)
+  {
+    if (sc.tasks[i].state == TASK_BLOCKED)
+      sched_ready(&sc, &sc.tasks[i]);
+  }
+  pthread_mutex_unlock(&sc.lock);
+
+  for (i = 0; i < threads; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    t = &sc.tasks[i];
+    print_run(t->vm.output, t->vm.output_len, t->vm.halted);
+    vm_stack_release(t->vm.stack);
+    free(t->vm.input);
+    free(t->vm.output);
+    free(t->pending);
+  }
+  pthread_mutex_destroy(&sc.lock);
+  pthread_cond_destroy(&sc.wake);
+  free(workers);
+  free(sc.tasks);
+}
+
+////////////////////////////////// SPMD lanes //////////////////////////////////
+
+// With --lanes a batch worker runs LANES inputs at once, one per lane of a
+// vector. Every VM register holds one value per lane and the ALU instructions
+// run as vector operations on the active lanes. Lanes that branch different
+// ways are split: the lanes at the lowest pc run and the others are parked,
+// so split lanes meet again at the first join point after the branch and run
+// together from there. The data stack interleaves the lanes, slot s of lane k
+// being stack[s * LANES + k], so lanes with the same frame layout load and
+// store a whole row at once.
+
+// a where mask is set and b elsewhere. Vectors are not passed by value so
+// that the code does not depend on the vector ABI of the target.
+#define lane_blend(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+// Returns true if every lane of *v is 0
+static inline bool lane_zero(lane_int *v)
+{
+  int k, any = 0;
+
+  for (k = 0; k < LANES; k++)
+  {
+    any |= (*v)[k];
+  }
+  return any == 0;
+}
+
+// Starts count runs (at most LANES) on the lanes of lv
+void lane_init(lane_vm *lv, vm_stack *stack, batch_run *runs, int count)
+{
+  int k;
+
+  memset(lv, 0, sizeof(lane_vm));
+  lv->stack = stack->slots;
+  lv->bp += 1;
+  for (k = 0; k < LANES; k++)
+  {
+    if (k < count)
+    {
+      lv->runs[k] = &runs[k];
+      runs[k].output = malloc(sizeof(int));
+      lv->active |= 1u << k;
+      lv->mask[k] = -1;
+    }
+    else
+    {
+      lv->halted[k] = 1;
+    }
+  }
+  lv->park_min = INT_MAX;
+}
+
+// Chooses the lanes to run next: of the active and parked lanes, those at
+// the lowest pc. lane_pc has to hold the pc of every active lane.
+void lane_schedule(lane_vm *lv)
+{
+  unsigned waiting = lv->active | lv->parked;
+  int k, pc = INT_MAX;
+
+  for (k = 0; k < LANES; k++)
+  {
+    if ((waiting >> k & 1) && lv->lane_pc[k] < pc)
+      pc = lv->lane_pc[k];
+  }
+  lv->pc = pc;
+  lv->active = 0;
+  lv->park_min = INT_MAX;
+  for (k = 0; k < LANES; k++)
+  {
+    lv->mask[k] = 0;
+    if ((waiting >> k & 1) == 0)
+      continue;
+    if (lv->lane_pc[k] == pc)
+    {
+      lv->active |= 1u << k;
+      lv->mask[k] = -1;
+    }
+    else if (lv->lane_pc[k] < lv->park_min)
+    {
+      lv->park_min = lv->lane_pc[k];
+    }
+  }
+  lv->parked = waiting & ~lv->active;
+}
+
+// Stops the active lanes with the given halted status
+void lane_halt(lane_vm *lv, int halted)
+{
+  int k;
+
+  for (k = 0; k < LANES; k++)
+  {
+    if (lv->active >> k & 1)
+      lv->halted[k] = halted;
+  }
+  lv->active = 0;
+  lane_schedule(lv);
+}
+
+// Stores the base pointer l levels down on every active lane in *b
+static inline void lane_base(lane_vm *lv, int l, lane_int *b)
+{
+  int k;
+
+  *b = lv->bp;
+  while (l-- > 0)
+  {
+    for (k = 0; k < LANES; k++)
+    {
+      if (lv->active >> k & 1)
+        (*b)[k] = lv->stack[((*b)[k] + 1) * LANES + k];
+    }
+  }
+}
+
+// Appends a value written by lane k to the output of its run
+void lane_write(lane_vm *lv, int k, int value)
+{
+  batch_run *run = lv->runs[k];
+
+  if (run->output_len + 1 >= lv->output_cap[k])
+  {
+    lv->output_cap[k] = (lv->output_cap[k] == 0) ? 64 : lv->output_cap[k] * 2;
+    run->output = realloc(run->output, lv->output_cap[k] * sizeof(int));
+  }
+  run->output[run->output_len++] = value;
+}
+
+// Executes the program on all lanes until every lane has halted
+void lane_run(lane_vm *lv, instruction *code, int n)
+{
+  lane_int *reg = lv->reg, addr, res;
+  lane_uint a, b;
+  instruction *ir;
+  batch_run *run;
+  unsigned taken;
+  int k, pc, first;
+
+  while (lv->active != 0)
+  {
+    pc = lv->pc;
+    // Parked lanes at this pc join the active ones; parked lanes at an
+    // earlier pc run first while the active ones wait
+    if (lv->parked != 0 && lv->park_min <= pc)
+    {
+      for (k = 0; k < LANES; k++)
+      {
+        if (lv->active >> k & 1)
+          lv->lane_pc[k] = pc;
+      }
+      lane_schedule(lv);
+      continue;
+    }
+    if (pc < 0 || pc >= n)
+    {
+      lane_halt(lv, -1);
+      continue;
+    }
+    ir = &code[pc];
+    lv->pc = pc + 1;
+    a = (lane_uint)reg[ir->l & (MAX_REGISTERS - 1)];
+    b = (lane_uint)reg[ir->m & (MAX_REGISTERS - 1)];
+
+    switch (ir->op)
+    {
+      case 1:
+        reg[ir->r] = lane_blend(lv->mask, (lane_int){0} + ir->m, reg[ir->r]);
+        break;
+
+      // Lanes may return to different call sites
+      case 2:
+        for (k = 0; k < LANES; k++)
+        {
+          if (lv->active >> k & 1)
+          {
+            lv->sp[k] = lv->bp[k] - 1;
+            lv->bp[k] = lv->stack[(lv->sp[k] + 3) * LANES + k];
+            lv->lane_pc[k] = lv->stack[(lv->sp[k] + 4) * LANES + k];
+          }
+        }
+        lane_schedule(lv);
+        break;
+
+      // Lanes whose frames line up load or store a whole row
+      case 3:
+      case 4:
+        lane_base(lv, ir->l, &addr);
+        addr += ir->m;
+        first = __builtin_ctz(lv->active);
+        res = (addr ^ addr[first]) & lv->mask;
+        if (lane_zero(&res))
+        {
+          lane_int *row = (lane_int *)(lv->stack + addr[first] * LANES);
+          if (ir->op == 3)
+            reg[ir->r] = lane_blend(lv->mask, *row, reg[ir->r]);
+          else
+            *row = lane_blend(lv->mask, reg[ir->r], *row);
+        }
+        else
+        {
+          for (k = 0; k < LANES; k++)
+          {
+            if ((lv->active >> k & 1) == 0)
+              continue;
+            if (ir->op == 3)
+              reg[ir->r][k] = lv->stack[addr[k] * LANES + k];
+            else
+              lv->stack[addr[k] * LANES + k] = reg[ir->r][k];
+          }
+        }
+        break;
+
+      case 5:
+        lane_base(lv, ir->l, &addr);
+        for (k = 0; k < LANES; k++)
+        {
+          if ((lv->active >> k & 1) == 0)
+            continue;
+          lv->stack[(lv->sp[k] + 1) * LANES + k] = 0;
+          lv->stack[(lv->sp[k] + 2) * LANES + k] = addr[k];
+          lv->stack[(lv->sp[k] + 3) * LANES + k] = lv->bp[k];
+          lv->stack[(lv->sp[k] + 4) * LANES + k] = pc + 1;
+          lv->bp[k] = lv->sp[k] + 1;
+        }
+        lv->pc = ir->m;
+        break;
+
+      case 26:
+        if (ir->l >= 0)
+          lane_base(lv, ir->l, &addr);
+        for (k = 0; k < LANES; k++)
+        {
+          if ((lv->active >> k & 1) == 0)
+            continue;
+          if (ir->l >= 0)
+            lv->stack[(lv->sp[k] + 2) * LANES + k] = addr[k];
+          lv->stack[(lv->sp[k] + 3) * LANES + k] = lv->bp[k];
+          lv->stack[(lv->sp[k] + 4) * LANES + k] = pc + 1;
+          lv->bp[k] = lv->sp[k] + 1;
+        }
+        lv->sp += lv->mask & code[ir->m].m;
+        lv->pc = ir->m + 1;
+        break;
+
+      case 27:
+        if (ir->l >= 0)
+          lane_base(lv, ir->l, &addr);
+        for (k = 0; k < LANES; k++)
+        {
+          if ((lv->active >> k & 1) == 0)
+            continue;
+          if (ir->l >= 0)
+            lv->stack[(lv->bp[k] + 1) * LANES + k] = addr[k];
+          lv->sp[k] = lv->bp[k] - 1 + code[ir->m].m;
+        }
+        lv->pc = ir->m + 1;
+        break;
+
+      case 6:
+        lv->sp += lv->mask & ir->m;
+        break;
+
+      case 7:
+        lv->pc = ir->m;
+        break;
+
+      // Lanes split when only some of them take the branch
+      case 8:
+        taken = 0;
+        for (k = 0; k < LANES; k++)
+        {
+          if ((lv->active >> k & 1) && reg[ir->r][k] == 0)
+            taken |= 1u << k;
+        }
+        if (taken == lv->active)
+        {
+          lv->pc = ir->m;
+        }
+        else if (taken != 0)
+        {
+          for (k = 0; k < LANES; k++)
+          {
+            if (lv->active >> k & 1)
+              lv->lane_pc[k] = (taken >> k & 1) ? ir->m : pc + 1;
+          }
+          lane_schedule(lv);
+        }
+        break;
+
+      case 9:
+        for (k = 0; k < LANES; k++)
+        {
+          if (lv->active >> k & 1)
+            lane_write(lv, k, reg[ir->r][k]);
+        }
+        break;
+
+      case 10:
+        for (k = 0; k < LANES; k++)
+        {
+          if ((lv->active >> k & 1) == 0)
+            continue;
+          run = lv->runs[k];
+          reg[ir->r][k] = (lv->input_pos[k] < run->input_len) ? run->input[lv->input_pos[k]++] : 0;
+        }
+        break;
+
+      case 11:
+        lane_halt(lv, 1);
+        break;
+
+      case 12:
+        reg[ir->r] = lane_blend(lv->mask, (lane_int)(0u - (lane_uint)reg[ir->r]), reg[ir->r]);
+        break;
+
+      case 28:
+        reg[ir->r] = lane_blend(lv->mask, (lane_int)a, reg[ir->r]);
+        break;
+
+      // Division only runs on the active lanes, which the other lanes'
+      // divisors cannot affect
+      case 16:
+      case 18:
+        for (k = 0; k < LANES; k++)
+        {
+          if (lv->active >> k & 1)
+            reg[ir->r][k] = vm_alu(ir->op, reg[ir->l][k], reg[ir->m][k]);
+        }
+        break;
+
+      case 13:
+      case 14:
+      case 15:
+      case 17:
+      case 19:
+      case 20:
+      case 21:
+      case 22:
+      case 23:
+      case 24:
+        switch (ir->op)
+        {
+          case 13: res = (lane_int)(a + b); break;
+          case 14: res = (lane_int)(a - b); break;
+          case 15: res = (lane_int)(a * b); break;
+          case 17: res = (lane_int)a % 2; break;
+          case 19: res = -((lane_int)a == (lane_int)b); break;
+          case 20: res = -((lane_int)a != (lane_int)b); break;
+          case 21: res = -((lane_int)a < (lane_int)b); break;
+          case 22: res = -((lane_int)a <= (lane_int)b); break;
+          case 23: res = -((lane_int)a > (lane_int)b); break;
+          default: res = -((lane_int)a >= (lane_int)b); break;
+        }
+        reg[ir->r] = lane_blend(lv->mask, res, reg[ir->r]);
+        break;
+
+      default:
+        printf("\tInvalid opcode\n");
+    }
+  }
+
+  for (k = 0; k < LANES; k++)
+  {
+    if (lv->runs[k] != NULL)
+      lv->runs[k]->halted = lv->halted[k];
+  }
+}
+
+// Runs lane_run with stack overflow detection. Returns false on overflow.
+bool lane_execute(lane_vm *lv, instruction *code, int n)
+{
+  sigjmp_buf env;
+
+  if (sigsetjmp(env, 1) != 0)
+  {
+    vm_overflow_jmp = NULL;
+    return false;
+  }
+  vm_overflow_jmp = &env;
+  lane_run(lv, code, n);
+  vm_overflow_jmp = NULL;
+  return true;
+}
+
+// Runs batch inputs LANES at a time. A group of lanes that overflows the
+// stack is run again on the interpreter one input at a time, so only the
+// inputs that really overflow report it.
+void *lane_worker(void *arg)
+{
+  batch_job *job = arg;
+  vm_stack *stack = vm_stack_acquire(job->slots * LANES), *one;
+  lane_vm lv;
+  vm_state vm;
+  int i, k, last, count;
+
+  while (stack != NULL
+         && (i = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED)) < job->n)
+  {
+    last = (i + job->chunk < job->n) ? i + job->chunk : job->n;
+    for (; i < last; i += LANES)
+    {
+      count = (last - i < LANES) ? last - i : LANES;
+      lane_init(&lv, stack, &job->runs[i], count);
+      if (lane_execute(&lv, ins, insIndex) == false)
+      {
+        one = vm_stack_acquire(job->slots);
+        for (k = i; k < i + count && one != NULL; k++)
+        {
+          free(job->runs[k].output);
+          vm_init(&vm, one);
+          vm.capture = true;
+          vm.input = job->runs[k].input;
+          vm.input_len = job->runs[k].input_len;
+          vm.output = malloc(sizeof(int));
+          vm.output_cap = 1;
+          vm_execute(&vm, ins, insIndex, NULL);
+          job->runs[k].output = vm.output;
+          job->runs[k].output_len = vm.output_len;
+          job->runs[k].halted = vm.halted;
+          vm_stack_clear(one);
+        }
+        if (one != NULL)
+          vm_stack_release(one);
+      }
+      vm_stack_clear(stack);
+    }
+  }
+
+  if (stack != NULL)
+  {
+    vm_stack_release(stack);
+  }
+  return NULL;
+}
+
+void print_stack(int* as_code, int i)
+{
+    int* op, r, l, m;
+    fprintf(fpout, "Line \t OP \t R \t L \t M\n");
+    int lines = i/4;
+    int k =0;
+    for(int j=0; j<=lines; j++)
+    {
+        fprintf(fpout, "%d \t", j); // line
+        switch (as_code[k])
+        {
+          case 1:
+            fprintf(fpout, "lit \t");
+            break;
+
+          case 2:
+            fprintf(fpout, "rtn \t");
+            break;
+
+          case 3:
+            fprintf(fpout, "lod \t");
+            break;
+
+          case 4:
+            fprintf(fpout, "sto \t");
+            break;
+
+          case 5:
+            fprintf(fpout, "cal \t");
+            break;
+
+          case 6:
+            fprintf(fpout, "inc \t");
+            break;
+
+          case 7:
+            fprintf(fpout, "jmp \t");
+            break;
+
+          case 8:
+            fprintf(fpout, "jpc \t");
+            break;
+
+          case 9:
+            fprintf(fpout, "sio \t");
+            break;
+
+          case 10:
+            fprintf(fpout, "sio \t");
+            break;
+
+          case 11:
+            fprintf(fpout, "sio \t");
+            break;
+
+          case 12:
+            fprintf(fpout, "neg \t");
+            break;
+
+          case 13:
+            fprintf(fpout, "add \t");
+            break;
+
+          case 14:
+            fprintf(fpout, "sub \t");
+            break;
+
+          case 15:
+            fprintf(fpout, "mul \t");
+            break;
+
+          case 16:
+            fprintf(fpout, "div \t");
+            break;
+
+          case 17:
+            fprintf(fpout, "odd \t");
+            break;
+
+          case 18:
+            fprintf(fpout, "mod \t");
+            break;
+
+          case 19:
+            fprintf(fpout, "eql \t");
+            break;
+
+          case 20:
+            fprintf(fpout, "neq \t");
+            break;
+
+          case 21:
+            fprintf(fpout, "lss \t");
+            break;
 
           case 22:
             fprintf(fpout, "leq \t");
@@ -1817,6 +8851,18 @@ void print_stack(int* as_code, int i)
           case 24:
             fprintf(fpout, "geq \t");
             break;
+
+          case 26:
+            fprintf(fpout, "lcl \t");
+            break;
+
+          case 27:
+            fprintf(fpout, "tcl \t");
+            break;
+
+          case 28:
+            fprintf(fpout, "mov \t");
+            break;
         }
         k++;
         fprintf(fpout, "%d \t", as_code[k]); // r
@@ -0,0 +1,42 @@
+// Renders a binary trace written with -v --trace-file into the text that -v
+// prints without it, or prints the machine's state after one step of it.
+//
+// To build: gcc -O2 -pthread -o render_trace tools/render_trace.c
+// To use:   ./render_trace <trace file> [output file]
+//           ./render_trace --step <n> <trace file>
+
+#define HW4_NO_MAIN
+#include "../hw4compiler.c"
+
+int main(int argc, char **argv)
+{
+  if (argc == 4 && strcmp(argv[1], "--step") == 0)
+  {
+    fpout = stdout;
+    if (trace_state_at(argv[3], strtoull(argv[2], NULL, 10)) == false)
+    {
+      printf("%s is not a trace file or has no step %s\n", argv[3], argv[2]);
+      return 1;
+    }
+    return 0;
+  }
+  if (argc < 2 || argc > 3)
+  {
+    printf("To use: %s <trace file> [output file]\n", argv[0]);
+    printf("        %s --step <n> <trace file>\n", argv[0]);
+    return 1;
+  }
+  fpout = (argc == 3) ? fopen(argv[2], "w") : stdout;
+  if (fpout == NULL)
+  {
+    printf("Could not open %s\n", argv[2]);
+    return 1;
+  }
+  if (trace_render_file(argv[1]) == false)
+  {
+    printf("%s is not a trace file\n", argv[1]);
+    return 1;
+  }
+  fclose(fpout);
+  return 0;
+}